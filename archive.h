@@ -0,0 +1,353 @@
+#pragma once
+/*
+ * Lists the members of zip, tar and cpio archives.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * The archive is in memory. Each member is described by the offset and size
+ * of its data in the archive, so the members can be searched in any order.
+ * Compressed zip members are decompressed by the caller, with decompress.h.
+ *
+ * Only regular files are listed, directories, links and devices are skipped.
+ * Zip files are read from the central directory, tar and cpio files by
+ * walking the headers, a truncated last member is clipped.
+ */
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include "decompress.h"
+
+enum ArchiveType {
+    NOT_AN_ARCHIVE,
+    ZIP_ARCHIVE,
+    TAR_ARCHIVE,
+    CPIO_ARCHIVE,
+};
+
+struct archivemember {
+    std::string name;
+    uint64_t offset;            // of the member data, in the archive
+    uint64_t size;              // the size of the stored data
+    Compression compression;    // for zip members, how the data is stored
+    std::string problem;        // why the member can not be searched, like 'encrypted'
+};
+
+static uint16_t archive_get16le(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+static uint32_t archive_get32le(const uint8_t *p)
+{
+    return archive_get16le(p) | (uint32_t(archive_get16le(p + 2)) << 16);
+}
+static uint64_t archive_get64le(const uint8_t *p)
+{
+    return archive_get32le(p) | (uint64_t(archive_get32le(p + 4)) << 32);
+}
+
+// parses an octal or hex number of fixed width, as used in tar and cpio headers.
+// returns UINT64_MAX when it contains other characters.
+static uint64_t archive_number(const uint8_t *p, size_t n, int base)
+{
+    uint64_t value = 0;
+    size_t i = 0;
+    while (i < n && p[i] == ' ')
+        i++;
+    for ( ; i < n && p[i] && p[i] != ' ' ; i++) {
+        int digit = p[i] >= '0' && p[i] <= '9' ? p[i] - '0'
+                  : base == 16 && (p[i] | 0x20) >= 'a' && (p[i] | 0x20) <= 'f' ? (p[i] | 0x20) - 'a' + 10
+                  : base;
+        if (digit >= base)
+            return UINT64_MAX;
+        value = value * base + digit;
+    }
+    return value;
+}
+
+static bool tarchecksumvalid(const uint8_t *h)
+{
+    auto expected = archive_number(h + 148, 8, 8);
+    if (expected == UINT64_MAX)
+        return false;
+    uint64_t sum = 0;
+    for (int i = 0 ; i < 512 ; i++)
+        sum += i >= 148 && i < 156 ? ' ' : h[i];
+    return sum == expected;
+}
+
+static ArchiveType detectarchive(const uint8_t *p, size_t n)
+{
+    if (n >= 4 && (memcmp(p, "PK\3\4", 4) == 0 || memcmp(p, "PK\5\6", 4) == 0))
+        return ZIP_ARCHIVE;
+    if (n >= 6 && (memcmp(p, "070701", 6) == 0 || memcmp(p, "070702", 6) == 0 || memcmp(p, "070707", 6) == 0))
+        return CPIO_ARCHIVE;
+    // old tar files have no magic, only the header checksum
+    if (n >= 512 && p[0] && tarchecksumvalid(p))
+        return TAR_ARCHIVE;
+    return NOT_AN_ARCHIVE;
+}
+
+static const char *archivename(ArchiveType t)
+{
+    switch(t) {
+        case NOT_AN_ARCHIVE: return "none";
+        case ZIP_ARCHIVE: return "zip";
+        case TAR_ARCHIVE: return "tar";
+        case CPIO_ARCHIVE: return "cpio";
+    }
+    return "?";
+}
+
+/*
+ *  the members of a zip file, from the central directory.
+ */
+static std::vector<archivemember> zipmembers(const uint8_t *p, size_t size)
+{
+    // the end of central directory record is followed by a comment of at most 64K.
+    size_t eocd = SIZE_MAX;
+    if (size >= 22) {
+        size_t lowest = size - 22 > 0xffff ? size - 22 - 0xffff : 0;
+        for (size_t i = size - 22 + 1 ; i-- > lowest ; )
+            if (memcmp(p + i, "PK\5\6", 4) == 0) {
+                eocd = i;
+                break;
+            }
+    }
+    if (eocd == SIZE_MAX)
+        throw std::runtime_error("zip: no central directory");
+
+    uint64_t nentries = archive_get16le(p + eocd + 10);
+    uint64_t dirsize = archive_get32le(p + eocd + 12);
+    uint64_t dirofs = archive_get32le(p + eocd + 16);
+    uint64_t dirend = eocd;
+
+    // zip64: the locator, just before the end record, points to the zip64 end record.
+    if (eocd >= 20 && memcmp(p + eocd - 20, "PK\6\7", 4) == 0) {
+        auto ofs = archive_get64le(p + eocd - 20 + 8);
+        if (ofs <= size && size - ofs >= 56 && memcmp(p + ofs, "PK\6\6", 4) == 0) {
+            nentries = archive_get64le(p + ofs + 32);
+            dirsize = archive_get64le(p + ofs + 40);
+            dirofs = archive_get64le(p + ofs + 48);
+            dirend = ofs;
+        }
+    }
+    // data prepended to the zip, like a self extractor, shifts all offsets.
+    // the offsets and sizes are checked by subtracting, so corrupt 64 bit values can not wrap.
+    if (dirofs > dirend || dirsize > dirend - dirofs)
+        throw std::runtime_error("zip: corrupt central directory");
+    uint64_t bias = dirend - dirofs - dirsize;
+
+    std::vector<archivemember> list;
+    uint64_t pos = dirofs + bias;
+    for (uint64_t n = 0 ; n < nentries ; n++) {
+        if (pos > dirend || dirend - pos < 46 || memcmp(p + pos, "PK\1\2", 4) != 0)
+            throw std::runtime_error("zip: corrupt central directory");
+        auto e = p + pos;
+        uint16_t flags = archive_get16le(e + 8);
+        uint16_t method = archive_get16le(e + 10);
+        uint64_t csize = archive_get32le(e + 20);
+        uint32_t usize = archive_get32le(e + 24);
+        size_t namelen = archive_get16le(e + 28);
+        size_t extralen = archive_get16le(e + 30);
+        size_t commentlen = archive_get16le(e + 32);
+        uint64_t localofs = archive_get32le(e + 42);
+        if (dirend - pos - 46 < namelen + extralen)
+            throw std::runtime_error("zip: corrupt central directory");
+        std::string name((const char*)e + 46, namelen);
+
+        // the zip64 extra field has the 64 bit values for the fields set to 0xffffffff
+        auto x = e + 46 + namelen;
+        for (size_t i = 0 ; i + 4 <= extralen ; i += 4 + archive_get16le(x + i + 2)) {
+            if (archive_get16le(x + i) != 1)
+                continue;
+            auto v = x + i + 4;
+            auto vend = v + std::min<size_t>(archive_get16le(x + i + 2), extralen - i - 4);
+            if (usize == 0xffffffff)
+                v += 8;
+            if (csize == 0xffffffff && v + 8 <= vend) {
+                csize = archive_get64le(v);
+                v += 8;
+            }
+            if (localofs == 0xffffffff && v + 8 <= vend)
+                localofs = archive_get64le(v);
+            break;
+        }
+        pos += 46 + namelen + extralen + commentlen;
+
+        if (name.empty() || name.back() == '/')
+            continue;
+
+        archivemember m = { name, 0, csize, NOT_COMPRESSED, "" };
+        if (localofs > size - bias || size - bias - localofs < 30 || memcmp(p + localofs + bias, "PK\3\4", 4) != 0) {
+            m.problem = "missing local header";
+            list.push_back(m);
+            continue;
+        }
+        auto h = localofs + bias;
+        m.offset = h + 30 + archive_get16le(p + h + 26) + archive_get16le(p + h + 28);
+        if (m.offset > size)
+            m.offset = size;
+        m.size = std::min<uint64_t>(csize, size - m.offset);
+
+        if (flags & 1)
+            m.problem = "encrypted";
+        else if (method == 0)
+            m.compression = NOT_COMPRESSED;
+        else if (method == 8)
+            m.compression = DEFLATE_COMPRESSED;
+        else if (method == 93)
+            m.compression = ZSTD_COMPRESSED;
+        else if (method == 95)
+            m.compression = XZ_COMPRESSED;
+        else
+            m.problem = "unsupported compression method " + std::to_string(method);
+        list.push_back(m);
+    }
+    return list;
+}
+
+/*
+ *  the members of a tar file, including the GNU and pax long names.
+ */
+static std::vector<archivemember> tarmembers(const uint8_t *p, size_t size)
+{
+    std::vector<archivemember> list;
+    std::string longname;       // from a preceding GNU 'L' or pax 'x' header
+    uint64_t pos = 0;
+    while (pos <= size && size - pos >= 512) {
+        auto h = p + pos;
+        if (std::all_of(h, h + 512, [](uint8_t c) { return c == 0; }))
+            break;
+        if (!tarchecksumvalid(h))
+            throw std::runtime_error("tar: corrupt header at offset " + std::to_string(pos));
+
+        // GNU tar stores large sizes in base 256
+        uint64_t filesize = 0;
+        if (h[124] & 0x80) {
+            for (int i = 125 ; i < 136 ; i++)
+                filesize = (filesize << 8) | h[i];
+        }
+        else {
+            filesize = archive_number(h + 124, 12, 8);
+            if (filesize == UINT64_MAX)
+                throw std::runtime_error("tar: corrupt header at offset " + std::to_string(pos));
+        }
+        uint64_t dataofs = pos + 512;
+        uint64_t datasize = std::min<uint64_t>(filesize, size - dataofs);
+        char type = h[156];
+
+        if (type == 'L') {
+            longname.assign((const char*)p + dataofs, strnlen((const char*)p + dataofs, datasize));
+        }
+        else if (type == 'x') {
+            // pax records: "<length> <key>=<value>\n"
+            auto r = (const char*)p + dataofs;
+            auto rend = r + datasize;
+            while (r < rend) {
+                char *end;
+                auto len = strtoul(r, &end, 10);
+                if (len == 0 || len > size_t(rend - r) || *end != ' ')
+                    break;
+                std::string rec((const char*)end + 1, r + len - 1);
+                if (rec.compare(0, 5, "path=") == 0)
+                    longname = rec.substr(5);
+                r += len;
+            }
+        }
+        else {
+            std::string name;
+            if (!longname.empty()) {
+                name = longname;
+                longname.clear();
+            }
+            else {
+                name.assign((const char*)h, strnlen((const char*)h, 100));
+                // ustar splits long names in a prefix and a name
+                if (memcmp(h + 257, "ustar", 5) == 0 && h[345])
+                    name = std::string((const char*)h + 345, strnlen((const char*)h + 345, 155)) + "/" + name;
+            }
+            if (type == '0' || type == 0 || type == '7')
+                list.push_back(archivemember{ name, dataofs, datasize, NOT_COMPRESSED, "" });
+        }
+        // links and directories have no data, their size field may be nonzero
+        if (type == '1' || type == '2' || type == '5')
+            filesize = 0;
+        // the truncated last member, a corrupt base 256 size could wrap the offset.
+        if (filesize > size - dataofs)
+            break;
+        pos = dataofs + ((filesize + 511) & ~uint64_t(511));
+    }
+    return list;
+}
+
+/*
+ *  the members of a cpio file, in the 'newc' or 'odc' format.
+ */
+static std::vector<archivemember> cpiomembers(const uint8_t *p, size_t size)
+{
+    std::vector<archivemember> list;
+    uint64_t pos = 0;
+    while (pos <= size && size - pos >= 6) {
+        auto h = p + pos;
+        uint64_t mode, filesize, namesize, nameofs, dataofs;
+        if (memcmp(h, "070701", 6) == 0 || memcmp(h, "070702", 6) == 0) {
+            if (size - pos < 110) {
+                if (pos == 0)
+                    throw std::runtime_error("cpio: truncated header");
+                break;
+            }
+            mode = archive_number(h + 14, 8, 16);
+            filesize = archive_number(h + 54, 8, 16);
+            namesize = archive_number(h + 94, 8, 16);
+            nameofs = pos + 110;
+            // the name and the data are aligned to 4 bytes
+            dataofs = (nameofs + namesize + 3) & ~uint64_t(3);
+        }
+        else if (memcmp(h, "070707", 6) == 0) {
+            if (size - pos < 76) {
+                if (pos == 0)
+                    throw std::runtime_error("cpio: truncated header");
+                break;
+            }
+            mode = archive_number(h + 18, 6, 8);
+            namesize = archive_number(h + 59, 6, 8);
+            filesize = archive_number(h + 65, 11, 8);
+            nameofs = pos + 76;
+            dataofs = nameofs + namesize;
+        }
+        else {
+            throw std::runtime_error("cpio: corrupt header at offset " + std::to_string(pos));
+        }
+        if (mode == UINT64_MAX || filesize == UINT64_MAX || namesize == UINT64_MAX || dataofs > size)
+            throw std::runtime_error("cpio: corrupt header at offset " + std::to_string(pos));
+
+        std::string name((const char*)p + nameofs, strnlen((const char*)p + nameofs, namesize));
+        if (name == "TRAILER!!!")
+            break;
+        if ((mode & 0170000) == 0100000)
+            list.push_back(archivemember{ name, dataofs, std::min<uint64_t>(filesize, size - dataofs), NOT_COMPRESSED, "" });
+
+        pos = dataofs + filesize;
+        if (h[5] != '7')
+            pos = (pos + 3) & ~uint64_t(3);
+    }
+    return list;
+}
+
+/*
+ *  lists the regular files in the archive [p, p+size).
+ *  throws when the archive structure is corrupt.
+ */
+static std::vector<archivemember> listmembers(const uint8_t *p, size_t size, ArchiveType type)
+{
+    switch(type) {
+        case ZIP_ARCHIVE: return zipmembers(p, size);
+        case TAR_ARCHIVE: return tarmembers(p, size);
+        case CPIO_ARCHIVE: return cpiomembers(p, size);
+        case NOT_AN_ARCHIVE: break;
+    }
+    return {};
+}
@@ -0,0 +1,599 @@
+#pragma once
+/*
+ * Decompresses gzip, xz, zstd and lz4 files, ahead of the searcher.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * The format is detected from the magic bytes. The decompressed data is
+ * produced in blocks, with the same interface as blockreader, so it is searched
+ * by the sequential search, which finds matches crossing block boundaries.
+ *
+ * Files consisting of independent frames, like bgzip files, or zstd files written
+ * by pzstd, are decompressed on several threads. Other files are
+ * decompressed by a single thread, while the previous block is being searched.
+ *
+ * Each format is only available when its library is: WITH_ZLIB, WITH_LZMA,
+ * WITH_ZSTD and WITH_LZ4 are set by the build.
+ */
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <unistd.h>
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef WITH_LZMA
+#include <lzma.h>
+#endif
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_LZ4
+#include <lz4frame.h>
+#endif
+
+enum Compression {
+    NOT_COMPRESSED,
+    GZIP_COMPRESSED,
+    XZ_COMPRESSED,
+    ZSTD_COMPRESSED,
+    LZ4_COMPRESSED,
+    DEFLATE_COMPRESSED,     // raw deflate, as used in zip files. never detected.
+};
+
+static Compression detectcompression(const uint8_t *p, size_t n)
+{
+    if (n >= 3 && p[0] == 0x1f && p[1] == 0x8b && p[2] == 8)
+        return GZIP_COMPRESSED;
+    if (n >= 6 && memcmp(p, "\xfd" "7zXZ\0", 6) == 0)
+        return XZ_COMPRESSED;
+    if (n >= 4 && memcmp(p, "\x28\xb5\x2f\xfd", 4) == 0)
+        return ZSTD_COMPRESSED;
+    // pzstd starts with a skippable frame
+    if (n >= 4 && (p[0] & 0xf0) == 0x50 && memcmp(p + 1, "\x2a\x4d\x18", 3) == 0)
+        return ZSTD_COMPRESSED;
+    if (n >= 4 && memcmp(p, "\x04\x22\x4d\x18", 4) == 0)
+        return LZ4_COMPRESSED;
+    return NOT_COMPRESSED;
+}
+
+static const char *compressionname(Compression c)
+{
+    switch(c) {
+        case NOT_COMPRESSED: return "none";
+        case GZIP_COMPRESSED: return "gzip";
+        case XZ_COMPRESSED: return "xz";
+        case ZSTD_COMPRESSED: return "zstd";
+        case LZ4_COMPRESSED: return "lz4";
+        case DEFLATE_COMPRESSED: return "deflate";
+    }
+    return "?";
+}
+
+/*
+ *  decodes a compressed stream, in pieces.
+ */
+class streamdecoder {
+public:
+    virtual ~streamdecoder() { }
+
+    /*
+     *  decodes from [in, inend) to [out, outend), advancing 'in' and 'out'.
+     *  'last' is set when [in, inend) contains the end of the compressed data.
+     *  returns true at the end of a frame, or gzip member.
+     *  throws on corrupt data.
+     */
+    virtual bool decode(const char*& in, const char *inend, char*& out, char *outend, bool last) = 0;
+
+    // prepare for the next frame, after decode returned true.
+    virtual void restart() { }
+};
+
+#ifdef WITH_ZLIB
+class zlibdecoder : public streamdecoder {
+    z_stream zs;
+public:
+    // windowbits: 15+16 for gzip, -15 for raw deflate.
+    zlibdecoder(int windowbits)
+    {
+        memset(&zs, 0, sizeof(zs));
+        if (inflateInit2(&zs, windowbits) != Z_OK)
+            throw std::runtime_error("inflateInit failed");
+    }
+    ~zlibdecoder()
+    {
+        inflateEnd(&zs);
+    }
+    bool decode(const char*& in, const char *inend, char*& out, char *outend, bool /*last*/) override
+    {
+        zs.next_in = (Bytef*)in;
+        zs.avail_in = inend - in;
+        zs.next_out = (Bytef*)out;
+        zs.avail_out = outend - out;
+        int r = inflate(&zs, Z_NO_FLUSH);
+        in = (const char*)zs.next_in;
+        out = (char*)zs.next_out;
+        if (r == Z_STREAM_END)
+            return true;
+        if (r != Z_OK && r != Z_BUF_ERROR)
+            throw std::runtime_error(std::string("inflate: ") + (zs.msg ? zs.msg : "error"));
+        return false;
+    }
+    void restart() override
+    {
+        inflateReset(&zs);
+    }
+};
+#endif
+
+#ifdef WITH_LZMA
+class lzmadecoder : public streamdecoder {
+    lzma_stream strm = LZMA_STREAM_INIT;
+public:
+    lzmadecoder()
+    {
+        if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+            throw std::runtime_error("lzma_stream_decoder failed");
+    }
+    ~lzmadecoder()
+    {
+        lzma_end(&strm);
+    }
+    bool decode(const char*& in, const char *inend, char*& out, char *outend, bool last) override
+    {
+        strm.next_in = (const uint8_t*)in;
+        strm.avail_in = inend - in;
+        strm.next_out = (uint8_t*)out;
+        strm.avail_out = outend - out;
+        auto r = lzma_code(&strm, last ? LZMA_FINISH : LZMA_RUN);
+        in = (const char*)strm.next_in;
+        out = (char*)strm.next_out;
+        if (r == LZMA_STREAM_END)
+            return true;
+        if (r != LZMA_OK && r != LZMA_BUF_ERROR)
+            throw std::runtime_error("lzma_code: error " + std::to_string(r));
+        return false;
+    }
+};
+#endif
+
+#ifdef WITH_ZSTD
+class zstddecoder : public streamdecoder {
+    ZSTD_DStream *ds;
+public:
+    zstddecoder()
+        : ds(ZSTD_createDStream())
+    {
+        if (!ds)
+            throw std::runtime_error("ZSTD_createDStream failed");
+    }
+    ~zstddecoder()
+    {
+        ZSTD_freeDStream(ds);
+    }
+    bool decode(const char*& in, const char *inend, char*& out, char *outend, bool last) override
+    {
+        ZSTD_inBuffer ib = { in, size_t(inend - in), 0 };
+        ZSTD_outBuffer ob = { out, size_t(outend - out), 0 };
+        auto r = ZSTD_decompressStream(ds, &ob, &ib);
+        if (ZSTD_isError(r))
+            throw std::runtime_error(std::string("zstd: ") + ZSTD_getErrorName(r));
+        in += ib.pos;
+        out += ob.pos;
+        // the next call starts a new frame
+        return r == 0;
+    }
+};
+#endif
+
+#ifdef WITH_LZ4
+class lz4decoder : public streamdecoder {
+    LZ4F_dctx *dctx = nullptr;
+public:
+    lz4decoder()
+    {
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+            throw std::runtime_error("LZ4F_createDecompressionContext failed");
+    }
+    ~lz4decoder()
+    {
+        LZ4F_freeDecompressionContext(dctx);
+    }
+    bool decode(const char*& in, const char *inend, char*& out, char *outend, bool last) override
+    {
+        size_t insize = inend - in;
+        size_t outsize = outend - out;
+        auto r = LZ4F_decompress(dctx, out, &outsize, in, &insize, NULL);
+        if (LZ4F_isError(r))
+            throw std::runtime_error(std::string("lz4: ") + LZ4F_getErrorName(r));
+        in += insize;
+        out += outsize;
+        // the next call starts a new frame
+        return r == 0;
+    }
+};
+#endif
+
+/*
+ *  returns a decoder for 'c', or NULL when findstr was built without support for it.
+ */
+static std::unique_ptr<streamdecoder> makedecoder(Compression c)
+{
+    switch(c) {
+#ifdef WITH_ZLIB
+        case GZIP_COMPRESSED: return std::make_unique<zlibdecoder>(15 + 16);
+        case DEFLATE_COMPRESSED: return std::make_unique<zlibdecoder>(-15);
+#endif
+#ifdef WITH_LZMA
+        case XZ_COMPRESSED: return std::make_unique<lzmadecoder>();
+#endif
+#ifdef WITH_ZSTD
+        case ZSTD_COMPRESSED: return std::make_unique<zstddecoder>();
+#endif
+#ifdef WITH_LZ4
+        case LZ4_COMPRESSED: return std::make_unique<lz4decoder>();
+#endif
+        default:
+            return NULL;
+    }
+}
+
+static bool compressionsupported(Compression c)
+{
+    return c != NOT_COMPRESSED && makedecoder(c) != NULL;
+}
+
+/*
+ *  decompresses [p, p+size) in memory, at most 'maxsize' bytes.
+ *  Used for the start of a stream, or for data which is needed at once, like an archive.
+ */
+static std::vector<char> decompressdata(const char *p, size_t size, Compression c, size_t maxsize)
+{
+    auto decoder = makedecoder(c);
+    if (!decoder)
+        throw std::runtime_error(std::string("not built with ") + compressionname(c) + " support");
+    std::vector<char> data;
+    auto in = p;
+    auto inend = p + size;
+    while (data.size() < maxsize) {
+        size_t have = data.size();
+        data.resize(std::min(maxsize, std::max<size_t>(2 * have, 0x10000)));
+        auto out = data.data() + have;
+        auto before = in;
+        bool endofframe = decoder->decode(in, inend, out, data.data() + data.size(), true);
+        bool progress = in != before || out != data.data() + have;
+        data.resize(out - data.data());
+        if (endofframe) {
+            if (detectcompression((const uint8_t*)in, inend - in) != c)
+                break;
+            decoder->restart();
+        }
+        else if (!progress) {
+            throw std::runtime_error(std::string("unexpected end of ") + compressionname(c) + " data");
+        }
+    }
+    return data;
+}
+
+/*
+ *  returns the sizes of the independent frames of a compressed file,
+ *  or nothing when the file can not be split.
+ */
+static std::vector<size_t> splitframes(const uint8_t *p, size_t size, Compression c)
+{
+    std::vector<size_t> frames;
+    size_t pos = 0;
+    if (c == GZIP_COMPRESSED) {
+        // bgzip: each member has a 'BC' extra field with the member size.
+        while (pos < size) {
+            auto h = p + pos;
+            if (size - pos < 18 || h[0] != 0x1f || h[1] != 0x8b || !(h[3] & 4))
+                return {};
+            size_t xlen = h[10] | (h[11] << 8);
+            if (size - pos < 12 + xlen)
+                return {};
+            size_t bsize = 0;
+            for (size_t x = 12 ; x + 4 <= 12 + xlen ; x += 4 + (h[x + 2] | (h[x + 3] << 8))) {
+                if (h[x] == 'B' && h[x + 1] == 'C' && h[x + 2] == 2 && x + 6 <= 12 + xlen) {
+                    bsize = (h[x + 4] | (h[x + 5] << 8)) + 1;
+                    break;
+                }
+            }
+            if (bsize == 0 || bsize > size - pos)
+                return {};
+            frames.push_back(bsize);
+            pos += bsize;
+        }
+    }
+#ifdef WITH_ZSTD
+    else if (c == ZSTD_COMPRESSED) {
+        while (pos < size) {
+            auto n = ZSTD_findFrameCompressedSize(p + pos, size - pos);
+            if (ZSTD_isError(n))
+                return {};
+            frames.push_back(n);
+            pos += n;
+        }
+    }
+#endif
+    if (frames.size() < 2)
+        return {};
+    return frames;
+}
+
+/*
+ *  Produces the decompressed data of a file in blocks.
+ *
+ *  The interface is the same as that of blockreader: 'next' returns the next
+ *  block, with 'reserve' bytes of room in front of it, 'release' returns it.
+ */
+class decompressreader {
+public:
+    struct block {
+        char *data;             // the decompressed data, preceded by 'reserve' bytes
+        size_t size;
+        std::vector<char> buffer;
+        std::vector<std::pair<size_t, uint64_t>> frames;    // the frames starting in this block: data offset, compressed offset
+    };
+private:
+    const uint8_t *input;       // the mapped compressed file
+    size_t inputsize;
+    Compression type;
+    size_t blocksize;
+    size_t reserve;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::map<uint64_t, std::unique_ptr<block>> done;    // finished blocks, by sequence nr
+    uint64_t nextseq = 0;       // the next block returned by 'next'
+    uint64_t maxahead;          // the nr of blocks decompressed ahead of 'next'
+    bool finished = false;      // all blocks are in 'done'
+    uint64_t nblocks = 0;
+    std::string error;
+    uint64_t errorseq = UINT64_MAX; // the block which could not be decompressed
+    std::atomic<bool> stop{false};
+
+    std::vector<std::thread> workers;
+
+    // frame start offsets, in uncompressed and compressed coordinates.
+    std::vector<std::pair<uint64_t, uint64_t>> framelist;
+    uint64_t outoffset = 0;     // the uncompressed offset of the next block
+
+public:
+    decompressreader(const void *input, size_t inputsize, Compression type, size_t blocksize, size_t reserve, int nthreads, int nbuffers)
+        : input((const uint8_t*)input), inputsize(inputsize), type(type), blocksize(blocksize), reserve(reserve)
+    {
+        auto frames = nthreads > 1 ? splitframes(this->input, inputsize, type) : std::vector<size_t>();
+        if (frames.empty()) {
+            maxahead = std::max(nbuffers, 2);
+            workers.emplace_back([this]() { decodesequential(); });
+            return;
+        }
+
+        // group the frames in jobs of about one block of compressed data
+        std::vector<std::pair<size_t, size_t>> jobs;    // first frame, nr of frames
+        for (size_t i = 0, jobsize = 0 ; i < frames.size() ; i++) {
+            if (jobs.empty() || jobsize >= blocksize) {
+                jobs.emplace_back(i, 0);
+                jobsize = 0;
+            }
+            jobs.back().second++;
+            jobsize += frames[i];
+        }
+        maxahead = std::max(nbuffers, 2 * nthreads);
+
+        auto nextjob = std::make_shared<std::atomic<size_t>>(0);
+        std::vector<uint64_t> frameofs(frames.size() + 1);
+        for (size_t i = 0 ; i < frames.size() ; i++)
+            frameofs[i + 1] = frameofs[i] + frames[i];
+        for (int t = 0 ; t < std::min<int>(nthreads, jobs.size()) ; t++)
+            workers.emplace_back([this, jobs, frameofs, nextjob]() {
+                size_t j;
+                while (!stop && (j = (*nextjob)++) < jobs.size())
+                    decodejob(j, frameofs[jobs[j].first], frameofs[jobs[j].first + jobs[j].second]);
+                finish(jobs.size());
+            });
+    }
+    ~decompressreader()
+    {
+        {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+        }
+        cv.notify_all();
+        for (auto & t : workers)
+            t.join();
+    }
+
+    /*
+     *  returns the next block, or NULL at the end of the data.
+     *  throws when the data is corrupt, after returning all data before the error.
+     */
+    block *next()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (true) {
+            cv.wait(lock, [this]() { return done.count(nextseq) || (finished && nextseq >= nblocks) || nextseq >= errorseq; });
+            auto i = done.find(nextseq);
+            if (i == done.end()) {
+                if (nextseq >= errorseq)
+                    throw std::runtime_error(error);
+                return NULL;
+            }
+            auto b = i->second.get();
+            nextseq++;
+            cv.notify_all();
+            for (auto [pos, cofs] : b->frames)
+                framelist.emplace_back(outoffset + pos, cofs);
+            outoffset += b->size;
+            if (b->size)
+                return b;
+            done.erase(i);
+        }
+    }
+
+    void release(block *b)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto i = done.begin() ; i != done.end() ; ++i)
+            if (i->second.get() == b) {
+                done.erase(i);
+                break;
+            }
+    }
+
+    /*
+     *  the compressed offset of the frame containing the uncompressed 'offset',
+     *  for blocks returned by 'next'.
+     */
+    uint64_t frameoffset(uint64_t offset) const
+    {
+        auto i = std::upper_bound(framelist.begin(), framelist.end(), std::make_pair(offset, UINT64_MAX));
+        return i == framelist.begin() ? 0 : std::prev(i)->second;
+    }
+
+private:
+    void fail(uint64_t seq, const std::string& msg)
+    {
+        {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (seq < errorseq) {
+            errorseq = seq;
+            error = msg;
+        }
+        }
+        cv.notify_all();
+    }
+
+    std::unique_ptr<block> newblock(size_t size)
+    {
+        auto b = std::make_unique<block>();
+        b->buffer.resize(reserve + size);
+        b->data = b->buffer.data() + reserve;
+        b->size = 0;
+        return b;
+    }
+
+    // wait until block 'seq' may be produced. returns false when stopped.
+    bool waitroom(uint64_t seq)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&]() { return stop || seq < nextseq + maxahead; });
+        return !stop;
+    }
+    void publish(uint64_t seq, std::unique_ptr<block> b)
+    {
+        {
+        std::lock_guard<std::mutex> lock(mtx);
+        done[seq] = std::move(b);
+        }
+        cv.notify_all();
+    }
+    void finish(uint64_t count)
+    {
+        {
+        std::lock_guard<std::mutex> lock(mtx);
+        finished = true;
+        nblocks = count;
+        }
+        cv.notify_all();
+    }
+
+    /*
+     *  decompress the whole file on one thread, in blocks of 'blocksize'.
+     */
+    void decodesequential()
+    {
+        uint64_t seq = 0;
+        try {
+            auto decoder = makedecoder(type);
+            auto in = (const char*)input;
+            auto inend = in + inputsize;
+
+            auto b = newblock(blocksize);
+            b->frames.emplace_back(0, 0);
+            while (!stop) {
+                auto out = b->data + b->size;
+                auto before = in;
+                bool endofframe = decoder->decode(in, inend, out, b->data + blocksize, true);
+                bool progress = in != before || out != b->data + b->size;
+                b->size = out - b->data;
+                if (endofframe) {
+                    // stop at trailing garbage, like the zero padding of tar.gz files.
+                    if (detectcompression((const uint8_t*)in, inend - in) != type)
+                        break;
+                    decoder->restart();
+                    b->frames.emplace_back(b->size, in - (const char*)input);
+                }
+                else if (!progress) {
+                    throw std::runtime_error(std::string("unexpected end of ") + compressionname(type) + " data");
+                }
+                if (b->size == blocksize) {
+                    if (!waitroom(seq))
+                        return;
+                    publish(seq++, std::move(b));
+                    b = newblock(blocksize);
+                }
+            }
+            if (b->size) {
+                if (!waitroom(seq))
+                    return;
+                publish(seq++, std::move(b));
+            }
+            finish(seq);
+        }
+        catch(const std::exception& e) {
+            fail(seq, e.what());
+        }
+    }
+
+    /*
+     *  decompress the independent frames in [first, last) of the input, as block 'seq'.
+     */
+    void decodejob(uint64_t seq, uint64_t first, uint64_t last)
+    {
+        if (!waitroom(seq))
+            return;
+        try {
+            auto decoder = makedecoder(type);
+            auto in = (const char*)input + first;
+            auto inend = (const char*)input + last;
+
+            // compressed data expands by about a factor 3 or 4.
+            auto b = newblock(4 * (last - first));
+            b->frames.emplace_back(0, first);
+            while (true) {
+                if (b->size == b->buffer.size() - reserve) {
+                    b->buffer.resize(b->buffer.size() * 2);
+                    b->data = b->buffer.data() + reserve;
+                }
+                auto out = b->data + b->size;
+                auto before = in;
+                bool endofframe = decoder->decode(in, inend, out, b->buffer.data() + b->buffer.size(), true);
+                bool progress = in != before || out != b->data + b->size;
+                b->size = out - b->data;
+                if (endofframe) {
+                    if (in == inend)
+                        break;
+                    decoder->restart();
+                    b->frames.emplace_back(b->size, in - (const char*)input);
+                }
+                else if (!progress) {
+                    throw std::runtime_error(std::string("unexpected end of ") + compressionname(type) + " data");
+                }
+            }
+            publish(seq, std::move(b));
+        }
+        catch(const std::exception& e) {
+            fail(seq, e.what());
+        }
+    }
+};
@@ -0,0 +1,327 @@
+#pragma once
+/*
+ * Walks directory trees, listing the directories on several threads.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * The files are reported by the thread calling 'walk', in the same order
+ * as a depth first walk on a single thread. When the walk enters a directory,
+ * all its subdirectories are queued, and listed by the worker threads while
+ * the walk reports the files. The most recently queued directories are
+ * listed first, so the listing stays just ahead of the walk. When the walk
+ * needs a directory which no worker started on yet, it lists it itself.
+ * At most MAXAHEAD listed directories wait for the walk, after that the
+ * workers wait, so a slow search does not hold a listing of the entire tree.
+ *
+ * The filter is applied while listing, excluded directories are not opened,
+ * files larger than 'maxsize' are dropped before they are reported.
+ * A directory is only entered once, so bind mounts and loops are
+ * walked once, and a file with several hard links is reported once.
+ * Symbolic links to files are reported, links to directories are not followed.
+ *
+ * On linux the directories are read with getdents64, elsewhere with readdir.
+ */
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <unordered_set>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+class dirwalker {
+public:
+    // returns false for files which should be skipped, and directories which should not be entered.
+    typedef std::function<bool(const std::string& path, const char *name, bool isdir)> FilterType;
+    typedef std::function<void(const std::string& path, int err)> ErrorType;
+
+    struct options {
+        int nthreads = 1;           // threads listing directories
+        bool onefilesystem = false; // do not enter directories on other filesystems
+        uint64_t maxsize = 0;       // skip files of this size, or larger
+        FilterType filter;
+        ErrorType error;            // called for directories which can not be read
+    };
+
+    // counts for --stats and -v
+    std::atomic<uint64_t> ndirs{0};         // directories listed
+    std::atomic<uint64_t> nfiltered{0};     // files and directories excluded by the filter
+    std::atomic<uint64_t> ntoolarge{0};
+    uint64_t nduplicates = 0;               // files and directories seen before, by their device and inode
+
+private:
+    struct entry {
+        std::string name;
+        uint64_t dev;
+        uint64_t ino;
+    };
+    struct dirnode {
+        std::string path;
+        uint64_t dev = 0;
+        uint64_t ino = 0;
+        enum { QUEUED, LISTING, LISTED } state = QUEUED;
+        std::vector<entry> files;
+        std::vector<entry> subdirs;
+        int err = 0;
+    };
+    typedef std::shared_ptr<dirnode> nodeptr;
+
+    options opt;
+    uint64_t rootdev = 0;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<nodeptr> queue;     // the directories not yet listed, the last is listed first
+    size_t listedahead = 0;         // directories listed by the workers, not yet reached by the walk
+    bool stop = false;
+    std::vector<std::thread> workers;
+
+    // device and inode, used only by the walking thread
+    struct keyhash {
+        size_t operator()(const std::pair<uint64_t, uint64_t>& k) const
+        {
+            return std::hash<uint64_t>()(k.first * 0x9E3779B97F4A7C15ULL ^ k.second);
+        }
+    };
+    std::unordered_set<std::pair<uint64_t, uint64_t>, keyhash> visiteddirs;
+    std::unordered_set<std::pair<uint64_t, uint64_t>, keyhash> visitedfiles;
+
+public:
+    static constexpr size_t MAXAHEAD = 256;
+
+    dirwalker(const options& opt)
+        : opt(opt)
+    {
+        for (int i = 0 ; i < opt.nthreads ; i++)
+            workers.emplace_back([this]() { worker(); });
+    }
+    ~dirwalker()
+    {
+        {
+        std::lock_guard<std::mutex> lock(mtx);
+        stop = true;
+        }
+        cv.notify_all();
+        for (auto & t : workers)
+            t.join();
+    }
+    dirwalker(const dirwalker&) = delete;
+    dirwalker& operator=(const dirwalker&) = delete;
+
+    /*
+     *  calls 'cb' for all files below 'root'.
+     */
+    void walk(const std::string& root, const std::function<void(const std::string&)>& cb)
+    {
+        struct stat st;
+        if (stat(root.c_str(), &st) || !S_ISDIR(st.st_mode))
+            return;
+        rootdev = st.st_dev;
+        if (!visiteddirs.emplace(st.st_dev, st.st_ino).second) {
+            nduplicates++;
+            return;
+        }
+
+        auto rootnode = std::make_shared<dirnode>();
+        rootnode->path = root;
+        rootnode->dev = st.st_dev;
+        rootnode->ino = st.st_ino;
+
+        std::vector<nodeptr> stack{ rootnode };
+        while (!stack.empty()) {
+            auto node = stack.back();
+            stack.pop_back();
+            waitlisted(node);
+            if (node->err) {
+                if (opt.error)
+                    opt.error(node->path, node->err);
+                continue;
+            }
+
+            std::vector<nodeptr> subdirs;
+            for (auto & d : node->subdirs) {
+                if (!visiteddirs.emplace(d.dev, d.ino).second) {
+                    nduplicates++;
+                    continue;
+                }
+                auto sub = std::make_shared<dirnode>();
+                sub->path = childpath(node->path, d.name);
+                sub->dev = d.dev;
+                sub->ino = d.ino;
+                subdirs.push_back(sub);
+            }
+            // queued in reverse, so the first subdirectory is listed first
+            {
+            std::lock_guard<std::mutex> lock(mtx);
+            queue.insert(queue.end(), subdirs.rbegin(), subdirs.rend());
+            }
+            cv.notify_all();
+
+            for (auto & f : node->files) {
+                if (!visitedfiles.emplace(f.dev, f.ino).second) {
+                    nduplicates++;
+                    continue;
+                }
+                cb(childpath(node->path, f.name));
+            }
+            stack.insert(stack.end(), subdirs.rbegin(), subdirs.rend());
+        }
+    }
+
+private:
+    static std::string childpath(const std::string& dir, const std::string& name)
+    {
+        if (!dir.empty() && dir.back() == '/')
+            return dir + name;
+        return dir + "/" + name;
+    }
+
+    // wait until 'node' is listed, or list it, when no worker started on it.
+    void waitlisted(const nodeptr& node)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        if (node->state == dirnode::QUEUED) {
+            node->state = dirnode::LISTING;
+            lock.unlock();
+            list(*node);
+            lock.lock();
+            node->state = dirnode::LISTED;
+            return;
+        }
+        cv.wait(lock, [&node]() { return node->state == dirnode::LISTED; });
+        listedahead--;
+        lock.unlock();
+        cv.notify_all();
+    }
+
+    void worker()
+    {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this]() { return stop || (!queue.empty() && listedahead < MAXAHEAD); });
+            if (stop)
+                return;
+            auto node = queue.back();
+            queue.pop_back();
+            // the walk lists it itself when it gets there first
+            if (node->state != dirnode::QUEUED)
+                continue;
+            node->state = dirnode::LISTING;
+            lock.unlock();
+
+            list(*node);
+
+            lock.lock();
+            node->state = dirnode::LISTED;
+            listedahead++;
+            lock.unlock();
+            cv.notify_all();
+        }
+    }
+
+    /*
+     *  reads the entries of a directory, and sorts them in files and subdirectories.
+     */
+    void list(dirnode& node)
+    {
+        int fd = open(node.path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            node.err = errno;
+            return;
+        }
+        ndirs++;
+        readentries(fd, [&](const char *name, uint64_t ino, unsigned char type) {
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+                return;
+            addentry(node, fd, name, ino, type);
+        });
+        close(fd);
+    }
+
+    void addentry(dirnode& node, int fd, const char *name, uint64_t ino, unsigned char type)
+    {
+        struct stat st;
+        bool isdir = type == DT_DIR;
+        bool havestat = false;
+        if (type == DT_UNKNOWN || type == DT_LNK || isdir || (type == DT_REG && opt.maxsize)) {
+            // links are followed for files, not for directories
+            if (fstatat(fd, name, &st, type == DT_LNK ? 0 : AT_SYMLINK_NOFOLLOW))
+                return;
+            havestat = true;
+            isdir = S_ISDIR(st.st_mode) && type != DT_LNK;
+            if (!isdir && !S_ISREG(st.st_mode))
+                return;
+        }
+        else if (type != DT_REG) {
+            // devices, pipes and sockets
+            return;
+        }
+
+        if (opt.filter && !opt.filter(childpath(node.path, name), name, isdir)) {
+            nfiltered++;
+            return;
+        }
+        if (isdir) {
+            if (opt.onefilesystem && uint64_t(st.st_dev) != rootdev)
+                return;
+            node.subdirs.push_back(entry{ name, uint64_t(st.st_dev), uint64_t(st.st_ino) });
+            return;
+        }
+        if (havestat && opt.maxsize && uint64_t(st.st_size) >= opt.maxsize) {
+            ntoolarge++;
+            return;
+        }
+        if (havestat)
+            node.files.push_back(entry{ name, uint64_t(st.st_dev), uint64_t(st.st_ino) });
+        else
+            node.files.push_back(entry{ name, node.dev, ino });
+    }
+
+#ifdef __linux__
+    template<typename FN>
+    static void readentries(int fd, FN fn)
+    {
+        struct linux_dirent64 {
+            uint64_t d_ino;
+            int64_t d_off;
+            unsigned short d_reclen;
+            unsigned char d_type;
+            char d_name[1];
+        };
+        // large reads take fewer round trips on network filesystems
+        std::vector<char> buf(0x20000);
+        while (true) {
+            auto n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+            if (n <= 0)
+                break;
+            for (long ofs = 0 ; ofs < n ; ) {
+                auto d = (const linux_dirent64*)&buf[ofs];
+                fn(d->d_name, d->d_ino, d->d_type);
+                ofs += d->d_reclen;
+            }
+        }
+    }
+#else
+    template<typename FN>
+    static void readentries(int fd, FN fn)
+    {
+        DIR *dir = fdopendir(dup(fd));
+        if (!dir)
+            return;
+        while (auto d = readdir(dir))
+            fn(d->d_name, d->d_ino, d->d_type);
+        closedir(dir);
+    }
+#endif
+};
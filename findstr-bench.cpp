@@ -0,0 +1,408 @@
+/*
+ * Throughput benchmark for the findstr search algorithms.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * Generates synthetic corpora, and runs each search algorithm over them
+ * with varying pattern lengths, pattern counts and wildcard densities.
+ * Besides the -S algorithms with hex patterns, text patterns are run through
+ * -S text and the regex engine, numbers through a --u8 .. --u64 value search,
+ * and hex patterns through a -F pattern file.
+ * The results are printed as tab separated values, one line per run:
+ *
+ *   corpus algorithm patlen npatterns wildcards bytes seconds GB/s matches matches/s
+ */
+#define FINDSTR_NO_MAIN
+#include "findstr.cpp"
+
+#include <random>
+
+struct benchconfig {
+    uint64_t corpussize = 0x4000000;
+    double maxtime = 2.0;        // skip runs expected to take longer than this
+    int repeat = 3;              // the fastest of 'repeat' runs is reported
+    std::set<std::string> corpora;
+    std::set<std::string> algorithms;
+};
+
+/*
+ * synthetic test data
+ */
+struct corpus {
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+static std::vector<uint8_t> randomdata(uint64_t size, std::mt19937_64& rng)
+{
+    std::vector<uint8_t> data(size);
+    for (uint64_t i = 0 ; i < size ; i++)
+        data[i] = rng();
+    return data;
+}
+
+// words with an english like letter distribution.
+static std::vector<uint8_t> textdata(uint64_t size, std::mt19937_64& rng)
+{
+    static const char *words[] = {
+        "the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with",
+        "be", "by", "on", "not", "he", "this", "are", "or", "his", "from", "at", "which",
+        "but", "have", "an", "had", "they", "you", "were", "their", "one", "all", "we",
+        "can", "her", "has", "there", "been", "if", "more", "when", "will", "would",
+        "who", "so", "no", "search", "pattern", "binary", "memory", "function", "string",
+    };
+    std::vector<uint8_t> data;
+    data.reserve(size);
+    int linelen = 0;
+    while (data.size() < size) {
+        auto w = words[rng() % (sizeof(words) / sizeof(*words))];
+        data.insert(data.end(), w, w + strlen(w));
+        linelen += strlen(w) + 1;
+        if (linelen > 72) {
+            data.push_back('\n');
+            linelen = 0;
+        }
+        else {
+            data.push_back(' ');
+        }
+    }
+    data.resize(size);
+    return data;
+}
+
+// mostly zero and 0xff filled areas, with some code like data in between.
+static std::vector<uint8_t> firmwaredata(uint64_t size, std::mt19937_64& rng)
+{
+    std::vector<uint8_t> data(size);
+    uint64_t i = 0;
+    while (i < size) {
+        uint64_t len = std::min<uint64_t>(size - i, 0x100 + rng() % 0x10000);
+        switch (rng() % 4) {
+            case 0:
+            case 1: std::fill(&data[i], &data[i] + len, 0); break;
+            case 2: std::fill(&data[i], &data[i] + len, 0xff); break;
+            case 3:
+                for (uint64_t j = 0 ; j < len ; j++)
+                    data[i + j] = (j & 3) == 3 ? 0xe0 + rng() % 16 : rng();
+                break;
+        }
+        i += len;
+    }
+    return data;
+}
+
+// many partial copies of a single 256 byte sequence, differing in the last byte.
+static std::vector<uint8_t> nearmatchdata(uint64_t size, std::mt19937_64& rng, const std::vector<uint8_t>& needle)
+{
+    std::vector<uint8_t> data(size);
+    uint64_t i = 0;
+    while (i < size) {
+        size_t len = std::min<uint64_t>(size - i, 1 + rng() % needle.size());
+        std::copy(needle.begin(), needle.begin() + len, &data[i]);
+        if (len > 1)
+            data[i + len - 1] ^= 1 + rng() % 255;
+        i += len;
+    }
+    return data;
+}
+
+/*
+ * how the patterns of a run are specified.
+ */
+enum PatternKind {
+    HEX_PATTERN,        // -x "aa bb ??|cc dd"
+    TEXT_PATTERN,       // "abc|def", with '.' for a wildcard
+    VALUE_PATTERN,      // --u8 .. --u64, with the pattern length as the width
+    FILE_PATTERN,       // -F, with one hex pattern per line
+};
+
+struct algorithm {
+    std::string name;
+    SearchType type;
+    PatternKind kind;
+};
+
+/*
+ * the search algorithms, by their -S name, and the other kinds of searches.
+ */
+static const std::vector<algorithm> algorithms = {
+    { "regex", REGEX_SEARCH, HEX_PATTERN },
+    { "std", STD_SEARCH, HEX_PATTERN },
+    { "stdbm", STD_BOYER_MOORE, HEX_PATTERN },
+    { "stdbmh", STD_BOYER_MOORE_HORSPOOL, HEX_PATTERN },
+#ifdef USE_BOOST_REGEX
+    { "boostbm", BOOST_BOYER_MOORE, HEX_PATTERN },
+    { "boostbmh", BOOST_BOYER_MOORE_HORSPOOL, HEX_PATTERN },
+    { "boostkmp", BOOST_KNUTH_MORRIS_PRATT, HEX_PATTERN },
+#endif
+    { "mask", BYTEMASK_SEARCH, HEX_PATTERN },
+    { "ac", AHO_CORASICK_SEARCH, HEX_PATTERN },
+    { "auto", AUTO_SEARCH, HEX_PATTERN },
+    { "text", TEXT_SEARCH, TEXT_PATTERN },
+    { "regex-text", REGEX_SEARCH, TEXT_PATTERN },
+    { "value", VALUE_SEARCH, VALUE_PATTERN },
+    { "file", AHO_CORASICK_SEARCH, FILE_PATTERN },
+};
+
+// only these handle wildcards in a pattern.
+static bool supportswildcards(const algorithm& a)
+{
+    if (a.kind == VALUE_PATTERN || a.type == TEXT_SEARCH)
+        return false;
+    return a.type == REGEX_SEARCH || a.type == BYTEMASK_SEARCH || a.type == AHO_CORASICK_SEARCH || a.type == AUTO_SEARCH;
+}
+
+/*
+ * builds a '-x' style hex pattern list, taking the patterns from the corpus, so
+ * at least some of them will match.
+ */
+static std::string makepatterns(const std::vector<uint8_t>& data, size_t patlen, size_t npatterns, double wildcards, std::mt19937_64& rng)
+{
+    std::string pattern;
+    for (size_t n = 0 ; n < npatterns ; n++) {
+        if (!pattern.empty())
+            pattern += "|";
+        auto ofs = rng() % (data.size() - patlen);
+        for (size_t i = 0 ; i < patlen ; i++) {
+            if (i)
+                pattern += " ";
+            // the first byte is never a wildcard
+            if (i && std::uniform_real_distribution<double>()(rng) < wildcards)
+                pattern += "??";
+            else
+                pattern += stringformat("%02x", data[ofs + i]);
+        }
+    }
+    return pattern;
+}
+
+/*
+ * builds a text pattern list from the corpus, bytes which are not printable,
+ * or are regex syntax, are replaced by a letter.
+ * A wildcard is a '.', and only used with the regex engine.
+ */
+static std::string maketextpatterns(const std::vector<uint8_t>& data, size_t patlen, size_t npatterns, double wildcards, std::mt19937_64& rng)
+{
+    std::string pattern;
+    for (size_t n = 0 ; n < npatterns ; n++) {
+        if (!pattern.empty())
+            pattern += "|";
+        auto ofs = rng() % (data.size() - patlen);
+        for (size_t i = 0 ; i < patlen ; i++) {
+            auto c = data[ofs + i];
+            if (i && std::uniform_real_distribution<double>()(rng) < wildcards)
+                pattern += '.';
+            else if ((isprint(c) || c == '\n') && !strchr("\\^$.[]()*+?{}|", c))
+                pattern += c;
+            else
+                pattern += 'a' + c % 26;
+        }
+    }
+    return pattern;
+}
+
+/*
+ * builds value queries for numbers taken from the corpus, 'patlen' is the
+ * width in bytes, returns an empty list for other lengths.
+ */
+static std::vector<std::pair<std::string, std::string>> makevaluequeries(const std::vector<uint8_t>& data, size_t patlen, size_t npatterns, std::mt19937_64& rng)
+{
+    std::vector<std::pair<std::string, std::string>> queries;
+    if (patlen != 1 && patlen != 2 && patlen != 4 && patlen != 8)
+        return queries;
+    for (size_t n = 0 ; n < npatterns ; n++) {
+        auto ofs = rng() % (data.size() - patlen);
+        uint64_t value = 0;
+        memcpy(&value, &data[ofs], patlen);
+        queries.emplace_back(stringformat("u%d", patlen * 8), stringformat("%d", value));
+    }
+    return queries;
+}
+
+/*
+ * writes the patterns of a '-x' style list to a temporary -F file, one per line.
+ */
+static std::string makepatternfile(const std::string& patterns)
+{
+    char name[] = "/tmp/findstr-bench-XXXXXX";
+    int fd = mkstemp(name);
+    if (fd == -1)
+        throw std::runtime_error("mkstemp failed");
+    filehandle f = fd;
+    std::string lines;
+    for (size_t i = 0 ; i <= patterns.size() ; ) {
+        auto j = std::min(patterns.find('|', i), patterns.size());
+        lines += "hex:" + patterns.substr(i, j - i) + "\n";
+        i = j + 1;
+    }
+    if (::write(f, lines.data(), lines.size()) != ssize_t(lines.size()))
+        throw std::runtime_error("write error");
+    return name;
+}
+
+struct benchresult {
+    double seconds;
+    uint64_t matches;
+};
+
+static benchresult runsearch(const SearchBase& searcher, const std::vector<uint8_t>& data, int repeat)
+{
+    benchresult best = { 1e99, 0 };
+    for (int r = 0 ; r < repeat ; r++) {
+        uint64_t matches = 0;
+        auto t0 = std::chrono::steady_clock::now();
+        searcher.search((const char*)data.data(), (const char*)data.data() + data.size(), [&matches](const char *, const char *)->bool {
+            matches++;
+            return true;
+        });
+        auto t1 = std::chrono::steady_clock::now();
+        double seconds = std::chrono::duration<double>(t1 - t0).count();
+        if (seconds < best.seconds)
+            best = { seconds, matches };
+    }
+    return best;
+}
+
+static void runbench(const benchconfig& cfg, const corpus& c, std::mt19937_64& rng)
+{
+    struct run {
+        size_t patlen;
+        size_t npatterns;
+        double wildcards;
+    };
+    std::vector<std::vector<run>> series;
+
+    // pattern length
+    series.emplace_back();
+    for (size_t len = 1 ; len <= 256 ; len *= 2)
+        series.back().push_back({ len, 1, 0.0 });
+    // pattern count
+    series.emplace_back();
+    for (size_t n : { 1, 10, 100, 1000, 10000 })
+        series.back().push_back({ 8, n, 0.0 });
+    // wildcard density
+    series.emplace_back();
+    for (double w : { 0.1, 0.25, 0.5 })
+        series.back().push_back({ 16, 1, w });
+
+    for (auto & a : algorithms) {
+        auto & name = a.name;
+        if (!cfg.algorithms.empty() && !cfg.algorithms.count(name))
+            continue;
+        for (auto & s : series) {
+            for (size_t i = 0 ; i < s.size() ; i++) {
+                auto & r = s[i];
+                if (r.wildcards > 0 && !supportswildcards(a))
+                    continue;
+
+                findstr f;
+                f.searchtype = a.type;
+                f.matchbinary = true;
+                f.matchcase = true;
+                std::string patternfile;
+                switch (a.kind) {
+                    case HEX_PATTERN:
+                        f.pattern_is_hex = true;
+                        f.pattern = makepatterns(c.data, r.patlen, r.npatterns, r.wildcards, rng);
+                        break;
+                    case TEXT_PATTERN:
+                        f.pattern = maketextpatterns(c.data, r.patlen, r.npatterns, r.wildcards, rng);
+                        break;
+                    case VALUE_PATTERN:
+                        // value searches are selected by compile_values
+                        f.searchtype = AUTO_SEARCH;
+                        f.valuequeries = makevaluequeries(c.data, r.patlen, r.npatterns, rng);
+                        break;
+                    case FILE_PATTERN:
+                        f.pattern_is_hex = true;
+                        f.patternfile = patternfile = makepatternfile(makepatterns(c.data, r.patlen, r.npatterns, r.wildcards, rng));
+                        break;
+                }
+                if (a.kind == VALUE_PATTERN && f.valuequeries.empty())
+                    continue;
+
+                benchresult res;
+                try {
+                    bool ok = f.compile_pattern();
+                    if (!patternfile.empty())
+                        unlink(patternfile.c_str());
+                    if (!ok)
+                        continue;
+                    if (f.searchtype == AUTO_SEARCH)
+                        f.selectsearchtype();
+                    auto searcher = f.makesearcher();
+                    res = runsearch(*searcher, c.data, cfg.repeat);
+                }
+                catch(const std::exception& e) {
+                    fprintf(stderr, "%s %s %d*%d: %s\n", c.name.c_str(), name.c_str(), int(r.npatterns), int(r.patlen), e.what());
+                    break;
+                }
+
+                print("%s\t%s\t%d\t%d\t%.2f\t%d\t%.6f\t%.3f\t%d\t%.0f\n", c.name, name,
+                        r.patlen, r.npatterns, r.wildcards, c.data.size(), res.seconds,
+                        c.data.size() / res.seconds / 1e9, res.matches, res.matches / res.seconds);
+                fflush(stdout);
+
+                // the time grows with the number of patterns, skip the rest of
+                // this series when the next run is expected to take too long.
+                if (i + 1 < s.size() && res.seconds * s[i + 1].npatterns / r.npatterns > cfg.maxtime)
+                    break;
+            }
+        }
+    }
+}
+
+static void benchusage()
+{
+    print("Usage: findstr-bench [options]\n");
+    print("   --size SIZE        corpus size, default 64M\n");
+    print("   --maxtime SEC      skip runs expected to take longer than this, default 2\n");
+    print("   --repeat N         report the fastest of N runs, default 3\n");
+    print("   --corpus NAME      only this corpus: random, text, firmware, nearmatch\n");
+    print("   --algorithm NAME   only this algorithm, the names used with -S, or regex-text, value, file\n");
+}
+
+int main(int argc, char** argv)
+{
+    benchconfig cfg;
+    for (auto& arg : ArgParser(argc, argv))
+        switch (arg.option())
+        {
+            case '-': if (arg.match("--size")) cfg.corpussize = arg.getint();
+                      else if (arg.match("--maxtime")) cfg.maxtime = strtod(arg.getstr().c_str(), NULL);
+                      else if (arg.match("--repeat")) cfg.repeat = arg.getint();
+                      else if (arg.match("--corpus")) cfg.corpora.insert(arg.getstr());
+                      else if (arg.match("--algorithm")) cfg.algorithms.insert(arg.getstr());
+                      else {
+                          benchusage();
+                          return 1;
+                      }
+                      break;
+            default:
+                benchusage();
+                return 1;
+        }
+    if (cfg.corpussize < 0x1000)
+        cfg.corpussize = 0x1000;
+    if (cfg.repeat < 1)
+        cfg.repeat = 1;
+
+    std::mt19937_64 rng(1);
+    auto needle = randomdata(256, rng);
+
+    std::vector<std::pair<std::string, std::function<std::vector<uint8_t>()>>> generators = {
+        { "random",    [&]() { return randomdata(cfg.corpussize, rng); } },
+        { "text",      [&]() { return textdata(cfg.corpussize, rng); } },
+        { "firmware",  [&]() { return firmwaredata(cfg.corpussize, rng); } },
+        { "nearmatch", [&]() { return nearmatchdata(cfg.corpussize, rng, needle); } },
+    };
+
+    print("corpus\talgorithm\tpatlen\tnpatterns\twildcards\tbytes\tseconds\tGB/s\tmatches\tmatches/s\n");
+    for (auto & [name, gen] : generators) {
+        if (!cfg.corpora.empty() && !cfg.corpora.count(name))
+            continue;
+        corpus c = { name, gen() };
+        runbench(cfg, c, rng);
+    }
+    return 0;
+}
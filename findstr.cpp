@@ -14,8 +14,9 @@
 #define BASIC_REGEX boost::basic_regex
 #define REGEX_ITER  boost::regex_iterator
 #define REGEX_MATCH boost::regex_match
+#define REGEX_FIND  boost::regex_search
 #define REGEX_CONST boost::regex_constants
-#define PARTIALARG  , boost::match_partial
+#define PARTIALFLAG REGEX_CONST::match_partial
 #endif
 
 #ifdef USE_STD_REGEX
@@ -23,8 +24,9 @@
 #define BASIC_REGEX std::basic_regex
 #define REGEX_ITER  std::regex_iterator
 #define REGEX_MATCH std::regex_match
+#define REGEX_FIND  std::regex_search
 #define REGEX_CONST std::regex_constants
-#define PARTIALARG
+#define PARTIALFLAG REGEX_CONST::match_default
 #endif
 
 #ifdef USE_BOOST_REGEX
@@ -58,14 +60,48 @@ using namespace std::string_literals;
 #include <cpputils/fslibrary.h>
 
 #include <set>
+#include <map>
+#include <array>
+#include <bitset>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <cmath>
 #include <fcntl.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#ifndef _WIN32
+#include <poll.h>
+#include <dirent.h>
+#endif
 
 #ifdef WITH_MEMSEARCH
-// TODO: add support for linux /proc/<pid>/mem,  reading info from ../maps
 // machmemory is from hexdumper
 #include "machmemory.h"
 #endif
 
+#if defined(__linux__) && !defined(WITH_MEMSEARCH)
+#define WITH_PROCMEM
+#include "procmemory.h"
+#endif
+
+#include "ngramindex.h"
+#include "readahead.h"
+#include "decompress.h"
+#include "archive.h"
+#include "searchstats.h"
+#include "patterncache.h"
+#include "matchqueue.h"
+#ifndef _WIN32
+#include "dirwalker.h"
+#include <fnmatch.h>
+#endif
+
 #define catchall(call, arg) \
     try { \
         call; \
@@ -77,15 +113,6 @@ using namespace std::string_literals;
         print("EXCEPTION in %s\n", arg); \
     }
 
-//
-// TODO: add option to specify what is printed for matches:
-//       - only offset
-//       - the offset and the matching data.
-//       - the 'record' containing the match,
-//           where 'record' can be a CR/LF terminated line,
-//           or a 'CSV' record, or a NUL terminated item.
-//           or a fixed sized block of data.
-//
 typedef std::vector<uint8_t> ByteVector;
 typedef std::pair<ByteVector,ByteVector> ByteMaskType;
 
@@ -289,33 +316,526 @@ public:
 };
 
 
+/*
+ * rough relative frequency of byte values in typical binaries and text,
+ * used to pick the least likely byte of a pattern as the search anchor.
+ */
+static int bytefrequency(uint8_t c)
+{
+    switch(c) {
+        case 0x00: return 255;
+        case 0xFF: return 160;
+        case ' ':  return 150;
+        case 0x8b: case 0x89: case 0x48: case 0xe8:
+        case 0xcc: case 0x90: case 0xc3: return 120;  // common in x86 code
+    }
+    if (strchr("etaoinsrhl", c))
+        return 130;
+    if (islower(c))
+        return 100;
+    if (isdigit(c))
+        return 90;
+    if (c < 0x10)
+        return 85;
+    if (isupper(c))
+        return 80;
+    if (isprint(c))
+        return 60;
+    if (c < 0x20)
+        return 50;
+    return 30;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WITH_X86_SIMD
+#include <immintrin.h>
+#endif
+
+/*
+ *  Extracts the required literals from a regular expression.
+ *
+ *  For each top-level alternative the longest run of plain characters
+ *  is taken, together with the maximum number of bytes the alternative
+ *  can match before and after this literal.
+ *  When an alternative has no literal, or can match an unbounded number of
+ *  bytes, or uses constructs which are not understood, like backreferences or
+ *  lookahead, no literals are returned.
+ */
+class regexliterals {
+    static constexpr size_t UNBOUNDED = ~size_t(0);
+
+    struct atom {
+        int byte;           // -1 when this is not a single literal byte
+        size_t minlen;
+        size_t maxlen;
+    };
+    struct unsupported { };
+
+    const std::string& re;
+    size_t i = 0;
+
+    static size_t add(size_t a, size_t b)
+    {
+        return (a == UNBOUNDED || b == UNBOUNDED) ? UNBOUNDED : a + b;
+    }
+    static size_t mul(size_t a, size_t n)
+    {
+        return (a == UNBOUNDED || n == UNBOUNDED) ? (a == 0 || n == 0 ? 0 : UNBOUNDED) : a * n;
+    }
+    bool atend() const { return i >= re.size(); }
+    char peek() const { return re[i]; }
+
+    size_t parsenumber()
+    {
+        size_t n = 0;
+        if (atend() || !isdigit(peek()))
+            throw unsupported();
+        while (!atend() && isdigit(peek()))
+            n = n * 10 + (re[i++] - '0');
+        return n;
+    }
+    int parsehex(int maxdigits)
+    {
+        int value = 0, n = 0;
+        while (n < maxdigits && !atend() && isxdigit(peek())) {
+            char c = re[i++];
+            value = value * 16 + (isdigit(c) ? c - '0' : (tolower(c) - 'a' + 10));
+            n++;
+        }
+        if (n == 0)
+            throw unsupported();
+        return value;
+    }
+
+    // after the backslash
+    atom parseescape()
+    {
+        if (atend())
+            throw unsupported();
+        char c = re[i++];
+        switch(c) {
+            case 'x':
+                if (!atend() && peek() == '{')
+                    throw unsupported();
+                return { parsehex(2), 1, 1 };
+            case 'n': return { '\n', 1, 1 };
+            case 'r': return { '\r', 1, 1 };
+            case 't': return { '\t', 1, 1 };
+            case 'f': return { '\f', 1, 1 };
+            case 'v': return { '\v', 1, 1 };
+            case 'a': return { '\a', 1, 1 };
+            case 'e': return { 0x1b, 1, 1 };
+            case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+            case 'h': case 'H':
+                return { -1, 1, 1 };
+            case 'b': case 'B': case 'A': case 'z': case 'Z': case '<': case '>': case '`': case '\'':
+                return { -1, 0, 0 };
+        }
+        if (isalnum(c))
+            throw unsupported();    // backreferences, unicode properties, etc.
+        return { (uint8_t)c, 1, 1 };
+    }
+
+    void skipcharset()
+    {
+        // the '[' was already consumed
+        if (!atend() && peek() == '^')
+            i++;
+        if (!atend() && peek() == ']')
+            i++;
+        while (!atend() && peek() != ']') {
+            if (peek() == '\\')
+                i++;
+            else if (peek() == '[' && i + 1 < re.size() && (re[i+1] == ':' || re[i+1] == '=' || re[i+1] == '.')) {
+                auto close = re.find(std::string(1, re[i+1]) + "]", i + 2);
+                if (close == std::string::npos)
+                    throw unsupported();
+                i = close + 1;
+                continue;
+            }
+            i++;
+        }
+        if (atend())
+            throw unsupported();
+        i++;
+    }
+
+    atom parseatom()
+    {
+        char c = re[i++];
+        switch(c) {
+            case '.': return { -1, 1, 1 };
+            case '^': case '$': return { -1, 0, 0 };
+            case '[':
+                skipcharset();
+                return { -1, 1, 1 };
+            case '\\':
+                return parseescape();
+            case '(':
+                {
+                if (!atend() && peek() == '?') {
+                    if (i + 1 < re.size() && re[i+1] == ':')
+                        i += 2;
+                    else
+                        throw unsupported();    // lookaround, flags, named groups
+                }
+                auto alts = parsealternatives();
+                if (atend() || peek() != ')')
+                    throw unsupported();
+                i++;
+                atom a = { -1, UNBOUNDED, 0 };
+                for (auto & seq : alts) {
+                    size_t minlen = 0, maxlen = 0;
+                    for (auto & x : seq) {
+                        minlen = add(minlen, x.minlen);
+                        maxlen = add(maxlen, x.maxlen);
+                    }
+                    a.minlen = std::min(a.minlen, minlen);
+                    a.maxlen = std::max(a.maxlen, maxlen);
+                }
+                return a;
+                }
+            case '*': case '+': case '?': case '{': case ')': case '|':
+                throw unsupported();
+        }
+        return { (uint8_t)c, 1, 1 };
+    }
+
+    void parsequantifier(atom& a)
+    {
+        if (atend())
+            return;
+        size_t qmin = 1, qmax = 1;
+        switch(peek()) {
+            case '*': qmin = 0; qmax = UNBOUNDED; i++; break;
+            case '+': qmin = 1; qmax = UNBOUNDED; i++; break;
+            case '?': qmin = 0; qmax = 1; i++; break;
+            case '{':
+                i++;
+                qmin = qmax = parsenumber();
+                if (!atend() && peek() == ',') {
+                    i++;
+                    qmax = (!atend() && peek() == '}') ? UNBOUNDED : parsenumber();
+                }
+                if (atend() || peek() != '}')
+                    throw unsupported();
+                i++;
+                break;
+            default:
+                return;
+        }
+        // lazy or possessive modifiers
+        if (!atend() && (peek() == '?' || peek() == '+'))
+            i++;
+        if (qmin != 1 || qmax != 1)
+            a.byte = -1;
+        a.minlen = mul(a.minlen, qmin);
+        a.maxlen = mul(a.maxlen, qmax);
+    }
+
+    std::vector<std::vector<atom>> parsealternatives()
+    {
+        std::vector<std::vector<atom>> alts(1);
+        while (!atend() && peek() != ')') {
+            if (peek() == '|') {
+                i++;
+                alts.emplace_back();
+                continue;
+            }
+            auto a = parseatom();
+            parsequantifier(a);
+            alts.back().push_back(a);
+        }
+        return alts;
+    }
+
+public:
+    struct literal {
+        std::string text;
+        size_t maxbefore;   // max nr of bytes matched before the literal
+        size_t maxafter;    // max nr of bytes matched after the literal
+    };
+
+    regexliterals(const std::string& re)
+        : re(re)
+    {
+    }
+
+    std::vector<literal> extract()
+    {
+        std::vector<std::vector<atom>> alts;
+        try {
+            alts = parsealternatives();
+            if (!atend())
+                return {};
+        }
+        catch(const unsupported&) {
+            return {};
+        }
+
+        std::vector<literal> literals;
+        for (auto & seq : alts) {
+            // find the longest run of literal bytes
+            size_t bestpos = 0, bestlen = 0;
+            for (size_t j = 0 ; j < seq.size() ; ) {
+                size_t k = j;
+                while (k < seq.size() && seq[k].byte >= 0)
+                    k++;
+                if (k - j > bestlen) {
+                    bestpos = j;
+                    bestlen = k - j;
+                }
+                j = std::max(j + 1, k);
+            }
+            if (bestlen == 0)
+                return {};
+
+            literal lit = { "", 0, 0 };
+            for (size_t j = 0 ; j < seq.size() ; j++) {
+                if (j < bestpos)
+                    lit.maxbefore = add(lit.maxbefore, seq[j].maxlen);
+                else if (j < bestpos + bestlen)
+                    lit.text += (char)seq[j].byte;
+                else
+                    lit.maxafter = add(lit.maxafter, seq[j].maxlen);
+            }
+            if (lit.maxbefore == UNBOUNDED || lit.maxafter == UNBOUNDED)
+                return {};
+            literals.push_back(lit);
+        }
+        return literals;
+    }
+};
+
+/*
+ *  Finds occurrences of a small set of literals.
+ *
+ *  Each literal has an 'anchor', its least likely byte, all anchors are
+ *  compared 16 bytes at a time, the literals are verified at the positions
+ *  where an anchor was found.
+ */
+class literalscanner {
+    std::vector<regexliterals::literal> literals;
+    std::vector<size_t> anchors;        // offset of the anchor byte in each literal
+    std::vector<uint8_t> anchorbytes;   // all values to search for, including case variants
+    std::array<uint8_t, 256> fold;
+    std::array<uint8_t, 256> isanchor;
+public:
+    static constexpr size_t MAXANCHORS = 8;
+
+    literalscanner(const std::vector<regexliterals::literal>& literals, bool matchcase)
+        : literals(literals)
+    {
+        for (int c = 0 ; c < 256 ; c++)
+            fold[c] = matchcase ? c : tolower(c);
+        isanchor.fill(0);
+
+        auto frequency = [&](uint8_t c) {
+            if (fold[c] != c || fold[toupper(c)] != toupper(c))
+                return bytefrequency(tolower(c)) + bytefrequency(toupper(c));
+            return bytefrequency(c);
+        };
+        for (auto & lit : literals) {
+            size_t best = 0;
+            for (size_t j = 1 ; j < lit.text.size() ; j++)
+                if (frequency(lit.text[j]) < frequency(lit.text[best]))
+                    best = j;
+            anchors.push_back(best);
+
+            uint8_t c = lit.text[best];
+            for (uint8_t v : { c, fold[c], (uint8_t)(matchcase ? c : toupper(c)) })
+                if (!isanchor[v]) {
+                    isanchor[v] = 1;
+                    anchorbytes.push_back(v);
+                }
+        }
+    }
+    bool usable() const
+    {
+        return !literals.empty() && anchorbytes.size() <= MAXANCHORS;
+    }
+    const regexliterals::literal& getliteral(size_t n) const { return literals[n]; }
+
+    bool verify(size_t n, const char *p) const
+    {
+        auto & text = literals[n].text;
+        for (size_t j = 0 ; j < text.size() ; j++)
+            if (fold[(uint8_t)p[j]] != fold[(uint8_t)text[j]])
+                return false;
+        return true;
+    }
+
+    // check all literals whose anchor could be at 'a'.
+    template<typename FN>
+    bool candidate(const char *first, const char *last, const char *a, FN& fn) const
+    {
+        for (size_t n = 0 ; n < literals.size() ; n++) {
+            if (fold[(uint8_t)*a] != fold[(uint8_t)literals[n].text[anchors[n]]])
+                continue;
+            if (size_t(a - first) < anchors[n])
+                continue;
+            auto p = a - anchors[n];
+            if (size_t(last - p) < literals[n].text.size())
+                continue;
+            if (verify(n, p) && !fn(p, n))
+                return false;
+        }
+        return true;
+    }
+
+    /*
+     *  calls fn(p, n) for each occurrence of literal n at p,
+     *  in order of the position of the anchor.
+     *  stops when fn returns false.
+     */
+    template<typename FN>
+    bool scan(const char *first, const char *last, FN fn) const
+    {
+        auto a = first;
+#ifdef WITH_X86_SIMD
+        __m128i needles[MAXANCHORS];
+        for (size_t k = 0 ; k < anchorbytes.size() ; k++)
+            needles[k] = _mm_set1_epi8(anchorbytes[k]);
+
+        for ( ; last - a >= 16 ; a += 16) {
+            auto v = _mm_loadu_si128((const __m128i*)a);
+            auto e = _mm_cmpeq_epi8(v, needles[0]);
+            for (size_t k = 1 ; k < anchorbytes.size() ; k++)
+                e = _mm_or_si128(e, _mm_cmpeq_epi8(v, needles[k]));
+            unsigned bits = _mm_movemask_epi8(e);
+            while (bits) {
+                if (!candidate(first, last, a + __builtin_ctz(bits), fn))
+                    return false;
+                bits &= bits - 1;
+            }
+        }
+#endif
+        for ( ; a < last ; a++)
+            if (isanchor[(uint8_t)*a] && !candidate(first, last, a, fn))
+                return false;
+        return true;
+    }
+};
+
 /*
  *   the various search implementations
+ *
+ *   A searcher is not modified after construction, so a single searcher
+ *   can be used for all files, and by multiple threads at the same time.
  */
 typedef std::function<bool(const char*, const char*)>  CallbackType;
 class SearchBase {
 public:
     virtual ~SearchBase() { }
-    virtual const char *search(const char *first, const char *last, CallbackType cb) = 0;
+    virtual const char *search(const char *first, const char *last, CallbackType cb) const = 0;
+
+    // the same, for searchers which need 'offset', the file offset of 'first'.
+    virtual const char *searchat(const char *first, const char *last, uint64_t /*offset*/, CallbackType cb) const { return search(first, last, cb); }
+
+    // true when the searcher counts the candidates it verifies in 'threadstats'
+    virtual bool countscandidates() const { return false; }
+
+    // the id of the pattern matching [first, last), or -1 when the searcher does not know.
+    virtual int64_t patternid(const char */*first*/, const char */*last*/) const { return -1; }
 };
 class regexsearcher : public SearchBase {
     const BASIC_REGEX<char> re;
+
+    // used to find candidate ranges, when the regex contains required literals.
+    std::unique_ptr<literalscanner> prefilter;
+    size_t maxlength = 0;       // the longest possible match
 public:
     regexsearcher(const std::string& pattern, bool matchcase)
         : re(pattern.c_str(), pattern.c_str() + pattern.size(),
                 BASIC_REGEX<char>::flag_type(REGEX_CONST::nosubs | (matchcase ? 0 :  REGEX_CONST::icase)))
 
     {
-
+        auto literals = regexliterals(pattern).extract();
+        if (literals.empty())
+            return;
+        prefilter = std::make_unique<literalscanner>(literals, matchcase);
+        if (!prefilter->usable()) {
+            prefilter.reset();
+            return;
+        }
+        for (auto & lit : literals)
+            maxlength = std::max(maxlength, lit.maxbefore + lit.text.size() + lit.maxafter);
     }
 
     // returns:
     //     NULL   when final match found
     //     last   when only complete matches were found
     //     *      when partial match was found
-    const char *search(const char *first, const char *last, CallbackType cb)
+    const char *search(const char *first, const char *last, CallbackType cb) const
+    {
+        if (!prefilter || size_t(last - first) <= 2 * maxlength)
+            return searchrange(first, last, first, last, cb, PARTIALFLAG);
+
+        // Only the ranges around the literals are passed to the regex engine.
+        // The last 'maxlength' bytes are always searched, since they may
+        // contain a partial match, without a complete literal.
+        auto tailstart = last - maxlength;
+        const char *done = first;       // everything before this was searched
+        const char *rangestart = NULL;
+        const char *rangeend = NULL;
+        bool stopped = false;
+
+        auto flush = [&]() {
+            if (searchrange(rangestart, rangeend, first, last, cb, REGEX_CONST::match_default) == NULL)
+                return false;
+            done = rangeend;
+            rangestart = rangeend = NULL;
+            return true;
+        };
+
+        prefilter->scan(first, last, [&](const char *p, size_t n) {
+            threadstats.candidates++;
+            auto & lit = prefilter->getliteral(n);
+            auto ws = std::max(done, p - std::min(lit.maxbefore, size_t(p - first)));
+            auto we = p + std::min(lit.text.size() + lit.maxafter, size_t(last - p));
+            if (rangestart && ws <= rangeend) {
+                rangeend = std::max(rangeend, we);
+            }
+            else {
+                if (rangestart && !flush()) {
+                    stopped = true;
+                    return false;
+                }
+                rangestart = ws;
+                rangeend = we;
+            }
+            return rangeend < tailstart;
+        });
+        if (stopped)
+            return NULL;
+
+        if (rangestart) {
+            if (rangeend < tailstart) {
+                if (!flush())
+                    return NULL;
+            }
+            else {
+                tailstart = std::min(tailstart, rangestart);
+            }
+        }
+        return searchrange(std::max(tailstart, done), last, first, last, cb, PARTIALFLAG);
+    }
+    bool countscandidates() const { return prefilter != nullptr; }
+
+    /*
+     *  search [first, last), 'bufstart' and 'bufend' are the limits of the entire buffer.
+     *
+     *  The byte before 'first' and the byte after 'last' are passed to the regex
+     *  engine as well, so '^', '$' and '\b' see the real neighbours of the range.
+     *  Matches starting after 'last' are left for the next range.
+     */
+    const char *searchrange(const char *first, const char *last, const char *bufstart, const char *bufend, CallbackType& cb, REGEX_CONST::match_flag_type flags) const
     {
-        REGEX_ITER<const char*> a(first, last, re   PARTIALARG);
+        if (first > bufstart)
+            flags |= REGEX_CONST::match_prev_avail;
+        auto end = last < bufend ? last + 1 : last;
+
+        REGEX_ITER<const char*> a(first, end, re, flags);
         REGEX_ITER<const char*> b;
 
         const char *maxpartial = NULL;
@@ -325,7 +845,10 @@ public:
         while (a != b) {
             auto m = (*a)[0];
             //printf("    match %d  %p..%p\n", m.matched, m.first, m.second);
-            if (m.matched) {
+            if (m.matched && m.first >= last && end > last) {
+                // in the lookahead byte
+            }
+            else if (m.matched) {
                 if (!cb(m.first, m.second)) {
                     //printf("searchrange: stopping\n");
                     return NULL;
@@ -380,7 +903,7 @@ public:
     /*
      *  perform any of the boost library search algorithms.
      */
-    const char *search(const char *first, const char *last, CallbackType cb)
+    const char *search(const char *first, const char *last, CallbackType cb) const
     {
         for (auto& hp : patterns)
         {
@@ -403,247 +926,3014 @@ public:
 
 /*
  * byte mask search
+ *
+ * Candidate positions are found by comparing one or two 'anchor' bytes of the
+ * pattern, 16 or 32 positions at a time, only the candidates are verified
+ * against the entire masked pattern.
+ * The anchors are the least likely bytes, preferably without wildcard bits.
  */
 class masksearch : public SearchBase {
-    std::vector<ByteMaskType> patterns;
-public:
-    masksearch(const std::vector<ByteMaskType> & bytemasks)
-        : patterns(bytemasks)
-    {
-        for (auto & bm : patterns)
-            if (bm.first.size() != bm.second.size())
-                print("WARNING: size mismatch between pattern and bytemask\n");
+    struct maskpattern {
+        ByteVector data;
+        ByteVector mask;
+        size_t size;        // unpadded size, data and mask are padded to 16 bytes
+        size_t anchor1;
+        size_t anchor2;
+        bool hasanchor;
 
-        // todo: maybe i can optimize this by splitting the patterns in 'full' and 'partial' sequences.
-        //    where 'full' is a sequence of bytes which has mask == 0xff
+        maskpattern(const ByteMaskType& bm)
+            : data(bm.first), mask(bm.second), size(bm.first.size()), anchor1(0), anchor2(0), hasanchor(false)
+        {
+            auto score = [this](size_t i) {
+                if (mask[i] == 0xFF)
+                    return bytefrequency(data[i]);
+                // a partially masked byte matches many more values
+                return 256 + 16 * (8 - (int)std::bitset<8>(mask[i]).count());
+            };
+            for (size_t i = 0 ; i < size ; i++) {
+                if (mask[i] == 0)
+                    continue;
+                if (!hasanchor || score(i) < score(anchor1)) {
+                    anchor2 = anchor1;
+                    anchor1 = i;
+                    hasanchor = true;
+                }
+                else if (anchor2 == anchor1 || score(i) < score(anchor2)) {
+                    anchor2 = i;
+                }
+            }
+            for (size_t i = 0 ; i < size ; i++)
+                data[i] &= mask[i];
+
+            data.resize((size + 15) & ~15);
+            mask.resize(data.size());
+        }
+
+        // compare the pattern at 'p', 'last' limits the vector loads.
+        bool verify(const char *p, const char *last) const
+        {
+            threadstats.candidates++;
+#ifdef WITH_X86_SIMD
+            if (size_t(last - p) >= data.size()) {
+                for (size_t i = 0 ; i < data.size() ; i += 16) {
+                    auto t = _mm_loadu_si128((const __m128i*)(p + i));
+                    auto m = _mm_loadu_si128((const __m128i*)&mask[i]);
+                    auto d = _mm_loadu_si128((const __m128i*)&data[i]);
+                    auto x = _mm_and_si128(_mm_xor_si128(t, d), m);
+                    if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF)
+                        return false;
+                }
+                return true;
+            }
+#endif
+            for (size_t i = 0 ; i < size ; i++)
+                if ((p[i] ^ data[i]) & mask[i])
+                    return false;
+            return true;
+        }
+    };
+    std::vector<maskpattern> patterns;
+
+    // candidate positions p are in [first, end), with end = last - size + 1
+    static bool scan_scalar(const maskpattern& mp, const char *first, const char *last, CallbackType& cb)
+    {
+        auto end = last - mp.size + 1;
+        for (auto p = first ; p < end ; p++) {
+            if (mp.hasanchor) {
+                auto a = p + mp.anchor1;
+                if (mp.mask[mp.anchor1] == 0xFF) {
+                    a = (const char*)memchr(a, mp.data[mp.anchor1], end - p);
+                    if (a == NULL)
+                        break;
+                    p = a - mp.anchor1;
+                }
+                else if ((*a & mp.mask[mp.anchor1]) != mp.data[mp.anchor1]) {
+                    continue;
+                }
+            }
+            if (mp.verify(p, last) && !cb(p, p + mp.size))
+                return false;
+        }
+        return true;
     }
-    const char *maskedsearch(const char *first, const char *last, ByteMaskType& bm)
+
+#ifdef WITH_X86_SIMD
+    static bool scan_sse2(const maskpattern& mp, const char *first, const char *last, CallbackType& cb)
     {
-        auto p = first;
+        auto end = last - mp.size + 1;
+        auto m1 = _mm_set1_epi8(mp.mask[mp.anchor1]);
+        auto d1 = _mm_set1_epi8(mp.data[mp.anchor1]);
+        auto m2 = _mm_set1_epi8(mp.mask[mp.anchor2]);
+        auto d2 = _mm_set1_epi8(mp.data[mp.anchor2]);
 
-        // bytes
-        auto b = &bm.first[0];
-        auto bend = b + bm.first.size();
+        auto p = first;
+        for ( ; end - p >= 16 ; p += 16) {
+            auto e1 = _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i*)(p + mp.anchor1)), m1), d1);
+            auto e2 = _mm_cmpeq_epi8(_mm_and_si128(_mm_loadu_si128((const __m128i*)(p + mp.anchor2)), m2), d2);
+            unsigned bits = _mm_movemask_epi8(_mm_and_si128(e1, e2));
+            while (bits) {
+                auto q = p + __builtin_ctz(bits);
+                bits &= bits - 1;
+                if (mp.verify(q, last) && !cb(q, q + mp.size))
+                    return false;
+            }
+        }
+        return scan_scalar(mp, p, last, cb);
+    }
 
-        // mask 
-        auto m = &bm.second[0];
+    __attribute__((target("avx2")))
+    static bool scan_avx2(const maskpattern& mp, const char *first, const char *last, CallbackType& cb)
+    {
+        auto end = last - mp.size + 1;
+        auto m1 = _mm256_set1_epi8(mp.mask[mp.anchor1]);
+        auto d1 = _mm256_set1_epi8(mp.data[mp.anchor1]);
+        auto m2 = _mm256_set1_epi8(mp.mask[mp.anchor2]);
+        auto d2 = _mm256_set1_epi8(mp.data[mp.anchor2]);
 
-        while (p != last)
-        {
-            if (((*p ^ *b)&(*m)) == 0) {
-                ++b; ++m;
-                if (b==bend)
-                    return p - bm.first.size();
+        auto p = first;
+        for ( ; end - p >= 32 ; p += 32) {
+            auto e1 = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p + mp.anchor1)), m1), d1);
+            auto e2 = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_loadu_si256((const __m256i*)(p + mp.anchor2)), m2), d2);
+            unsigned bits = _mm256_movemask_epi8(_mm256_and_si256(e1, e2));
+            while (bits) {
+                auto q = p + __builtin_ctz(bits);
+                bits &= bits - 1;
+                if (mp.verify(q, last) && !cb(q, q + mp.size))
+                    return false;
             }
-            else {
-                b = &bm.first[0];
+        }
+        return scan_sse2(mp, p, last, cb);
+    }
+#endif
+
+    typedef bool (*ScanFunction)(const maskpattern& mp, const char *first, const char *last, CallbackType& cb);
+    ScanFunction scan = scan_scalar;
+public:
+    masksearch(const std::vector<ByteMaskType> & bytemasks)
+    {
+        for (auto & bm : bytemasks) {
+            if (bm.first.size() != bm.second.size()) {
+                print("WARNING: size mismatch between pattern and bytemask\n");
+                continue;
             }
+            if (bm.first.empty())
+                continue;
+            patterns.emplace_back(bm);
         }
-        return last;
+#ifdef WITH_X86_SIMD
+        if (__builtin_cpu_supports("avx2"))
+            scan = scan_avx2;
+        else
+            scan = scan_sse2;
+#endif
     }
 
     /*
      *  do a bytemask search.
      */
-    const char *search(const char *first, const char *last, CallbackType cb)
+    const char *search(const char *first, const char *last, CallbackType cb) const
     {
-        for (auto& bm : patterns)
+        for (auto& mp : patterns)
         {
-            auto size = bm.first.size();
-
-            auto p = first;
-            while (p != last) {
-                auto f = maskedsearch(p, last, bm);
-                if (f == last)
-                    break;
-                if (!cb((const char*)f, (const char*)f + size))
-                    return NULL;
-                p = f + 1;
-            }
+            if (size_t(last - first) < mp.size)
+                continue;
+            auto scanner = mp.hasanchor ? scan : scan_scalar;
+            if (!scanner(mp, first, last, cb))
+                return NULL;
         }
         return last;
     }
+    bool countscandidates() const { return true; }
 };
+
 /*
- * The various search algoritms implemented in findstr.
+ * returns the offset and length of the longest run of fully masked bytes.
  */
-enum SearchType {
-    REGEX_SEARCH,
-    STD_SEARCH,
-    STD_BOYER_MOORE,
-    STD_BOYER_MOORE_HORSPOOL,
-    BOOST_BOYER_MOORE,
-    BOOST_BOYER_MOORE_HORSPOOL,
-    BOOST_KNUTH_MORRIS_PRATT,
-    BYTEMASK_SEARCH,
-};
+static std::pair<size_t, size_t> longestfullmask(const uint8_t *mask, size_t size)
+{
+    size_t bestofs = 0, bestlen = 0;
+    size_t runofs = 0, runlen = 0;
+    for (size_t i = 0 ; i < size ; i++) {
+        if (mask[i] == 0xFF) {
+            if (runlen == 0)
+                runofs = i;
+            runlen++;
+            if (runlen > bestlen) {
+                bestofs = runofs;
+                bestlen = runlen;
+            }
+        }
+        else {
+            runlen = 0;
+        }
+    }
+    return { bestofs, bestlen };
+}
+static std::pair<size_t, size_t> longestfullmask(const ByteMaskType& bm)
+{
+    return longestfullmask(bm.second.data(), bm.second.size());
+}
 
+/*
+ * A set of bytemasks, stored in a few contiguous arrays instead of two
+ * vectors per pattern, so the 100000s of patterns from -F take little
+ * more memory than their bytes.
+ *
+ * A pattern can also match as utf-16 or utf-32, with each byte followed
+ * by 1 or 3 zero bytes, without storing these variants.
+ */
+class patternset {
+    cachedarray<uint8_t> bytes;         // the data of each pattern, followed by its mask, when it has wildcards
+    cachedarray<uint32_t> offsets{0};   // pattern i is at [offsets[i], offsets[i+1])
+    cachedarray<uint32_t> ids;          // reported with the match, the line in the -F file
+    cachedarray<uint8_t> flags;
+    std::shared_ptr<patterncache> cache;
+public:
+    enum {
+        FOLDCASE = 1,   // ignore the case of letters
+        HASMASK = 2,
+        // the encodings to match
+        NARROW = 0x10,
+        UTF16 = 0x20,
+        UTF32 = 0x40,
+    };
 
-struct findstr {
-    bool matchword = false;      // modifies pattern
-    bool matchbinary = false;    // modifies pattern, modifies verbose output
-    bool matchcase = false;      // modifies pattern
-    bool matchstart = false;      // modifies pattern
-    bool pattern_is_hex = false; // modifies verbose output, implies binary
-    bool pattern_is_guid = false;// modifies verbose output, implies binary
-    int verbose = 0;             // modifies ouput
-    bool list_only = false;      // modifies ouput
-    bool count_only = false;     // modifies ouput
-    bool readcontinuous = false; // read until ctrl-c, instead of until eof
-    bool use_sequential = false; // use read, instead of mmap
-    uint64_t maxfilesize = 0;
-    bool nameprinted = false;
+    patternset() { }
+    patternset(const std::vector<ByteMaskType> & bytemasks, bool matchcase)
+    {
+        for (size_t i = 0 ; i < bytemasks.size() ; i++) {
+            auto & bm = bytemasks[i];
+            if (bm.first.size() != bm.second.size()) {
+                print("WARNING: size mismatch between pattern and bytemask\n");
+                continue;
+            }
+            add(bm, i, (matchcase ? 0 : FOLDCASE) | NARROW);
+        }
+    }
+    patternset(std::shared_ptr<patterncache> cache)
+        : cache(cache)
+    {
+        cache->loadarray(bytes);
+        cache->loadarray(offsets);
+        cache->loadarray(ids);
+        cache->loadarray(flags);
+        validate();
+    }
+    // a damaged, or stale cache must not make the search read outside the arrays.
+    void validate() const
+    {
+        bool ok = offsets.size() == ids.size() + 1 && flags.size() == ids.size() && offsets[0] == 0;
+        for (size_t i = 0 ; ok && i < ids.size() ; i++)
+            ok = offsets[i] <= offsets[i+1] && offsets[i+1] <= bytes.size()
+                && !((flags[i] & HASMASK) && (offsets[i+1] - offsets[i]) % 2);
+        if (!ok)
+            throw std::runtime_error("invalid pattern cache");
+    }
+    void save(patterncache::writer& w) const
+    {
+        w.addarray(bytes);
+        w.addarray(offsets);
+        w.addarray(ids);
+        w.addarray(flags);
+    }
+    void add(const ByteMaskType& bm, uint32_t id, uint8_t flags)
+    {
+        if (bm.first.empty())
+            return;
+        bool hasmask = std::find_if(bm.second.begin(), bm.second.end(), [](uint8_t m) { return m != 0xFF; }) != bm.second.end();
+        if (bytes.size() + 2 * bm.first.size() > UINT32_MAX)
+            throw std::runtime_error("too many pattern bytes");
+        bytes.append(bm.first.begin(), bm.first.end());
+        if (hasmask)
+            bytes.append(bm.second.begin(), bm.second.end());
+        offsets.push_back(bytes.size());
+        ids.push_back(id);
+        this->flags.push_back(flags | (hasmask ? HASMASK : 0));
+    }
+
+    size_t size() const { return ids.size(); }
+    // the nr of bytes in the narrow encoding
+    size_t length(size_t i) const { return (offsets[i+1] - offsets[i]) >> (flags[i] & HASMASK ? 1 : 0); }
+    const uint8_t *data(size_t i) const { return &bytes[offsets[i]]; }
+    // NULL when all bytes must match
+    const uint8_t *mask(size_t i) const { return flags[i] & HASMASK ? &bytes[offsets[i]] + length(i) : NULL; }
+    uint32_t id(size_t i) const { return ids[i]; }
+    bool foldcase(size_t i) const { return flags[i] & FOLDCASE; }
+    bool hasencoding(size_t i, int width) const { return flags[i] & (width == 1 ? NARROW : width == 2 ? UTF16 : UTF32); }
+    size_t maxlength() const
+    {
+        size_t len = 0;
+        for (size_t i = 0 ; i < size() ; i++)
+            len = std::max(len, length(i) * (hasencoding(i, 4) ? 4 : hasencoding(i, 2) ? 2 : 1));
+        return len;
+    }
+};
+
+/*
+ * Aho-Corasick multi-pattern search.
+ *
+ * All patterns are combined into a single automaton, so the data is scanned
+ * only once, no matter how many patterns, or unicode variants there are.
+ *
+ * The automaton is built from a 'key' in each variant of a pattern: the
+ * MAXKEY bytes with the rarest bytes in the longest run of fully masked bytes.
+ * The rest of the pattern is verified after the key was found.
+ *
+ * The states are numbered breadth first.  The shallow states, where the
+ * search spends most of its time, have a full row of transitions, up to
+ * MAXDENSE bytes in total.  The deeper states only store their trie edges,
+ * other bytes follow the failure links until a state with a full row.
+ * So the memory grows with the total key length, not with the number of
+ * states times the number of distinct bytes.
+ */
+class acsearch : public SearchBase {
+    std::shared_ptr<const patternset> patterns;
+    std::shared_ptr<patterncache> cache;
+
+    // a pattern in one of its encodings
+    struct variant {
+        uint32_t pattern;
+        uint32_t keyofs;    // offset of the key in the encoded pattern
+        uint8_t keylen;
+        uint8_t shift;      // log2 of the character size
+        uint8_t unused[2] = {};     // the padding, zero in the cache file
+    };
+    cachedarray<variant> variants;
+    cachedarray<uint32_t> unanchored;   // variants without any fully masked byte
+
+    std::array<uint8_t, 256> fold;      // case folding, identity when all patterns match case
+    std::array<uint16_t, 256> classmap; // byte -> equivalence class
+    unsigned nclasses = 0;
+
+    // the search uses state codes: the offset of the row of a state with a full row,
+    // or SPARSE + the state. The rows of states in which keys may end are last,
+    // they, and all sparse states, have a code >= 'finalcode'.
+    uint32_t ndense = 0;                // states below this have a full transition row
+    cachedarray<uint32_t> dense;        // the next state code, indexed by code + class
+    cachedarray<uint32_t> staterow;     // the code of each state with a full row
+    cachedarray<uint32_t> rowstate;     // the state of each row
+    uint32_t finalcode = 0;
+
+    // the trie edges of state s are [edgestart[s], edgestart[s+1]), sorted by class.
+    // the states are numbered in the same order as the edges, edge e leads to state e+1.
+    cachedarray<uint32_t> edgestart;
+    cachedarray<uint16_t> edgeclass;
+    cachedarray<uint32_t> fail;
+
+    // per state: the first variant with a key ending in that state, and a link
+    // to the next state on the failure chain which has variants.
+    // per variant: the next variant with the same key.
+    cachedarray<uint32_t> firstout;
+    cachedarray<uint32_t> nextout;
+    cachedarray<uint32_t> dictlink;
+    cachedarray<uint8_t> isfinal;
+
+    static constexpr uint32_t NOLINK = ~uint32_t(0);
+    static constexpr uint32_t SPARSE = 0x80000000;
+public:
+    static constexpr size_t MAXKEY = 8;
+    static constexpr size_t MAXDENSE = 0x1000000;
+
+    acsearch(std::shared_ptr<const patternset> ps)
+        : patterns(ps)
+    {
+        bool foldcase = false;
+        for (size_t i = 0 ; i < patterns->size() ; i++)
+            foldcase |= patterns->foldcase(i);
+        for (int c = 0 ; c < 256 ; c++)
+            fold[c] = foldcase ? tolower(c) : c;
+
+        std::array<uint8_t, 256> freq;
+        for (int c = 0 ; c < 256 ; c++)
+            freq[c] = bytefrequency(fold[c]);
+        for (uint32_t i = 0 ; i < patterns->size() ; i++)
+            for (uint8_t shift = 0 ; shift < 3 ; shift++)
+                if (patterns->hasencoding(i, 1 << shift))
+                    variants.push_back(selectkey(i, shift, freq));
+        for (uint32_t v = 0 ; v < variants.size() ; v++)
+            if (variants[v].keylen == 0)
+                unanchored.push_back(v);
+
+        // only bytes used in a key get their own class, all others map to class 0.
+        // the classes are in byte order, so the edges sorted by byte are sorted by class.
+        std::array<bool, 256> used{};
+        for (auto & v : variants)
+            for (size_t j = 0 ; j < v.keylen ; j++)
+                used[fold[byte(v, v.keyofs + j)]] = true;
+        classmap.fill(0);
+        nclasses = 1;
+        for (int c = 0 ; c < 256 ; c++)
+            if (used[c])
+                classmap[c] = nclasses++;
+        for (int c = 0 ; c < 256 ; c++)
+            classmap[c] = classmap[fold[c]];
+
+        buildtrie();
+        buildfailures();
+        layoutrows();
+    }
+
+    // load an automaton saved with 'save'
+    acsearch(std::shared_ptr<patterncache> cache)
+        : patterns(std::make_shared<patternset>(cache)), cache(cache)
+    {
+        cache->loadarray(variants);
+        cache->loadarray(unanchored);
+        cache->loadvalue(fold);
+        cache->loadvalue(classmap);
+        cache->loadvalue(nclasses);
+        cache->loadvalue(ndense);
+        cache->loadvalue(finalcode);
+        cache->loadarray(dense);
+        cache->loadarray(staterow);
+        cache->loadarray(rowstate);
+        cache->loadarray(edgestart);
+        cache->loadarray(edgeclass);
+        cache->loadarray(fail);
+        cache->loadarray(firstout);
+        cache->loadarray(nextout);
+        cache->loadarray(dictlink);
+        cache->loadarray(isfinal);
+        validate();
+    }
+    void save(patterncache::writer& w) const
+    {
+        patterns->save(w);
+        w.addarray(variants);
+        w.addarray(unanchored);
+        w.addvalue(fold);
+        w.addvalue(classmap);
+        w.addvalue(nclasses);
+        w.addvalue(ndense);
+        w.addvalue(finalcode);
+        w.addarray(dense);
+        w.addarray(staterow);
+        w.addarray(rowstate);
+        w.addarray(edgestart);
+        w.addarray(edgeclass);
+        w.addarray(fail);
+        w.addarray(firstout);
+        w.addarray(nextout);
+        w.addarray(dictlink);
+        w.addarray(isfinal);
+    }
+    std::shared_ptr<const patternset> getpatterns() const { return patterns; }
+
+    /*
+     *  check that all states, codes, classes and variants in a loaded automaton
+     *  are in range, and that the failure, dictionary and output links end.
+     */
+    void validate() const
+    {
+        auto check = [](bool ok) {
+            if (!ok)
+                throw std::runtime_error("invalid pattern cache");
+        };
+        size_t nstates = firstout.size();
+        check(nclasses > 0 && nclasses <= 256 && nstates > 0 && nstates < SPARSE && ndense > 0 && ndense <= nstates);
+        check(edgestart.size() == nstates + 1 && edgeclass.size() + 1 == nstates && fail.size() == nstates
+                && dictlink.size() == nstates && isfinal.size() == nstates && nextout.size() == variants.size());
+        check(staterow.size() == ndense && rowstate.size() == ndense && dense.size() == size_t(ndense) * nclasses
+                && finalcode <= dense.size());
+
+        for (auto cls : classmap)
+            check(cls < nclasses);
+        for (auto cls : edgeclass)
+            check(cls < nclasses);
+        for (auto & v : variants)
+            check(v.pattern < patterns->size() && v.shift <= 2 && v.keylen <= MAXKEY && v.keyofs + v.keylen <= length(v));
+        for (auto vi : unanchored)
+            check(vi < variants.size());
+
+        check(edgestart[0] == 0 && edgestart[nstates] == edgeclass.size());
+        for (uint32_t s = 0 ; s < nstates ; s++)
+            check(edgestart[s] <= edgestart[s+1] && (s == 0 || fail[s] < s) && (dictlink[s] == NOLINK || dictlink[s] < s));
+        for (uint32_t s = 0 ; s < ndense ; s++)
+            check(staterow[s] % nclasses == 0 && staterow[s] < dense.size() && rowstate[s] < ndense);
+        for (auto code : dense)
+            check(code & SPARSE ? (code & ~SPARSE) < nstates : code % nclasses == 0 && code < dense.size());
+
+        // each variant is on at most one output list.
+        std::vector<bool> listed(variants.size());
+        for (uint32_t s = 0 ; s < nstates ; s++)
+            for (auto vi = firstout[s] ; vi != NOLINK ; vi = nextout[vi]) {
+                check(vi < variants.size() && !listed[vi]);
+                listed[vi] = true;
+            }
+    }
+
+    size_t length(const variant& v) const { return patterns->length(v.pattern) << v.shift; }
+
+    // byte 'j' of the encoded pattern, and its mask.
+    uint8_t byte(const variant& v, size_t j) const
+    {
+        if (j & ((1 << v.shift) - 1))
+            return 0;
+        return patterns->data(v.pattern)[j >> v.shift];
+    }
+    uint8_t maskbyte(const variant& v, size_t j) const
+    {
+        auto m = patterns->mask(v.pattern);
+        if (!m || (j & ((1 << v.shift) - 1)))
+            return 0xFF;
+        return m[j >> v.shift];
+    }
+
+    /*
+     *  the window of at most MAXKEY bytes with the lowest total 'freq',
+     *  in the longest run of fully masked bytes.
+     */
+    variant selectkey(uint32_t i, uint8_t shift, const std::array<uint8_t, 256>& freq) const
+    {
+        variant v = { i, 0, 0, shift };
+        size_t n = length(v);
+
+        size_t ofs = 0, len = n;
+        if (patterns->mask(i)) {
+            size_t runlen = 0;
+            len = 0;
+            for (size_t j = 0 ; j < n ; j++) {
+                runlen = maskbyte(v, j) == 0xFF ? runlen + 1 : 0;
+                if (runlen > len) {
+                    ofs = j + 1 - runlen;
+                    len = runlen;
+                }
+            }
+        }
+        if (len > MAXKEY) {
+            int sum = 0, best = 0;
+            size_t bestofs = ofs;
+            for (size_t j = ofs ; j < ofs + len ; j++) {
+                sum += freq[byte(v, j)];
+                if (j < ofs + MAXKEY - 1)
+                    continue;
+                if (j >= ofs + MAXKEY)
+                    sum -= freq[byte(v, j - MAXKEY)];
+                if (j == ofs + MAXKEY - 1 || sum < best) {
+                    best = sum;
+                    bestofs = j + 1 - MAXKEY;
+                }
+            }
+            ofs = bestofs;
+            len = MAXKEY;
+        }
+        v.keyofs = ofs;
+        v.keylen = len;
+        return v;
+    }
+
+    /*
+     *  build the trie breadth first from the sorted keys.
+     *  each state is a range of keys with a common prefix, of which the keys
+     *  ending in the state come first.
+     */
+    void buildtrie()
+    {
+        // the folded keys, copied to a single array for fast sorting
+        struct sortkey {
+            uint8_t bytes[MAXKEY];
+            uint8_t len;
+            uint32_t v;
+            bool operator<(const sortkey& rhs) const
+            {
+                int r = std::memcmp(bytes, rhs.bytes, std::min(len, rhs.len));
+                return r ? r < 0 : len < rhs.len;
+            }
+        };
+        std::vector<sortkey> keys;
+        for (uint32_t vi = 0 ; vi < variants.size() ; vi++) {
+            auto & v = variants[vi];
+            if (v.keylen == 0)
+                continue;
+            sortkey k;
+            for (size_t j = 0 ; j < v.keylen ; j++)
+                k.bytes[j] = fold[byte(v, v.keyofs + j)];
+            k.len = v.keylen;
+            k.v = vi;
+            keys.push_back(k);
+        }
+        std::sort(keys.begin(), keys.end());
+
+        // the states of one level, in the order in which they are numbered.
+        struct range {
+            uint32_t first, last;
+        };
+        std::vector<range> level{ { 0, uint32_t(keys.size()) } }, nextlevel;
+        nextout.assign(variants.size(), NOLINK);
+
+        for (size_t depth = 0 ; !level.empty() ; depth++) {
+            for (auto [first, last] : level) {
+                uint32_t out = NOLINK;
+                for ( ; first < last && keys[first].len == depth ; first++) {
+                    nextout[keys[first].v] = out;
+                    out = keys[first].v;
+                }
+                firstout.push_back(out);
+
+                edgestart.push_back(edgeclass.size());
+                while (first < last) {
+                    auto c = keys[first].bytes[depth];
+                    auto end = first + 1;
+                    while (end < last && keys[end].bytes[depth] == c)
+                        end++;
+                    edgeclass.push_back(classmap[c]);
+                    nextlevel.push_back({ first, end });
+                    first = end;
+                }
+            }
+            level.swap(nextlevel);
+            nextlevel.clear();
+        }
+        edgestart.push_back(edgeclass.size());
+        firstout.shrink_to_fit();
+        edgestart.shrink_to_fit();
+        edgeclass.shrink_to_fit();
+    }
+
+    // the trie edge from 's' with class 'cls', or NOLINK.
+    uint32_t edge(uint32_t s, unsigned cls) const
+    {
+        auto first = edgeclass.begin() + edgestart[s];
+        auto last = edgeclass.begin() + edgestart[s+1];
+        auto i = std::lower_bound(first, last, cls);
+        if (i == last || *i != cls)
+            return NOLINK;
+        return (i - edgeclass.begin()) + 1;
+    }
+    // while building, the rows contain states, instead of codes.
+    uint32_t nextstate(uint32_t s, unsigned cls) const
+    {
+        while (s >= ndense) {
+            auto t = edge(s, cls);
+            if (t != NOLINK)
+                return t;
+            s = fail[s];
+        }
+        return dense[size_t(s) * nclasses + cls];
+    }
+    // the code of the state after 'cls' in sparse state 's'.
+    uint32_t next(uint32_t s, unsigned cls) const
+    {
+        while (s >= ndense) {
+            auto t = edge(s, cls);
+            if (t != NOLINK)
+                return SPARSE | t;
+            s = fail[s];
+        }
+        return dense[staterow[s] + cls];
+    }
+    uint32_t codestate(uint32_t code) const
+    {
+        return code & SPARSE ? code & ~SPARSE : rowstate[code / nclasses];
+    }
+
+    /*
+     *  breadth first: calculate the failure links, and the full rows.
+     *  the failure link of a state always leads to a state with a lower number.
+     */
+    void buildfailures()
+    {
+        uint32_t nstates = firstout.size();
+        if (nstates >= SPARSE)
+            throw std::runtime_error("too many patterns");
+        ndense = std::min<size_t>(nstates, std::max<size_t>(1, MAXDENSE / (nclasses * sizeof(uint32_t))));
+        dense.assign(size_t(ndense) * nclasses, 0);
+        fail.assign(nstates, 0);
+        dictlink.assign(nstates, NOLINK);
+        isfinal.assign(nstates, 0);
+
+        for (uint32_t s = 0 ; s < nstates ; s++) {
+            auto f = fail[s];
+            if (s) {
+                dictlink[s] = firstout[f] != NOLINK ? f : dictlink[f];
+                isfinal[s] = firstout[s] != NOLINK || dictlink[s] != NOLINK;
+            }
+            for (auto e = edgestart[s] ; e < edgestart[s+1] ; e++)
+                fail[e + 1] = s ? nextstate(f, edgeclass[e]) : 0;
+            if (s < ndense) {
+                auto row = &dense[size_t(s) * nclasses];
+                if (s)
+                    std::copy_n(&dense[size_t(f) * nclasses], nclasses, row);
+                for (auto e = edgestart[s] ; e < edgestart[s+1] ; e++)
+                    row[edgeclass[e]] = e + 1;
+            }
+        }
+    }
+
+    /*
+     *  replace the states in the rows by codes, with the rows of the final
+     *  states last, so the search needs a single compare to find these.
+     */
+    void layoutrows()
+    {
+        staterow.assign(ndense, 0);
+        rowstate.clear();
+        for (int final = 0 ; final < 2 ; final++)
+            for (uint32_t s = 0 ; s < ndense ; s++)
+                if (isfinal[s] == final) {
+                    if (final && finalcode == 0)
+                        finalcode = rowstate.size() * nclasses;
+                    staterow[s] = rowstate.size() * nclasses;
+                    rowstate.push_back(s);
+                }
+        if (finalcode == 0)
+            finalcode = dense.size();
+
+        std::vector<uint32_t> codes(dense.size());
+        for (uint32_t s = 0 ; s < ndense ; s++)
+            for (unsigned cls = 0 ; cls < nclasses ; cls++) {
+                auto t = dense[size_t(s) * nclasses + cls];
+                codes[staterow[s] + cls] = t < ndense ? staterow[t] : SPARSE | t;
+            }
+        dense = std::move(codes);
+    }
+
+    // the key is the entire pattern, and it is folded only when the pattern ignores case.
+    bool needverify(const variant& v) const
+    {
+        return v.keylen < length(v) || (!patterns->foldcase(v.pattern) && fold['A'] != 'A');
+    }
+    bool verify(const variant& v, const char *p) const
+    {
+        auto d = patterns->data(v.pattern);
+        auto m = patterns->mask(v.pattern);
+        auto n = patterns->length(v.pattern);
+        bool foldcase = patterns->foldcase(v.pattern);
+        auto w = size_t(1) << v.shift;
+        for (size_t j = 0 ; j < n ; j++, p += w) {
+            uint8_t a = *p, b = d[j];
+            if (foldcase) {
+                a = fold[a];
+                b = fold[b];
+            }
+            if ((a ^ b) & (m ? m[j] : 0xFF))
+                return false;
+            for (size_t k = 1 ; k < w ; k++)
+                if (p[k])
+                    return false;
+        }
+        return true;
+    }
+
+    /*
+     *  calls fn(v, p) for all variants 'v' matching at 'p' in [first, last),
+     *  in order of the end of the key.
+     */
+    template<typename FN>
+    bool scan(const char *first, const char *last, FN fn) const
+    {
+        uint32_t code = 0;
+        for (auto p = first ; p < last ; p++) {
+            auto cls = classmap[(uint8_t)*p];
+            code = code & SPARSE ? next(code & ~SPARSE, cls) : dense[code + cls];
+            if (code < finalcode)
+                continue;
+            auto s = codestate(code);
+            if (!isfinal[s])
+                continue;
+            for (auto t = firstout[s] != NOLINK ? s : dictlink[s] ; t != NOLINK ; t = dictlink[t])
+                for (auto vi = firstout[t] ; vi != NOLINK ; vi = nextout[vi]) {
+                    auto & v = variants[vi];
+                    threadstats.candidates++;
+                    // the pattern around the key must be inside the searched range
+                    auto keystart = p + 1 - v.keylen;
+                    if (keystart - first < (ptrdiff_t)v.keyofs)
+                        continue;
+                    auto m = keystart - v.keyofs;
+                    if (last - m < (ptrdiff_t)length(v))
+                        continue;
+                    if (needverify(v) && !verify(v, m))
+                        continue;
+                    if (!fn(v, m))
+                        return false;
+                }
+        }
+
+        for (auto vi : unanchored) {
+            auto & v = variants[vi];
+            for (auto p = first ; last - p >= (ptrdiff_t)length(v) ; p++)
+                if (verify(v, p) && !fn(v, p))
+                    return false;
+        }
+        return true;
+    }
+
+    const char *search(const char *first, const char *last, CallbackType cb) const
+    {
+        if (!scan(first, last, [this, &cb](const variant& v, const char *p) { return cb(p, p + length(v)); }))
+            return NULL;
+        return last;
+    }
+    bool countscandidates() const { return true; }
+
+    // the id of the pattern which matched exactly [first, last)
+    int64_t patternid(const char *first, const char *last) const
+    {
+        int64_t id = -1;
+        scan(first, last, [this, &id, first, last](const variant& v, const char *p) {
+            if (p != first || length(v) != size_t(last - first))
+                return true;
+            id = patterns->id(v.pattern);
+            return false;
+        });
+        return id;
+    }
+};
+
+/*
+ * unicode helpers for textsearch
+ */
+enum TextEncoding {
+    LATIN1_TEXT,        // one byte per character, used for patterns which are not valid utf-8
+    UTF8_TEXT,
+    UTF16LE_TEXT,
+    UTF16BE_TEXT,
+    UTF32LE_TEXT,
+    UTF32BE_TEXT,
+};
+
+/*
+ *  returns the other case of unicode character 'c', or 'c' itself.
+ *  Only simple one to one mappings are handled, for latin, greek, cyrillic and armenian.
+ */
+static uint32_t othercase(uint32_t c)
+{
+    // ranges where the upper and lower case differ by a fixed distance
+    static const struct { uint32_t first, last; int32_t delta; } shifted[] = {
+        { 'A', 'Z', 0x20 }, { 'a', 'z', -0x20 },
+        { 0xC0, 0xD6, 0x20 }, { 0xD8, 0xDE, 0x20 }, { 0xE0, 0xF6, -0x20 }, { 0xF8, 0xFE, -0x20 },
+        { 0x391, 0x3A1, 0x20 }, { 0x3A3, 0x3AB, 0x20 }, { 0x3B1, 0x3C1, -0x20 }, { 0x3C3, 0x3CB, -0x20 },
+        { 0x400, 0x40F, 0x50 }, { 0x410, 0x42F, 0x20 }, { 0x430, 0x44F, -0x20 }, { 0x450, 0x45F, -0x50 },
+        { 0x531, 0x556, 0x30 }, { 0x561, 0x586, -0x30 },
+    };
+    // ranges of alternating upper and lower case, starting with an upper case character
+    static const struct { uint32_t first, last; } paired[] = {
+        { 0x100, 0x12F }, { 0x132, 0x137 }, { 0x139, 0x148 }, { 0x14A, 0x177 }, { 0x179, 0x17E },
+        { 0x460, 0x481 }, { 0x48A, 0x4BF }, { 0x4D0, 0x52F }, { 0x1E00, 0x1E95 }, { 0x1EA0, 0x1EFF },
+    };
+    for (auto & r : shifted)
+        if (c >= r.first && c <= r.last)
+            return c + r.delta;
+    for (auto & r : paired)
+        if (c >= r.first && c <= r.last)
+            return ((c - r.first) & 1) ? c - 1 : c + 1;
+    if (c == 0xFF)
+        return 0x178;
+    if (c == 0x178)
+        return 0xFF;
+    return c;
+}
+
+// decodes utf-8 text, returns false when it is not valid utf-8.
+static bool decodeutf8(const std::string& txt, std::vector<uint32_t>& chars)
+{
+    for (size_t i = 0 ; i < txt.size() ; ) {
+        uint8_t c = txt[i];
+        int n = c < 0x80 ? 0 : (c & 0xE0) == 0xC0 ? 1 : (c & 0xF0) == 0xE0 ? 2 : (c & 0xF8) == 0xF0 ? 3 : -1;
+        if (n < 0 || i + n >= txt.size() + (n == 0))
+            return false;
+        uint32_t value = n ? c & (0x3F >> n) : c;
+        for (int j = 1 ; j <= n ; j++) {
+            if ((txt[i + j] & 0xC0) != 0x80)
+                return false;
+            value = (value << 6) | (txt[i + j] & 0x3F);
+        }
+        // reject overlong encodings and surrogates
+        static const uint32_t minvalue[] = { 0, 0x80, 0x800, 0x10000 };
+        if (value < minvalue[n] || value > 0x10FFFF || (value >= 0xD800 && value < 0xE000))
+            return false;
+        chars.push_back(value);
+        i += n + 1;
+    }
+    return true;
+}
+
+static void encodechar(uint32_t c, TextEncoding enc, ByteVector& out)
+{
+    switch(enc) {
+        case LATIN1_TEXT:
+            out.push_back(c);
+            break;
+        case UTF8_TEXT:
+            if (c < 0x80) {
+                out.push_back(c);
+            }
+            else if (c < 0x800) {
+                out.push_back(0xC0 | (c >> 6));
+                out.push_back(0x80 | (c & 0x3F));
+            }
+            else if (c < 0x10000) {
+                out.push_back(0xE0 | (c >> 12));
+                out.push_back(0x80 | ((c >> 6) & 0x3F));
+                out.push_back(0x80 | (c & 0x3F));
+            }
+            else {
+                out.push_back(0xF0 | (c >> 18));
+                out.push_back(0x80 | ((c >> 12) & 0x3F));
+                out.push_back(0x80 | ((c >> 6) & 0x3F));
+                out.push_back(0x80 | (c & 0x3F));
+            }
+            break;
+        case UTF16LE_TEXT:
+        case UTF16BE_TEXT:
+            if (c >= 0x10000) {
+                encodechar(0xD800 + ((c - 0x10000) >> 10), enc, out);
+                encodechar(0xDC00 + (c & 0x3FF), enc, out);
+            }
+            else if (enc == UTF16LE_TEXT) {
+                out.push_back(c);
+                out.push_back(c >> 8);
+            }
+            else {
+                out.push_back(c >> 8);
+                out.push_back(c);
+            }
+            break;
+        case UTF32LE_TEXT:
+            for (int i = 0 ; i < 32 ; i += 8)
+                out.push_back(c >> i);
+            break;
+        case UTF32BE_TEXT:
+            for (int i = 24 ; i >= 0 ; i -= 8)
+                out.push_back(c >> i);
+            break;
+    }
+}
+
+/*
+ * Text search, in all unicode encodings in a single pass.
+ *
+ * Each text is encoded as utf-8, utf-16 and utf-32, little and big endian.
+ * Unless matching case, each character also matches its other case, see othercase.
+ *
+ * Each encoded text has an 'anchor': a byte of its least likely character, and
+ * a 'check': a byte of the next least likely character. All anchor values, of
+ * all encodings and case variants, are compared 16 or 32 bytes at a time,
+ * together with the check values, at the distances the check has from the
+ * anchor in each encoding. The distances depend on the character width, so
+ * the check is what makes the scan selective for utf-16 and utf-32 text.
+ *
+ * At a candidate the encodings using that anchor value are verified with a
+ * masked compare, the mask clears the bits in which the case variants differ.
+ * When that is not exact, like for some cyrillic letters, the characters are
+ * compared one by one.
+ *
+ * Big endian text is also little endian text starting one byte later, when
+ * both encodings match, only the little endian match is reported.
+ */
+class textsearch : public SearchBase {
+    struct entry {
+        TextEncoding encoding;
+        ByteVector text;    // the encoded text
+        ByteVector other;   // the same, with the case of each character swapped
+        ByteVector data;    // 'text' with the case bits cleared, padded to 16 bytes
+        ByteVector mask;
+        size_t size;
+        size_t anchor = 0;  // offset of the anchor byte
+        size_t check = 0;   // offset of a second byte, checked before the full compare
+        bool exact = true;  // the masked compare is sufficient
+        std::vector<std::pair<size_t, size_t>> chars;   // offset and length of each character
+        int sibling = -1;   // for big endian text: the little endian entry, matching 'siblingofs' later
+        size_t siblingofs = 0;
+    };
+    std::vector<entry> entries;
+    std::array<std::vector<uint32_t>, 256> byanchor;    // the entries with this anchor value
+    ByteVector anchorbytes;
+
+    // the check values, by their distance from the anchor
+    std::vector<std::pair<ptrdiff_t, ByteVector>> checks;
+    ptrdiff_t mincheck = 0;
+    ptrdiff_t maxcheck = 0;
+
+    bool useavx2 = false;
+public:
+    static constexpr size_t MAXANCHORS = 8;
+    static constexpr size_t MAXCOMPARES = 16;   // anchor and check values, compared for each vector
+
+    /*
+     *  'texts' are utf-8, or latin-1 when not valid utf-8.
+     *  with 'bytesonly' the utf-16 and utf-32 encodings are not searched.
+     */
+    textsearch(const std::vector<std::string>& texts, bool matchcase, bool bytesonly)
+    {
+        for (auto & txt : texts) {
+            if (txt.empty())
+                continue;
+            std::vector<uint32_t> chars;
+            auto bytes = UTF8_TEXT;
+            if (!decodeutf8(txt, chars)) {
+                chars.assign((const uint8_t*)txt.data(), (const uint8_t*)txt.data() + txt.size());
+                bytes = LATIN1_TEXT;
+            }
+            std::vector<TextEncoding> encodings = { bytes };
+            if (!bytesonly)
+                encodings.insert(encodings.end(), { UTF16LE_TEXT, UTF16BE_TEXT, UTF32LE_TEXT, UTF32BE_TEXT });
+
+            size_t first = entries.size();
+            for (auto enc : encodings) {
+                entries.push_back(makeentry(chars, enc, matchcase));
+                if (enc == UTF16BE_TEXT || enc == UTF32BE_TEXT) {
+                    entries.back().sibling = entries.size() - 2;
+                    entries.back().siblingofs = enc == UTF16BE_TEXT ? 1 : 3;
+                }
+            }
+            chooseanchor(first);
+        }
+        for (size_t id = 0 ; id < entries.size() ; id++) {
+            auto & e = entries[id];
+            for (uint8_t v : { e.text[e.anchor], e.other[e.anchor] }) {
+                if (byanchor[v].empty())
+                    anchorbytes.push_back(v);
+                if (byanchor[v].empty() || byanchor[v].back() != id)
+                    byanchor[v].push_back(id);
+            }
+        }
+
+        std::map<ptrdiff_t, std::set<uint8_t>> bydistance;
+        for (auto & e : entries) {
+            auto & values = bydistance[ptrdiff_t(e.check) - ptrdiff_t(e.anchor)];
+            values.insert(e.text[e.check]);
+            values.insert(e.other[e.check]);
+        }
+        size_t ncompares = anchorbytes.size();
+        for (auto & [distance, values] : bydistance) {
+            checks.emplace_back(distance, ByteVector(values.begin(), values.end()));
+            mincheck = std::min(mincheck, distance);
+            maxcheck = std::max(maxcheck, distance);
+            ncompares += values.size();
+        }
+        // with many texts, the checks cost more than they save
+        if (ncompares > MAXCOMPARES) {
+            checks.clear();
+            mincheck = maxcheck = 0;
+        }
+#ifdef WITH_X86_SIMD
+        useavx2 = __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    // true when the anchors can be compared with simd instructions
+    bool usable() const
+    {
+        return !entries.empty() && anchorbytes.size() <= MAXANCHORS;
+    }
+    // the nr of byte values compared for each vector
+    size_t ncompares() const
+    {
+        size_t n = anchorbytes.size();
+        for (auto & [distance, values] : checks)
+            n += values.size();
+        return n;
+    }
+    // true when candidates need both the anchor and the check byte
+    bool haschecks() const { return !checks.empty(); }
+
+    const char *search(const char *first, const char *last, CallbackType cb) const
+    {
+        auto a = first;
+#ifdef WITH_X86_SIMD
+        if (usable()) {
+            // the vector loop loads the check bytes before the anchor
+            if (!scan_scalar(first, last, a, std::min(last, first - mincheck), cb))
+                return NULL;
+            if (useavx2 && !scan_avx2(first, last, a, cb))
+                return NULL;
+            if (!scan_sse2(first, last, a, cb))
+                return NULL;
+        }
+#endif
+        if (!scan_scalar(first, last, a, last, cb))
+            return NULL;
+        return last;
+    }
+    bool countscandidates() const { return true; }
+
+private:
+    static entry makeentry(const std::vector<uint32_t>& chars, TextEncoding enc, bool matchcase)
+    {
+        entry e;
+        e.encoding = enc;
+        for (auto c : chars) {
+            auto ofs = e.text.size();
+            encodechar(c, enc, e.text);
+            auto len = e.text.size() - ofs;
+
+            // only a variant of the same length can be compared in place
+            auto oc = matchcase ? c : othercase(c);
+            if (enc == LATIN1_TEXT && oc > 0xFF)
+                oc = c;
+            ByteVector variant;
+            encodechar(oc, enc, variant);
+            if (variant.size() != len)
+                variant.assign(e.text.begin() + ofs, e.text.end());
+            e.other.insert(e.other.end(), variant.begin(), variant.end());
+
+            // exact when the variants differ in a single bit
+            int ndiff = 0;
+            for (size_t i = 0 ; i < len ; i++) {
+                uint8_t diff = e.text[ofs + i] ^ variant[i];
+                if (diff)
+                    ndiff += (diff & (diff - 1)) ? 2 : 1;
+            }
+            if (ndiff > 1)
+                e.exact = false;
+            e.chars.emplace_back(ofs, len);
+        }
+        e.size = e.text.size();
+        for (size_t i = 0 ; i < e.size ; i++) {
+            e.mask.push_back(~(e.text[i] ^ e.other[i]));
+            e.data.push_back(e.text[i] & e.mask.back());
+        }
+        e.data.resize((e.size + 15) & ~15);
+        e.mask.resize(e.data.size());
+        return e;
+    }
+
+    // the offset of the anchor byte in a character of 'len' bytes: the byte differing most between characters.
+    static size_t anchoroffset(TextEncoding enc, size_t len)
+    {
+        switch(enc) {
+            case UTF16LE_TEXT: return len == 4 ? 2 : 0;     // the low byte of the low surrogate
+            case UTF32LE_TEXT: return 0;
+            default: return len - 1;
+        }
+    }
+
+    /*
+     *  use the character with the least likely anchor values, for the entries of
+     *  one text, starting at 'first'. The next least likely is the check.
+     */
+    void chooseanchor(size_t first)
+    {
+        std::vector<std::pair<double, size_t>> costs;
+        for (size_t k = 0 ; k < entries[first].chars.size() ; k++) {
+            std::set<uint8_t> values;
+            for (size_t id = first ; id < entries.size() ; id++) {
+                auto & e = entries[id];
+                auto a = e.chars[k].first + anchoroffset(e.encoding, e.chars[k].second);
+                values.insert(e.text[a]);
+                values.insert(e.other[a]);
+            }
+            double cost = 0;
+            for (auto v : values)
+                cost += std::exp2(bytefrequency(v) / 32.0);
+            costs.emplace_back(cost, k);
+        }
+        std::stable_sort(costs.begin(), costs.end(), [](auto& a, auto& b) { return a.first < b.first; });
+        auto best = costs[0].second;
+        auto next = costs.size() > 1 ? costs[1].second : best;
+        for (size_t id = first ; id < entries.size() ; id++) {
+            auto & e = entries[id];
+            e.anchor = e.chars[best].first + anchoroffset(e.encoding, e.chars[best].second);
+            e.check = e.chars[next].first + anchoroffset(e.encoding, e.chars[next].second);
+        }
+    }
+
+    // compare the entry at 'p', 'last' limits the vector loads.
+    static bool verify(const entry& e, const char *p, const char *last)
+    {
+#ifdef WITH_X86_SIMD
+        if (size_t(last - p) >= e.data.size()) {
+            for (size_t i = 0 ; i < e.data.size() ; i += 16) {
+                auto t = _mm_loadu_si128((const __m128i*)(p + i));
+                auto m = _mm_loadu_si128((const __m128i*)&e.mask[i]);
+                auto d = _mm_loadu_si128((const __m128i*)&e.data[i]);
+                auto x = _mm_xor_si128(_mm_and_si128(t, m), d);
+                if (_mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())) != 0xFFFF)
+                    return false;
+            }
+        }
+        else
+#endif
+        for (size_t i = 0 ; i < e.size ; i++)
+            if ((p[i] & e.mask[i]) != e.data[i])
+                return false;
+        if (e.exact)
+            return true;
+        for (auto [ofs, len] : e.chars)
+            if (memcmp(p + ofs, &e.text[ofs], len) && memcmp(p + ofs, &e.other[ofs], len))
+                return false;
+        return true;
+    }
+
+    // check all entries whose anchor could be at 'a'.
+    bool candidates(const char *first, const char *last, const char *a, CallbackType& cb) const
+    {
+        for (auto id : byanchor[(uint8_t)*a]) {
+            auto & e = entries[id];
+            if (size_t(a - first) < e.anchor)
+                continue;
+            auto p = a - e.anchor;
+            if (size_t(last - p) < e.size)
+                continue;
+            auto c = (uint8_t)p[e.check];
+            if (c != e.text[e.check] && c != e.other[e.check])
+                continue;
+            threadstats.candidates++;
+            if (!verify(e, p, last))
+                continue;
+            if (e.sibling >= 0) {
+                auto & le = entries[e.sibling];
+                if (size_t(last - p) >= e.siblingofs + le.size && verify(le, p + e.siblingofs, last))
+                    continue;
+            }
+            if (!cb(p, p + e.size))
+                return false;
+        }
+        return true;
+    }
+
+    // the scan functions advance 'a', to where the next one should continue.
+    bool scan_scalar(const char *first, const char *last, const char*& a, const char *end, CallbackType& cb) const
+    {
+        for ( ; a < end ; a++)
+            if (!byanchor[(uint8_t)*a].empty() && !candidates(first, last, a, cb))
+                return false;
+        return true;
+    }
+
+#ifdef WITH_X86_SIMD
+    bool scan_sse2(const char *first, const char *last, const char*& a, CallbackType& cb) const
+    {
+        __m128i needles[MAXCOMPARES];
+        size_t n = 0;
+        for (auto v : anchorbytes)
+            needles[n++] = _mm_set1_epi8(v);
+        for (auto & [distance, values] : checks)
+            for (auto v : values)
+                needles[n++] = _mm_set1_epi8(v);
+
+        for ( ; last - a >= 16 + maxcheck ; a += 16) {
+            auto v = _mm_loadu_si128((const __m128i*)a);
+            auto e = _mm_cmpeq_epi8(v, needles[0]);
+            size_t k = 1;
+            for ( ; k < anchorbytes.size() ; k++)
+                e = _mm_or_si128(e, _mm_cmpeq_epi8(v, needles[k]));
+            if (!checks.empty()) {
+                auto c = _mm_setzero_si128();
+                for (auto & [distance, values] : checks) {
+                    auto w = _mm_loadu_si128((const __m128i*)(a + distance));
+                    for (size_t j = 0 ; j < values.size() ; j++)
+                        c = _mm_or_si128(c, _mm_cmpeq_epi8(w, needles[k++]));
+                }
+                e = _mm_and_si128(e, c);
+            }
+            unsigned bits = _mm_movemask_epi8(e);
+            while (bits) {
+                if (!candidates(first, last, a + __builtin_ctz(bits), cb))
+                    return false;
+                bits &= bits - 1;
+            }
+        }
+        return true;
+    }
+
+    __attribute__((target("avx2")))
+    bool scan_avx2(const char *first, const char *last, const char*& a, CallbackType& cb) const
+    {
+        __m256i needles[MAXCOMPARES];
+        size_t n = 0;
+        for (auto v : anchorbytes)
+            needles[n++] = _mm256_set1_epi8(v);
+        for (auto & [distance, values] : checks)
+            for (auto v : values)
+                needles[n++] = _mm256_set1_epi8(v);
+
+        for ( ; last - a >= 32 + maxcheck ; a += 32) {
+            auto v = _mm256_loadu_si256((const __m256i*)a);
+            auto e = _mm256_cmpeq_epi8(v, needles[0]);
+            size_t k = 1;
+            for ( ; k < anchorbytes.size() ; k++)
+                e = _mm256_or_si256(e, _mm256_cmpeq_epi8(v, needles[k]));
+            if (!checks.empty()) {
+                auto c = _mm256_setzero_si256();
+                for (auto & [distance, values] : checks) {
+                    auto w = _mm256_loadu_si256((const __m256i*)(a + distance));
+                    for (size_t j = 0 ; j < values.size() ; j++)
+                        c = _mm256_or_si256(c, _mm256_cmpeq_epi8(w, needles[k++]));
+                }
+                e = _mm256_and_si256(e, c);
+            }
+            unsigned bits = _mm256_movemask_epi8(e);
+            while (bits) {
+                if (!candidates(first, last, a + __builtin_ctz(bits), cb))
+                    return false;
+                bits &= bits - 1;
+            }
+        }
+        return true;
+    }
+#endif
+};
+
+/*
+ * A range of integer or floating point values, stored in 1, 2, 4 or 8 bytes.
+ *
+ *    VALUE           -- a single value
+ *    FIRST..LAST     -- inclusive
+ *    VALUE±DELTA     -- or VALUE+-DELTA
+ *
+ * Integers are decimal, or hex with '0x', floats are anything strtod accepts.
+ */
+struct valuerange {
+    enum Kind { UNSIGNED, SIGNED, FLOAT };
+    Kind kind = UNSIGNED;
+    int width = 0;
+    std::string name;       // as specified, like "u32 0x1000..0x2000"
+
+    // integers: x matches when (x - lo) <= span, as unsigned values of 'width' bytes,
+    // this works for signed values too, in two's complement.
+    uint64_t lo = 0;
+    uint64_t span = 0;
+    // floats: NaN never matches
+    double flo = 0;
+    double fhi = 0;
+
+    static valuerange parse(const std::string& type, const std::string& spec)
+    {
+        valuerange r;
+        r.name = type + " " + spec;
+        if (type.size() < 2 || !strchr("uif", type[0]))
+            throw std::runtime_error("unknown value type: " + type);
+        r.kind = type[0] == 'u' ? UNSIGNED : type[0] == 'i' ? SIGNED : FLOAT;
+        int bits = atoi(type.c_str() + 1);
+        if (r.kind == FLOAT ? bits != 32 && bits != 64 : bits != 8 && bits != 16 && bits != 32 && bits != 64)
+            throw std::runtime_error("unknown value type: " + type);
+        r.width = bits / 8;
+
+        std::string first, last, delta;
+        size_t i;
+        if ((i = spec.find("..")) != spec.npos)
+            first = spec.substr(0, i), last = spec.substr(i + 2);
+        else if ((i = spec.find("\xc2\xb1")) != spec.npos)
+            first = spec.substr(0, i), delta = spec.substr(i + 2);
+        else if ((i = spec.find("+-")) != spec.npos)
+            first = spec.substr(0, i), delta = spec.substr(i + 2);
+        else
+            first = spec;
+
+        if (r.kind == FLOAT) {
+            double lo = parsefloat(first);
+            double hi = last.empty() ? lo : parsefloat(last);
+            if (!delta.empty()) {
+                double d = std::fabs(parsefloat(delta));
+                lo -= d;
+                hi += d;
+            }
+            if (!(lo <= hi))
+                throw std::runtime_error("empty value range: " + spec);
+            if (r.width == 4) {
+                // the floats nearest to the bounds, inside the range
+                float flo = lo, fhi = hi;
+                if (flo < lo)
+                    flo = std::nextafter(flo, INFINITY);
+                if (fhi > hi)
+                    fhi = std::nextafter(fhi, -INFINITY);
+                lo = flo, hi = fhi;
+            }
+            r.flo = lo;
+            r.fhi = hi;
+            return r;
+        }
+
+        uint64_t mask = r.width == 8 ? ~uint64_t(0) : (uint64_t(1) << (8 * r.width)) - 1;
+        if (r.kind == UNSIGNED) {
+            uint64_t lo = parseunsigned(first, mask);
+            uint64_t hi = last.empty() ? lo : parseunsigned(last, mask);
+            if (!delta.empty()) {
+                uint64_t d = parseunsigned(delta, ~uint64_t(0));
+                lo = lo > d ? lo - d : 0;
+                hi = mask - hi > d ? hi + d : mask;
+            }
+            if (lo > hi)
+                throw std::runtime_error("empty value range: " + spec);
+            r.lo = lo;
+            r.span = hi - lo;
+        }
+        else {
+            int64_t max = mask >> 1, min = -max - 1;
+            int64_t lo = parsesigned(first, min, max);
+            int64_t hi = last.empty() ? lo : parsesigned(last, min, max);
+            if (!delta.empty()) {
+                int64_t d = parsesigned(delta, 0, INT64_MAX);
+                lo = lo - min > d ? lo - d : min;
+                hi = max - hi > d ? hi + d : max;
+            }
+            if (lo > hi)
+                throw std::runtime_error("empty value range: " + spec);
+            r.lo = uint64_t(lo) & mask;
+            r.span = uint64_t(hi) - uint64_t(lo);
+        }
+        return r;
+    }
+    static double parsefloat(const std::string& txt)
+    {
+        char *end;
+        double v = strtod(txt.c_str(), &end);
+        if (txt.empty() || *end)
+            throw std::runtime_error("invalid number: " + txt);
+        return v;
+    }
+    static uint64_t parseunsigned(const std::string& txt, uint64_t max)
+    {
+        char *end;
+        errno = 0;
+        uint64_t v = strtoull(txt.c_str(), &end, 0);
+        if (txt.empty() || *end || txt[0] == '-' || errno)
+            throw std::runtime_error("invalid number: " + txt);
+        if (v > max)
+            throw std::runtime_error("value too large: " + txt);
+        return v;
+    }
+    static int64_t parsesigned(const std::string& txt, int64_t min, int64_t max)
+    {
+        char *end;
+        errno = 0;
+        int64_t v = strtoll(txt.c_str(), &end, 0);
+        if (txt.empty() || *end || errno)
+            throw std::runtime_error("invalid number: " + txt);
+        if (v < min || v > max)
+            throw std::runtime_error("value out of range: " + txt);
+        return v;
+    }
+
+    // the value of 'width' bytes at 'p'
+    bool matches(const char *p, bool bigendian) const
+    {
+        uint64_t x = 0;
+        for (int i = 0 ; i < width ; i++)
+            x |= uint64_t(uint8_t(p[bigendian ? width - 1 - i : i])) << (8 * i);
+        if (kind == FLOAT) {
+            if (width == 4) {
+                float f;
+                uint32_t x32 = x;
+                memcpy(&f, &x32, 4);
+                return f >= flo && f <= fhi;
+            }
+            double d;
+            memcpy(&d, &x, 8);
+            return d >= flo && d <= fhi;
+        }
+        uint64_t mask = width == 8 ? ~uint64_t(0) : (uint64_t(1) << (8 * width)) - 1;
+        return ((x - lo) & mask) <= span;
+    }
+};
+
+/*
+ * Searches for numbers in a range, instead of for byte patterns.
+ *
+ * All offsets are compared, or with 'aligned' only the file offsets, or
+ * process memory addresses, which are a multiple of the value size.
+ *
+ * With avx2, 32 offsets are compared at once: for each byte k of the value
+ * size, the 32 bytes at p+k are loaded as lanes of values, and compared with
+ * a subtract and an unsigned compare. The lane results are combined in a
+ * bitmask of matching offsets, so matches are reported in order.
+ */
+class valuesearch : public SearchBase {
+    std::vector<valuerange> ranges;
+    bool bigendian;
+    bool aligned;
+    bool useavx2 = false;
+
+    // the first offset >= p to compare, 'offset' is the file offset of 'first'
+    size_t alignment(const valuerange& r, const char *first, const char *p, uint64_t offset) const
+    {
+        if (!aligned)
+            return 0;
+        auto misalign = (offset + (p - first)) % r.width;
+        return misalign ? r.width - misalign : 0;
+    }
+
+    bool scan_scalar(const valuerange& r, const char *first, const char *p, const char *last, uint64_t offset, CallbackType& cb) const
+    {
+        size_t step = aligned ? r.width : 1;
+        for (p += alignment(r, first, p, offset) ; last - p >= r.width ; p += step)
+            if (r.matches(p, bigendian) && !cb(p, p + r.width))
+                return false;
+        return true;
+    }
+
+#ifdef WITH_X86_SIMD
+    /*
+     *  returns the lanes of 'v' in the range, as a mask of all bits of each lane.
+     */
+    template<int W, valuerange::Kind K>
+    __attribute__((target("avx2")))
+    static __m256i compare_avx2(__m256i v, __m256i lo, __m256i hi)
+    {
+        if constexpr (K == valuerange::FLOAT && W == 4) {
+            auto f = _mm256_castsi256_ps(v);
+            return _mm256_castps_si256(_mm256_and_ps(_mm256_cmp_ps(f, _mm256_castsi256_ps(lo), _CMP_GE_OQ), _mm256_cmp_ps(f, _mm256_castsi256_ps(hi), _CMP_LE_OQ)));
+        }
+        else if constexpr (K == valuerange::FLOAT) {
+            auto d = _mm256_castsi256_pd(v);
+            return _mm256_castpd_si256(_mm256_and_pd(_mm256_cmp_pd(d, _mm256_castsi256_pd(lo), _CMP_GE_OQ), _mm256_cmp_pd(d, _mm256_castsi256_pd(hi), _CMP_LE_OQ)));
+        }
+        // for integers 'hi' is the span, x matches when max(x - lo, span) == span
+        else if constexpr (W == 1) {
+            auto d = _mm256_sub_epi8(v, lo);
+            return _mm256_cmpeq_epi8(_mm256_max_epu8(d, hi), hi);
+        }
+        else if constexpr (W == 2) {
+            auto d = _mm256_sub_epi16(v, lo);
+            return _mm256_cmpeq_epi16(_mm256_max_epu16(d, hi), hi);
+        }
+        else if constexpr (W == 4) {
+            auto d = _mm256_sub_epi32(v, lo);
+            return _mm256_cmpeq_epi32(_mm256_max_epu32(d, hi), hi);
+        }
+        else {
+            // there is no unsigned 64 bit compare, flip the sign bits for a signed compare.
+            auto sign = _mm256_set1_epi64x(INT64_MIN);
+            auto d = _mm256_xor_si256(_mm256_sub_epi64(v, lo), sign);
+            return _mm256_xor_si256(_mm256_cmpgt_epi64(d, _mm256_xor_si256(hi, sign)), _mm256_set1_epi64x(-1));
+        }
+    }
+
+    template<int W, valuerange::Kind K>
+    __attribute__((target("avx2")))
+    bool scan_avx2(const valuerange& r, const char *first, const char *last, uint64_t offset, CallbackType& cb) const
+    {
+        __m256i lo, hi;
+        if constexpr (K == valuerange::FLOAT && W == 4) {
+            lo = _mm256_castps_si256(_mm256_set1_ps(r.flo));
+            hi = _mm256_castps_si256(_mm256_set1_ps(r.fhi));
+        }
+        else if constexpr (K == valuerange::FLOAT) {
+            lo = _mm256_castpd_si256(_mm256_set1_pd(r.flo));
+            hi = _mm256_castpd_si256(_mm256_set1_pd(r.fhi));
+        }
+        else if constexpr (W == 1) {
+            lo = _mm256_set1_epi8(r.lo);
+            hi = _mm256_set1_epi8(r.span);
+        }
+        else if constexpr (W == 2) {
+            lo = _mm256_set1_epi16(r.lo);
+            hi = _mm256_set1_epi16(r.span);
+        }
+        else if constexpr (W == 4) {
+            lo = _mm256_set1_epi32(r.lo);
+            hi = _mm256_set1_epi32(r.span);
+        }
+        else {
+            lo = _mm256_set1_epi64x(r.lo);
+            hi = _mm256_set1_epi64x(r.span);
+        }
+
+        // reverses the bytes of each lane, for big endian values
+        uint8_t order[32];
+        for (int i = 0 ; i < 32 ; i++)
+            order[i] = (i & 15) ^ (W - 1);
+        auto swap = _mm256_loadu_si256((const __m256i*)order);
+
+        // one bit for the first byte of each lane
+        constexpr uint32_t lanebits = W == 1 ? 0xFFFFFFFF : W == 2 ? 0x55555555 : W == 4 ? 0x11111111 : 0x01010101;
+
+        // with 'aligned' only the lanes at byte 'k0' of each 32 byte block are compared
+        auto p = first;
+        int k0 = alignment(r, first, p, offset);
+        int kend = aligned ? k0 + 1 : W;
+        for ( ; last - p >= 32 + W - 1 ; p += 32) {
+            uint32_t bits = 0;
+            for (int k = aligned ? k0 : 0 ; k < kend ; k++) {
+                auto v = _mm256_loadu_si256((const __m256i*)(p + k));
+                if (W > 1 && bigendian)
+                    v = _mm256_shuffle_epi8(v, swap);
+                bits |= (_mm256_movemask_epi8(compare_avx2<W, K>(v, lo, hi)) & lanebits) << k;
+            }
+            while (bits) {
+                auto q = p + __builtin_ctz(bits);
+                bits &= bits - 1;
+                if (!cb(q, q + W))
+                    return false;
+            }
+        }
+        return scan_scalar(r, first, p, last, offset, cb);
+    }
+#endif
+
+    bool scan(const valuerange& r, const char *first, const char *last, uint64_t offset, CallbackType& cb) const
+    {
+#ifdef WITH_X86_SIMD
+        if (useavx2) {
+            switch(r.kind == valuerange::FLOAT ? -r.width : r.width) {
+                case 1: return scan_avx2<1, valuerange::UNSIGNED>(r, first, last, offset, cb);
+                case 2: return scan_avx2<2, valuerange::UNSIGNED>(r, first, last, offset, cb);
+                case 4: return scan_avx2<4, valuerange::UNSIGNED>(r, first, last, offset, cb);
+                case 8: return scan_avx2<8, valuerange::UNSIGNED>(r, first, last, offset, cb);
+                case -4: return scan_avx2<4, valuerange::FLOAT>(r, first, last, offset, cb);
+                case -8: return scan_avx2<8, valuerange::FLOAT>(r, first, last, offset, cb);
+            }
+        }
+#endif
+        return scan_scalar(r, first, first, last, offset, cb);
+    }
+public:
+    valuesearch(const std::vector<valuerange>& ranges, bool bigendian, bool aligned)
+        : ranges(ranges), bigendian(bigendian), aligned(aligned)
+    {
+#ifdef WITH_X86_SIMD
+        useavx2 = __builtin_cpu_supports("avx2");
+#endif
+    }
+
+    const char *search(const char *first, const char *last, CallbackType cb) const
+    {
+        return searchat(first, last, 0, cb);
+    }
+    const char *searchat(const char *first, const char *last, uint64_t offset, CallbackType cb) const
+    {
+        for (auto & r : ranges)
+            if (!scan(r, first, last, offset, cb))
+                return NULL;
+        return last;
+    }
+};
+
+/*
+ * The various search algoritms implemented in findstr.
+ */
+enum SearchType {
+    REGEX_SEARCH,
+    STD_SEARCH,
+    STD_BOYER_MOORE,
+    STD_BOYER_MOORE_HORSPOOL,
+    BOOST_BOYER_MOORE,
+    BOOST_BOYER_MOORE_HORSPOOL,
+    BOOST_KNUTH_MORRIS_PRATT,
+    BYTEMASK_SEARCH,
+    AHO_CORASICK_SEARCH,
+    TEXT_SEARCH,
+    VALUE_SEARCH,       // for --u32, etc, not a byte pattern
+    AUTO_SEARCH,        // one of the above, chosen after compiling the pattern
+};
+
+static const char *searchtypename(SearchType t)
+{
+    switch(t) {
+        case REGEX_SEARCH: return "regex";
+        case STD_SEARCH: return "std";
+        case STD_BOYER_MOORE: return "stdbm";
+        case STD_BOYER_MOORE_HORSPOOL: return "stdbmh";
+        case BOOST_BOYER_MOORE: return "boostbm";
+        case BOOST_BOYER_MOORE_HORSPOOL: return "boostbmh";
+        case BOOST_KNUTH_MORRIS_PRATT: return "boostkmp";
+        case BYTEMASK_SEARCH: return "mask";
+        case AHO_CORASICK_SEARCH: return "ac";
+        case TEXT_SEARCH: return "text";
+        case VALUE_SEARCH: return "value";
+        case AUTO_SEARCH: return "auto";
+    }
+    return "?";
+}
+
+/*
+ * The output formats for matches.
+ */
+enum OutputFormat {
+    TEXT_OUTPUT,        // the default, human readable
+    JSONL_OUTPUT,       // one json object per line
+    TSV_OUTPUT,         // tab separated: origin, offset, length, -F pattern id, bytes
+    BINARY_OUTPUT,      // binaryrecord, followed by the origin and the match bytes
+};
+
+// the record header used by BINARY_OUTPUT, in native byte order.
+struct binaryrecord {
+    uint32_t originlength;
+    uint32_t bytecount;     // nr of match bytes following the origin
+    uint64_t offset;        // UINT64_MAX for the per file summary of -c and -l
+    uint64_t length;        // the match length, or the match count for a summary
+};
+
+/*
+ * Finds the 'record' containing a match, for --record.
+ *
+ * A record is a LF terminated line, a CSV record, a NUL terminated item,
+ * or a block of a fixed size, aligned to its size in the file.
+ * The delimiters are found with memchr and memrchr, which are vectorized
+ * in most C libraries. At most 'maxsize' bytes before and after the
+ * match are examined, longer records are clipped.
+ */
+class recordfinder {
+public:
+    enum Type { NONE, LINE, NUL, CSV, BLOCK };
+    Type type = NONE;
+    uint64_t blocksize = 0;     // for BLOCK
+    size_t maxsize = 0x10000;
+
+    char delimiter() const { return type == NUL ? 0 : '\n'; }
+
+    static const char *findlast(const char *first, const char *last, char c)
+    {
+#ifdef __GLIBC__
+        return (const char*)memrchr(first, c, last - first);
+#else
+        while (last > first)
+            if (*--last == c)
+                return last;
+        return NULL;
+#endif
+    }
+
+    /*
+     *  returns the start of the record containing 'p', which is at 'pofs' in
+     *  the file, and is preceded by at least [first, p).
+     *  'known' is NULL, or a record start before 'p', like the end of the previous record.
+     */
+    const char *start(const char *first, const char *p, uint64_t pofs, const char *known) const
+    {
+        if (type == BLOCK)
+            return p - std::min<uint64_t>(pofs % blocksize, p - first);
+
+        auto limit = p - std::min<size_t>(maxsize, p - first);
+        if (type != CSV) {
+            auto d = findlast(limit, p, delimiter());
+            return d ? d + 1 : limit;
+        }
+
+        // a newline can be part of a quoted field, so the records can only be
+        // found forward from a known record start, or from the first line start
+        // when nothing is known.
+        auto s = known;
+        if (!s || s < limit) {
+            s = limit;
+            if (pofs - (p - limit) != 0) {
+                auto nl = (const char*)memchr(limit, '\n', p - limit);
+                if (!nl)
+                    return limit;
+                s = nl + 1;
+            }
+        }
+        auto recstart = s;
+        size_t quotes = 0;
+        while (auto e = (const char*)memchr(s, '\n', p - s)) {
+            quotes += std::count(s, e, '"');
+            s = e + 1;
+            if (quotes % 2 == 0)
+                recstart = s;
+        }
+        return recstart;
+    }
+
+    /*
+     *  returns the end of the record starting at 's', at 'sofs' in the file, and
+     *  extending at least to 'q'. The end includes the delimiter.
+     *  NULL is returned when the end is not in [s, last), and 'last' is not the end of the data.
+     */
+    const char *end(const char *s, uint64_t sofs, const char *q, const char *last, bool atend) const
+    {
+        if (type == BLOCK) {
+            uint64_t size = blocksize - sofs % blocksize;
+            if (size <= uint64_t(last - s))
+                return s + size;
+            return atend ? last : NULL;
+        }
+
+        auto limit = q + std::min<size_t>(maxsize, last - q);
+        auto p = q;
+        size_t quotes = type == CSV ? std::count(s, q, '"') : 0;
+        while (auto e = (const char*)memchr(p, delimiter(), limit - p)) {
+            if (type == CSV) {
+                quotes += std::count(p, e, '"');
+                if (quotes % 2) {
+                    p = e + 1;
+                    continue;
+                }
+            }
+            return e + 1;
+        }
+        if (size_t(last - q) >= maxsize || atend)
+            return limit;
+        return NULL;
+    }
+
+    // the record without its delimiter, and the CR of a CR/LF line.
+    const char *contentend(const char *s, const char *e) const
+    {
+        if (type == BLOCK)
+            return e;
+        if (e > s && e[-1] == delimiter())
+            e--;
+        if ((type == LINE || type == CSV) && e > s && e[-1] == '\r')
+            e--;
+        return e;
+    }
+};
+
+/*
+ * The results for a single file.
+ *
+ * The output is collected in 'output'. When searching on multiple threads
+ * it is printed in one go after the file was searched, otherwise it is
+ * written to stdout in large blocks, and by flush.
+ */
+struct matchresults {
+    bool nameprinted = false;
     int matchcount = 0;
 
+    // for --record
+    const char *ctxfirst = NULL;    // the data available around the current matches
+    const char *ctxlast = NULL;
+    bool ctxatend = false;          // ctxlast is the end of the data
+    uint64_t recordend = 0;         // the file offset after the last printed record
+    uint64_t recordstart = 0;       // the file offset of a known record start, like that of the last printed record
+    bool pending = false;           // the record at 'pendingofs' continues in the next block
+    uint64_t pendingofs = 0;
+
+    const decompressreader *compressed = NULL;  // set while searching decompressed data
+    std::vector<std::pair<uint64_t, uint64_t>> holes;   // the holes of the mapped file, which are not searched
+
+    bool buffered = false;
+    bool inworker = false;          // searched on one of several threads, large buffers are not split in chunks
+    std::string output;
+
+    static constexpr size_t FLUSHSIZE = 0x10000;
+
+    // start a new file
+    void reset()
+    {
+        nameprinted = false;
+        matchcount = 0;
+        resetrecords();
+    }
+    void resetrecords()
+    {
+        recordend = 0;
+        recordstart = 0;
+        pending = false;
+    }
+    void setcontext(const char *first, const char *last, bool atend)
+    {
+        ctxfirst = first;
+        ctxlast = last;
+        ctxatend = atend;
+    }
+
+    template<typename...ARGS>
+    void write(const char *fmt, ARGS&&...args)
+    {
+        output += stringformat(fmt, std::forward<ARGS>(args)...);
+        flushfull();
+    }
+    void append(const char *data, size_t size)
+    {
+        output.append(data, size);
+        flushfull();
+    }
+    void append(const std::string& str)
+    {
+        append(str.data(), str.size());
+    }
+    void appendhex(uint64_t value, int mindigits)
+    {
+        char buf[16];
+        int n = 0;
+        do {
+            buf[n++] = "0123456789abcdef"[value & 15];
+            value >>= 4;
+        } while (value || n < mindigits);
+        while (n)
+            output += buf[--n];
+    }
+    void appendbytes(const char *first, const char *last)
+    {
+        for (auto p = first ; p < last ; p++) {
+            output += "0123456789abcdef"[uint8_t(*p) >> 4];
+            output += "0123456789abcdef"[*p & 15];
+        }
+    }
+    void appenddecimal(uint64_t value)
+    {
+        output += std::to_string(value);
+    }
+    // escape for use in a json string
+    void appendjson(const std::string& str)
+    {
+        for (auto c : str) {
+            if (c == '"' || c == '\\') {
+                output += '\\';
+                output += c;
+            }
+            else if (uint8_t(c) < 0x20) {
+                output += "\\u00";
+                appendhex(uint8_t(c), 2);
+            }
+            else {
+                output += c;
+            }
+        }
+    }
+    // printable ascii as is, other bytes as \xNN
+    void appendescaped(const char *first, const char *last)
+    {
+        for (auto p = first ; p < last ; p++) {
+            if (*p == '\\') {
+                output += "\\\\";
+            }
+            else if (*p >= 0x20 && *p < 0x7f) {
+                output += *p;
+            }
+            else {
+                output += "\\x";
+                appendhex(uint8_t(*p), 2);
+            }
+        }
+    }
+    // escape tabs, newlines and backslashes, for tsv output
+    void appendtsv(const std::string& str)
+    {
+        for (auto c : str) {
+            switch(c) {
+                case '\t': output += "\\t"; break;
+                case '\n': output += "\\n"; break;
+                case '\\': output += "\\\\"; break;
+                default: output += c;
+            }
+        }
+    }
+
+    void flushfull()
+    {
+        if (!buffered && output.size() >= FLUSHSIZE)
+            flush();
+    }
+    void flush()
+    {
+        fwrite(output.data(), 1, output.size(), stdout);
+        output.clear();
+    }
+};
+
+
+struct findstr {
+    bool matchword = false;      // modifies pattern
+    bool matchbinary = false;    // modifies pattern, modifies verbose output
+    bool matchcase = false;      // modifies pattern
+    bool matchstart = false;      // modifies pattern
+    bool pattern_is_hex = false; // modifies verbose output, implies binary
+    bool pattern_is_guid = false;// modifies verbose output, implies binary
+    int verbose = 0;             // modifies ouput
+    bool list_only = false;      // modifies ouput
+    bool count_only = false;     // modifies ouput
+    OutputFormat outputformat = TEXT_OUTPUT;
+    bool outputbytes = false;    // include the match bytes in jsonl, tsv and bin output
+    recordfinder record;         // print the record containing the match, instead of the match
+    bool readcontinuous = false; // read until ctrl-c, instead of until eof
+    bool use_sequential = false; // use read, instead of mmap
+    bool decompress = false;     // search the decompressed contents of compressed files
+    bool archives = false;       // search the members of zip, tar and cpio files
+    int archivedepth = 4;        // the maximum nesting of archives searched
+    uint64_t maxfilesize = 0;
+    static constexpr size_t maxinmemory = 0x10000000;  // larger compressed archives are searched as one stream
+    int nthreads = 1;            // threads used for searching
+    size_t blocksize = 0x100000; // read size for sequential searches
+    int nbuffers = 3;            // nr of blocks being read ahead
+    uint64_t maxrss = 0;         // when set, files are mapped in windows of at most half this size
+    uint64_t chunksize = 0x4000000;  // large files are searched in chunks of this size, in parallel
+    static constexpr size_t regexwindow = 0x10000;  // assumed maximum length of a regex match
+    bool matcheszeros = true;    // a pattern may match zero bytes only, set after compiling, holes are only skipped when false
+    bool skipzeroblocks = false; // --skip-zeros: also skip zero filled blocks in the data
+    static constexpr size_t ZEROBLOCK = 0x1000;
+    searchstats *stats = NULL;   // the counters for --stats
+
 #ifdef WITH_MEMSEARCH
     int pid = 0;
     uint64_t memoffset = 0;
     uint64_t memsize = 0;
 #endif
+#ifdef WITH_PROCMEM
+    std::vector<int> pids;       // the processes to search
+    uint64_t memoffset = 0;      // only search this address range
+    uint64_t memsize = 0;
+    std::string memperms = "r";  // only regions with all these permissions
+    std::string memname;         // only regions with a name containing this
+    static constexpr size_t membatch = 0x1000000;  // nr of bytes read at once by each thread
+#endif
 
-    SearchType searchtype = REGEX_SEARCH;
+    SearchType searchtype = AUTO_SEARCH;
+    std::vector<uint32_t> samplecounts;   // byte histogram of the start of the first file, used by AUTO_SEARCH
+    uint64_t samplesize = 0;
 
     std::string pattern;
     std::vector<ByteMaskType> bytemasks;
+    std::vector<std::string> textpatterns;  // the alternatives of a text pattern, for TEXT_SEARCH
+
+    std::string patternfile;                        // -F: a file with one pattern per line
+    std::shared_ptr<const patternset> filepatterns; // the patterns read from 'patternfile'
+    const SearchBase *idsearcher = NULL;            // with -F: reports which pattern matched
+
+    std::string cachedir;                           // --cache: where compiled automatons are saved
+    uint64_t cachekey = 0;
+
+    std::vector<std::pair<std::string, std::string>> valuequeries;  // --u32 etc: the type and the range
+    std::vector<valuerange> valueranges;
+    bool valuebigendian = false;    // --be
+    bool valuealigned = false;      // --aligned
+
+#ifdef WITH_MEMSEARCH
+    void searchmemory(const SearchBase& searcher, matchresults& res)
+    {
+        task_t task = MachOpenProcessByPid(pid);
+
+        MachVirtualMemory mem(task, memoffset, memsize);
+        res.setcontext((const char*)mem.begin(), (const char*)mem.end(), true);
+
+        runsearchinorder(searcher, (const char*)mem.begin(), (const char*)mem.end(), memoffset, [&mem, &res, this](const char *first, const char *last)->bool {
+            return writeresult(res, "memory", (const char*)mem.begin(), memoffset, first, last);
+        });
+    }
+#endif
+
+#ifdef WITH_PROCMEM
+    std::vector<memregion> selectregions(const std::vector<memregion>& all) const
+    {
+        std::vector<memregion> list;
+        uint64_t rangeend = memsize ? memoffset + memsize : UINT64_MAX;
+        for (auto r : all) {
+            if (!r.hasperms(memperms))
+                continue;
+            if (!memname.empty() && r.name.find(memname) == r.name.npos)
+                continue;
+            // these can not be read
+            if (r.name == "[vvar]" || r.name == "[vvar_vclock]" || r.name == "[vsyscall]")
+                continue;
+            r.start = std::max(r.start, memoffset);
+            r.end = std::min(r.end, rangeend);
+            if (r.start < r.end)
+                list.push_back(r);
+        }
+        return list;
+    }
+
+    /*
+     *  search the memory of a running process.
+     *
+     *  The regions are split in pieces overlapping by the maximum match length,
+     *  and the pieces grouped in batches, which are read with a single system call.
+     *  The batches are searched on 'nthreads' threads, the matches are printed
+     *  by this thread in address order, with the region name, while the next
+     *  batches are searched.
+     *  With --record each piece includes the maximum record size before and after
+     *  the searched range, and the records are copied instead of the matches.
+     */
+    void searchprocess(int pid, const SearchBase& searcher, matchresults& res)
+    {
+        auto regions = selectregions(procmemory(pid).regions());
+
+        uint64_t context = record.type != recordfinder::NONE ? record.maxsize : 0;
+        uint64_t overlap = maxmatchlength() + context;
+        size_t maxpiece = context + membatch + overlap;
+        bool records = record.type != recordfinder::NONE && !count_only && !list_only;
+        struct piece {
+            size_t region;
+            uint64_t addr;
+            size_t size;        // nr of bytes to read
+            size_t lead;        // nr of bytes before the searched part
+            size_t keep;        // matches starting after this are found in the next piece
+        };
+        std::vector<std::vector<piece>> batches(1);
+        size_t batchsize = 0;
+        for (size_t ri = 0 ; ri < regions.size() ; ri++) {
+            auto & r = regions[ri];
+            for (uint64_t addr = r.start ; addr < r.end ; addr += membatch) {
+                size_t lead = std::min(addr - r.start, context);
+                piece p = { ri, addr - lead, size_t(std::min(r.end - addr, membatch + overlap)) + lead, lead, size_t(std::min(r.end - addr, uint64_t(membatch))) + lead };
+                if (batchsize + p.size > maxpiece && !batches.back().empty()) {
+                    batches.emplace_back();
+                    batchsize = 0;
+                }
+                batches.back().push_back(p);
+                batchsize += p.size;
+            }
+        }
+
+        struct memmatch {
+            size_t region;
+            uint64_t addr;
+            std::vector<char> data;
+        };
+        orderedqueue<memmatch> queue(batches.size(), std::min<size_t>(nthreads, batches.size()));
+        std::vector<int> counts(batches.size());
+        std::exception_ptr error;   // the first exception on a worker, rethrown on this thread
+        std::mutex errormtx;
+
+        auto worker = [&](int id) {
+            try {
+                procmemory mem(pid);
+                std::vector<char> buffer(maxpiece);
+                std::vector<procmemory::readrequest> reqs;
+                std::vector<std::pair<const char*, const char*>> matches;
+                uint64_t t0 = stats ? searchstats::now() : 0, tasks = 0;
+                size_t b;
+                while (queue.claim(b)) {
+                    tasks++;
+                    reqs.clear();
+                    size_t used = 0;
+                    for (auto & p : batches[b]) {
+                        reqs.push_back({ p.addr, &buffer[used], p.size, 0 });
+                        used += p.size;
+                    }
+                    {
+                    searchstats::timer t(stats ? &stats->iotime : NULL);
+                    mem.readbatch(reqs);
+                    }
+
+                    for (size_t i = 0 ; i < reqs.size() && queue.wanted(b) ; i++) {
+                        auto & p = batches[b][i];
+                        if (stats)
+                            stats->bytesread += reqs[i].got;
+                        if (reqs[i].got <= p.lead)
+                            continue;
+                        auto first = reqs[i].buf;
+                        auto last = first + reqs[i].got;
+                        auto keepend = first + std::min(p.keep, reqs[i].got);
+                        // not all searchers report their matches in address order: sort them, so
+                        // they are printed in order, and the records containing several are copied once.
+                        matches.clear();
+                        runsearch(searcher, first + p.lead, last, p.addr + p.lead, [&, keepend](const char *mfirst, const char *mlast)->bool {
+                            if (mfirst < keepend)
+                                matches.emplace_back(mfirst, mlast);
+                            return queue.wanted(b) && !(list_only && !matches.empty());
+                        });
+                        std::sort(matches.begin(), matches.end());
+                        counts[b] += matches.size();
+                        if (list_only && !matches.empty())
+                            queue.found(b);
+                        if (count_only)
+                            continue;
+                        const char *recordend = first;
+                        for (auto [mfirst, mlast] : matches) {
+                            if (records) {
+                                if (mfirst < recordend)
+                                    continue;
+                                auto s = record.start(first, mfirst, p.addr + (mfirst - first), recordend > first ? recordend : NULL);
+                                recordend = record.end(s, p.addr + (s - first), mlast, last, true);
+                                if (!queue.push(id, b, { p.region, p.addr + (s - first), std::vector<char>(s, recordend) }))
+                                    break;
+                            }
+                            else if (!queue.push(id, b, { p.region, p.addr + (mfirst - first), std::vector<char>(mfirst, mlast) })) {
+                                break;
+                            }
+                        }
+                    }
+                    if (!queue.done(id, b))
+                        break;
+                }
+                if (stats)
+                    stats->addthread("memory", tasks, searchstats::now() - t0);
+            }
+            catch(...) {
+                std::lock_guard<std::mutex> lock(errormtx);
+                if (!error)
+                    error = std::current_exception();
+                queue.cancel();
+            }
+        };
+
+        res.reset();
+
+        size_t lastregion = SIZE_MAX;
+        std::string origin;
+        queue.run(worker, [&](size_t b, std::vector<memmatch>& matches) {
+            res.matchcount += counts[b];
+            if (count_only)
+                return true;
+            for (auto & m : matches) {
+                if (m.region != lastregion) {
+                    auto & r = regions[m.region];
+                    origin = stringformat("%d:%s", pid, r.name.empty() ? "[anon]" : r.name);
+                    if (res.nameprinted)
+                        res.write("\n");
+                    res.nameprinted = false;
+                    lastregion = m.region;
+                }
+                auto bufstart = m.data.data();
+                res.setcontext(bufstart, bufstart + m.data.size(), true);
+                if (!writeresult(res, origin, bufstart, m.addr, bufstart, bufstart + m.data.size()))
+                    return false;
+            }
+            return true;
+        });
+        if (error)
+            std::rethrow_exception(error);
+        if (count_only)
+            writesummary(res, stringformat("pid %d", pid));
+        if (res.nameprinted)
+            res.write("\n");
+    }
+#endif
+
+    /*
+     *  search [first, last) with 'searcher', 'offset' is the file offset, or address of 'first'.
+     *  with --stats this counts the candidates, matches and time spent in the searcher.
+     */
+    const char *runsearch(const SearchBase& searcher, const char *first, const char *last, uint64_t offset, CallbackType cb)
+    {
+        if (!stats)
+            return searchnonzero(searcher, first, last, offset, cb);
+        auto t0 = searchstats::now();
+        auto candidates = threadstats.candidates;
+        auto outputtime = threadstats.outputtime;
+        uint64_t matches = 0;
+        auto r = searchnonzero(searcher, first, last, offset, [&matches, &cb](const char *mfirst, const char *mlast) {
+            matches++;
+            return cb(mfirst, mlast);
+        });
+        stats->searchtime += searchstats::now() - t0 - (threadstats.outputtime - outputtime);
+        stats->candidates += threadstats.candidates - candidates;
+        stats->matches += matches;
+        return r;
+    }
+
+    /*
+     *  like runsearch, but with --record 'cb' gets the matches in address order:
+     *  the mask and regex alternation searchers do not report them in order, and
+     *  writematchrecord skips the matches before the end of the last printed record.
+     */
+    const char *runsearchinorder(const SearchBase& searcher, const char *first, const char *last, uint64_t offset, CallbackType cb)
+    {
+        if (record.type == recordfinder::NONE || count_only || list_only)
+            return runsearch(searcher, first, last, offset, cb);
+
+        std::vector<std::pair<const char*, const char*>> matches;
+        auto r = runsearch(searcher, first, last, offset, [&matches](const char *mfirst, const char *mlast) {
+            matches.emplace_back(mfirst, mlast);
+            return true;
+        });
+        std::sort(matches.begin(), matches.end());
+        for (auto [mfirst, mlast] : matches)
+            if (!cb(mfirst, mlast))
+                return NULL;
+        return r;
+    }
+
+    static bool iszeroblock(const char *p)
+    {
+#ifdef WITH_X86_SIMD
+        for (size_t i = 0 ; i < ZEROBLOCK ; i += 64) {
+            auto v = _mm_or_si128(_mm_or_si128(_mm_load_si128((const __m128i*)(p + i)), _mm_load_si128((const __m128i*)(p + i + 16))),
+                                  _mm_or_si128(_mm_load_si128((const __m128i*)(p + i + 32)), _mm_load_si128((const __m128i*)(p + i + 48))));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_setzero_si128())) != 0xFFFF)
+                return false;
+        }
+        return true;
+#else
+        for (size_t i = 0 ; i < ZEROBLOCK ; i += 8) {
+            uint64_t v;
+            memcpy(&v, p + i, 8);
+            if (v)
+                return false;
+        }
+        return true;
+#endif
+    }
+
+    /*
+     *  with --skip-zeros, only search the parts of [first, last) between runs of zero
+     *  filled blocks, each with maxmatchlength-1 bytes of the zeros around it, for
+     *  matches starting or ending with zeros. The blocks are aligned by address,
+     *  like the pages of a mapped file.
+     *
+     *  A match can not contain the entire run of zeros between two parts, so
+     *  no match is found twice.
+     */
+    const char *searchnonzero(const SearchBase& searcher, const char *first, const char *last, uint64_t offset, const CallbackType& cb)
+    {
+        if (!skipzeroblocks || matcheszeros || size_t(last - first) < 2 * ZEROBLOCK)
+            return searcher.searchat(first, last, offset, cb);
+
+        size_t margin = std::max<size_t>(1, maxmatchlength()) - 1;
+        auto part = first;              // the start of the next part to search
+        const char *zerostart = NULL;   // the start of the current run of zero blocks
+        auto endzeros = [&](const char *zeroend) {
+            if (size_t(zeroend - zerostart) <= margin)
+                return true;
+            if (zerostart > part && !searcher.searchat(part, zerostart + margin, offset + (part - first), cb))
+                return false;
+            part = zeroend - margin;
+            if (stats)
+                stats->zerobytes += zeroend - zerostart;
+            return true;
+        };
+        auto block = first + (-uintptr_t(first) & (ZEROBLOCK - 1));
+        for ( ; last - block >= ptrdiff_t(ZEROBLOCK) ; block += ZEROBLOCK) {
+            if (iszeroblock(block)) {
+                if (!zerostart)
+                    zerostart = block;
+            }
+            else if (zerostart) {
+                if (!endzeros(block))
+                    return NULL;
+                zerostart = NULL;
+            }
+        }
+        if (zerostart && !endzeros(block))
+            return NULL;
+        if (part < last && !searcher.searchat(part, last, offset + (part - first), cb))
+            return NULL;
+        return last;
+    }
+
+    void searchstdin(const SearchBase& searcher, matchresults& res)
+    {
+        filehandle f(0);
+        searchsequential(f, "-", searcher, res);
+    }
+
+    void searchsequential(filehandle& f, const std::string& origin, const SearchBase& searcher, matchresults& res)
+    {
+        //printf("searching stdin\n");
+        // see: http://www.boost.org/doc/libs/1_52_0/libs/regex/doc/html/boost_regex/partial_matches.html
+
+        res.reset();
+
+        // the carried bytes can not be continued over a hole, for records crossing it.
+        uint64_t minhole = matcheszeros || record.type != recordfinder::NONE ? 0 : maxmatchlength();
+        blockreader reader(f, blocksize, nbuffers, maxcarry(), minhole);
+        searchstream(reader, origin, searcher, res);
+    }
+
+    /*
+     *  search the blocks produced by 'reader', which is a blockreader or a decompressreader.
+     */
+    template<typename READER>
+    void searchstream(READER& reader, const std::string& origin, const SearchBase& searcher, matchresults& res)
+    {
+        typename READER::block *prev = NULL;
+
+        uint64_t offset = 0;    // the file offset of 'bufstart'
+        size_t carry = 0;
+
+        // for --stats, the time waiting for the next block is io, or decompression
+        constexpr bool isfile = std::is_same<READER, blockreader>::value;
+        auto next = [&]() {
+            searchstats::timer t(!stats ? NULL : isfile ? &stats->iotime : &stats->decompresstime);
+            auto blk = reader.next();
+            if (stats && blk)
+                (isfile ? stats->bytesread : stats->bytesdecompressed) += blk->size;
+            return blk;
+        };
+
+        while (auto blk = next())
+        {
+            uint64_t hole = 0;
+            if constexpr (isfile) {
+                if (prev && blk->offset > prev->offset + prev->size)
+                    hole = blk->offset - prev->offset - prev->size;
+            }
+            if (hole) {
+                // the reader skipped a hole: search the carried bytes followed by zeros,
+                // and put zeros in front of the next block.
+                size_t margin = std::min<uint64_t>(hole, std::min(maxcarry(), std::max<size_t>(1, maxmatchlength()) - 1));
+                std::vector<char> tail(carry + margin);
+                memcpy(tail.data(), prev->data + prev->size - carry, carry);
+                size_t tailcarry;
+                if (carry && !searchblock(tail.data(), tail.data() + carry, tail.data() + tail.size(), offset, origin, searcher, res, tailcarry))
+                    break;
+                if (stats)
+                    stats->holebytes += hole;
+                offset += carry + hole - margin;
+                carry = margin;
+                memset(blk->data - carry, 0, carry);
+            }
+            char *bufstart = blk->data - carry;
+            if (carry && !hole)
+                memcpy(bufstart, prev->data + prev->size - carry, carry);
+            if (prev)
+                reader.release(prev);
+            prev = blk;
+
+            auto readend = blk->data + blk->size;
+            if (!searchblock(bufstart, blk->data, readend, offset, origin, searcher, res, carry))
+                break;
+            offset += (readend - bufstart) - carry;
+        }
+        if (res.pending && prev) {
+            auto end = prev->data + prev->size;
+            writependingrecord(res, origin, end - carry, end, offset, true);
+        }
+        if (count_only)
+            writesummary(res, origin);
+        if (res.nameprinted)
+            res.write("\n");
+    }
+
+    // the unsearched tail of each block is placed in front of the next block.
+    // this is at most half a block, larger partial matches are not found.
+    size_t maxcarry() const { return blocksize / 2; }
+
+    /*
+     *  search a block read from a stream, of which [bufstart, newdata) was
+     *  carried over from the previous block, with 'offset' the stream offset of bufstart.
+     *
+     *  'carry' is set to the nr of bytes at the end of the block which must
+     *  be searched again with the next block.
+     *  returns false when the search was stopped.
+     */
+    bool searchblock(const char *bufstart, const char *newdata, const char *readend, uint64_t offset, const std::string& origin, const SearchBase& searcher, matchresults& res, size_t& carry)
+    {
+        // the non-regex searchers do not report partial matches, for these keep
+        // enough bytes to find a match crossing the block boundary.
+        size_t overlap = searchtype == REGEX_SEARCH ? 0 : std::min(maxcarry(), std::max<size_t>(1, maxmatchlength()) - 1);
+
+        res.setcontext(bufstart, readend, false);
+        if (res.pending)
+            writependingrecord(res, origin, bufstart, readend, offset, false);
+
+        auto partial = runsearchinorder(searcher, bufstart, readend, offset, [&res, &origin, bufstart, newdata, offset, this](const char *first, const char *last)->bool {
+            // matches entirely in the carried bytes were already reported.
+            if (last <= newdata)
+                return true;
+            return writeresult(res, origin, bufstart, offset, first, last);
+        });
+        if (partial==NULL || matchstart) {  // writeresult told searcher to stop
+            // print the record as far as it was read
+            if (res.pending)
+                writependingrecord(res, origin, bufstart, readend, offset, true);
+            return false;
+        }
+
+        if (partial == readend)
+            partial -= std::min(overlap, size_t(readend - bufstart));
+
+        // keep the start of the record containing the carried bytes, it may contain a match in the next block.
+        if (record.type != recordfinder::NONE) {
+            auto s = res.pending ? bufstart + std::max(res.pendingofs, offset) - offset
+                                 : record.start(bufstart, partial, offset + (partial - bufstart), knownrecord(res, bufstart, offset, partial));
+            partial = std::min(partial, s);
+            if (size_t(readend - s) <= maxcarry())
+                res.recordstart = offset + (s - bufstart);
+        }
+
+        // avoid too large partial matches
+        carry = std::min(size_t(readend - partial), maxcarry());
+        if (stats) {
+            stats->blocks++;
+            if (carry) {
+                stats->carries++;
+                stats->carrybytes += carry;
+            }
+        }
+        return true;
+    }
+
+    void searchfile(const std::string& fn, const SearchBase& searcher, matchresults& res)
+    {
+        filehandle f = open(fn.c_str(), O_RDONLY);
+        if (stats)
+            stats->filesopened++;
+        searchhandle(f, fn, searcher, res);
+    }
+
+    void searchhandle(filehandle& f, const std::string& origin, const SearchBase& searcher, matchresults& res)
+    {
+        auto size = f.size();
+        if (size == 0)
+            return;
+        else if ((decompress || archives) && size > 0 && searchcontainer(f, size, origin, searcher, res))
+            return;
+        else if (use_sequential || size < 0)
+            searchsequential(f, origin, searcher, res);
+        else
+            searchmmap(f, size, origin, searcher, res);
+    }
+    /*
+     *  search a compressed file, with -z, or an archive, with -a.
+     *  returns false for other files.
+     */
+    bool searchcontainer(filehandle& f, uint64_t fsize, const std::string& origin, const SearchBase& searcher, matchresults& res)
+    {
+        uint8_t magic[512];
+        auto n = pread(f, magic, sizeof(magic), 0);
+        if (n <= 0)
+            return false;
+        auto type = decompress ? detectcompression(magic, n) : NOT_COMPRESSED;
+        if (type != NOT_COMPRESSED && !compressionsupported(type)) {
+            if (verbose)
+                res.write("%s: not built with %s support, searching the compressed data\n", origin, compressionname(type));
+            type = NOT_COMPRESSED;
+        }
+        if (type == NOT_COMPRESSED && !(archives && detectarchive(magic, n) != NOT_AN_ARCHIVE))
+            return false;
+        if (maxfilesize && fsize >= maxfilesize) {
+            if (stats)
+                stats->filesskipped++;
+            if (verbose)
+                res.write("skipping large file %s\n", origin);
+            return true;
+        }
+
+        if (stats)
+            stats->bytesmapped += fsize;
+        mappedmem r(f, 0, fsize, PROT_READ);
+#ifndef _WIN32
+        // a compressed file is read once, from start to end
+        if (type != NOT_COMPRESSED)
+            madvise(r.begin(), fsize, MADV_SEQUENTIAL);
+#endif
+        searchcontents((const char*)r.begin(), (const char*)r.end(), type, origin, 0, searcher, res);
+        return true;
+    }
+
+    /*
+     *  search [first, last), the contents of a file or of an archive member,
+     *  stored with compression 'c'. 'depth' is the nr of archives containing it.
+     *
+     *  A compressed archive, like a .tar.gz, is decompressed in memory, so its
+     *  members can be searched separately. Other compressed data is decompressed
+     *  while it is searched.
+     */
+    void searchcontents(const char *first, const char *last, Compression c, const std::string& origin, int depth, const SearchBase& searcher, matchresults& res)
+    {
+        if (c == NOT_COMPRESSED && decompress) {
+            c = detectcompression((const uint8_t*)first, last - first);
+            if (!compressionsupported(c))
+                c = NOT_COMPRESSED;
+        }
+        bool nested = archives && depth < archivedepth;
+        if (c != NOT_COMPRESSED) {
+            // an archive, or more compressed data, like a .tar.gz in a zip
+            auto head = decompressdata(first, last - first, c, 512);
+            if ((nested && detectarchive((const uint8_t*)head.data(), head.size()) != NOT_AN_ARCHIVE)
+                    || (decompress && compressionsupported(detectcompression((const uint8_t*)head.data(), head.size())))) {
+                auto limit = maxfilesize ? std::min<uint64_t>(maxfilesize, maxinmemory) : maxinmemory;
+                std::vector<char> data;
+                {
+                searchstats::timer t(stats ? &stats->decompresstime : NULL);
+                data = decompressdata(first, last - first, c, limit);
+                }
+                if (stats)
+                    stats->bytesdecompressed += data.size();
+                if (maxfilesize && data.size() >= maxfilesize) {
+                    if (stats)
+                        stats->filesskipped++;
+                    if (verbose)
+                        res.write("skipping large file %s\n", origin);
+                    return;
+                }
+                if (data.size() >= limit) {
+                    if (verbose)
+                        res.write("%s: too large to decompress in memory, searching it without the archive members\n", origin);
+                    data = std::vector<char>();
+                    searchdecompressed(first, last, c, origin, searcher, res);
+                    return;
+                }
+                searchcontents(data.data(), data.data() + data.size(), NOT_COMPRESSED, origin, depth, searcher, res);
+                return;
+            }
+            searchdecompressed(first, last, c, origin, searcher, res);
+            return;
+        }
+        auto type = nested ? detectarchive((const uint8_t*)first, last - first) : NOT_AN_ARCHIVE;
+        if (type != NOT_AN_ARCHIVE) {
+            searcharchive(first, last, type, origin, depth, searcher, res);
+            return;
+        }
+
+        searchplain(first, last, origin, searcher, res);
+    }
+
+    // search [first, last) as a single file.
+    void searchplain(const char *first, const char *last, const std::string& origin, const SearchBase& searcher, matchresults& res)
+    {
+        res.reset();
+        res.setcontext(first, last, true);
+        searchbuffer(first, last, last, 0, origin, searcher, res);
+        if (count_only)
+            writesummary(res, origin);
+        if (res.nameprinted)
+            res.write("\n");
+    }
+
+    /*
+     *  search the decompressed contents of [first, last).
+     *
+     *  The offsets are in the decompressed data, with -v and --format jsonl
+     *  the compressed offset of the frame, or gzip member, containing the match is added.
+     */
+    void searchdecompressed(const char *first, const char *last, Compression c, const std::string& origin, const SearchBase& searcher, matchresults& res)
+    {
+        res.reset();
+
+        decompressreader reader(first, last - first, c, blocksize, maxcarry(), nthreads, nbuffers);
+        // a deflated zip member is a single frame
+        res.compressed = c != DEFLATE_COMPRESSED ? &reader : NULL;
+        try {
+            searchstream(reader, origin, searcher, res);
+        }
+        catch(...) {
+            res.compressed = NULL;
+            throw;
+        }
+        res.compressed = NULL;
+    }
+
+    /*
+     *  search the members of the archive [first, last), each as a file named 'archive!member'.
+     *  Archives inside the archive are searched up to a nesting of 'archivedepth'.
+     *
+     *  With -j the members of the outermost archive are searched in parallel,
+     *  the output is printed in the order of the archive.
+     */
+    void searcharchive(const char *first, const char *last, ArchiveType type, const std::string& origin, int depth, const SearchBase& searcher, matchresults& res)
+    {
+        std::vector<archivemember> members;
+        try {
+            members = listmembers((const uint8_t*)first, last - first, type);
+        }
+        catch(const std::exception& e) {
+            // a truncated archive, or a file which only starts like one.
+            if (verbose)
+                res.write("%s: %s, searching it as a plain file\n", origin, e.what());
+            searchplain(first, last, origin, searcher, res);
+            return;
+        }
+        if (verbose > 1)
+            res.write("%s: %s archive with %d members\n", origin, archivename(type), members.size());
+
+        auto searchmember = [&](const archivemember& m, matchresults& mres) {
+            auto name = origin + "!" + m.name;
+            try {
+                if (!m.problem.empty()) {
+                    if (verbose)
+                        mres.write("skipping %s: %s\n", name, m.problem);
+                }
+                else if (m.compression != NOT_COMPRESSED && !compressionsupported(m.compression)) {
+                    if (verbose)
+                        mres.write("skipping %s: not built with %s support\n", name, compressionname(m.compression));
+                }
+                else if (maxfilesize && m.size >= maxfilesize) {
+                    if (stats)
+                        stats->filesskipped++;
+                    if (verbose)
+                        mres.write("skipping large file %s\n", name);
+                }
+                else {
+                    searchcontents(first + m.offset, first + m.offset + m.size, m.compression, name, depth + 1, searcher, mres);
+                }
+            }
+            catch(const std::exception& e) {
+                mres.write("EXCEPTION in %s - %s\n", name, e.what());
+            }
+        };
+
+        if (nthreads <= 1 || depth > 0 || res.inworker || members.size() < 2) {
+            for (auto & m : members)
+                searchmember(m, res);
+            return;
+        }
+
+        std::atomic<size_t> nextmember{0};
+        std::mutex outmtx;
+        std::map<size_t, std::string> finished;     // output of members done before the ones in front of them
+        size_t nextout = 0;
+
+        auto worker = [&]() {
+            size_t i;
+            uint64_t busy = 0, tasks = 0;
+            while ((i = nextmember++) < members.size()) {
+                matchresults mres;
+                mres.buffered = true;
+                mres.inworker = true;
+                auto t0 = stats ? searchstats::now() : 0;
+                searchmember(members[i], mres);
+                if (stats) {
+                    busy += searchstats::now() - t0;
+                    tasks++;
+                }
+
+                std::lock_guard<std::mutex> lock(outmtx);
+                finished.emplace(i, std::move(mres.output));
+                while (!finished.empty() && finished.begin()->first == nextout) {
+                    res.append(finished.begin()->second);
+                    finished.erase(finished.begin());
+                    nextout++;
+                }
+            }
+            if (stats)
+                stats->addthread("members", tasks, busy);
+        };
+
+        std::vector<std::thread> threads;
+        for (int t = 1 ; t < std::min<int>(nthreads, members.size()) ; t++)
+            threads.emplace_back(worker);
+        worker();
+        for (auto & t : threads)
+            t.join();
+    }
+
+    void searchmmap(filehandle& f, uint64_t fsize, const std::string& origin, const SearchBase& searcher, matchresults& res)
+    {
+        if (maxfilesize && fsize >= maxfilesize) {
+            if (stats)
+                stats->filesskipped++;
+            if (verbose)
+                res.write("skipping large file %s\n", origin);
+            return;
+        }
+        if (stats)
+            stats->bytesmapped += fsize;
+
+        res.reset();
+        if (!matcheszeros)
+            res.holes = fileholes(f, fsize, maxmatchlength());
+
+        if (usewindow(fsize)) {
+            searchwindowed(f, fsize, origin, searcher, res);
+        }
+        else {
+            mappedmem r(f, 0, fsize, PROT_READ);
+            res.setcontext((const char*)r.begin(), (const char*)r.end(), true);
+            searchbuffer((const char*)r.begin(), (const char*)r.end(), (const char*)r.end(), 0, origin, searcher, res);
+        }
+
+        if (count_only)
+            writesummary(res, origin);
+        if (res.nameprinted)
+            res.write("\n");
+        res.holes.clear();
+    }
+
+    /*
+     *  the holes of a sparse file, of at least 'minsize' bytes, as file offsets.
+     */
+    std::vector<std::pair<uint64_t, uint64_t>> fileholes(int f, uint64_t fsize, uint64_t minsize) const
+    {
+        std::vector<std::pair<uint64_t, uint64_t>> holes;
+#ifdef SEEK_HOLE
+        struct stat st;
+        if (fstat(f, &st) || uint64_t(st.st_blocks) * 512 >= fsize)
+            return holes;
+        uint64_t ofs = 0;
+        while (ofs < fsize) {
+            auto hole = lseek(f, ofs, SEEK_HOLE);
+            if (hole < 0 || uint64_t(hole) >= fsize)
+                break;
+            auto data = lseek(f, hole, SEEK_DATA);
+            uint64_t end = data < 0 ? fsize : data;
+            if (end - hole >= minsize) {
+                holes.emplace_back(hole, end);
+                if (stats)
+                    stats->holebytes += end - hole;
+            }
+            ofs = end;
+        }
+#endif
+        return holes;
+    }
 
-#ifdef WITH_MEMSEARCH
-    void searchmemory()
+    /*
+     *  search [bufstart, bufend), where 'offset' is the file offset of bufstart.
+     *  matches starting at or after 'keepend' are ignored.
+     *  returns false when the search was stopped by writeresult.
+     *
+     *  The holes in 'res.holes' are not searched, or touched, only
+     *  maxmatchlength-1 bytes at each end, for matches which start or end with zeros.
+     */
+    bool searchbuffer(const char *bufstart, const char *bufend, const char *keepend, uint64_t offset, const std::string& origin, const SearchBase& searcher, matchresults& res)
     {
-        task_t task = MachOpenProcessByPid(pid);
-        auto searcher = makesearcher();
+        if (res.holes.empty())
+            return searchpart(bufstart, bufend, keepend, offset, origin, searcher, res);
 
-        MachVirtualMemory mem(task, memoffset, memsize);
+        size_t margin = std::max<size_t>(1, maxmatchlength()) - 1;
+        auto part = bufstart;       // the start of the next part to search
+        for (auto [holestart, holeend] : res.holes) {
+            if (holeend <= offset)
+                continue;
+            if (holestart >= offset + (bufend - bufstart))
+                break;
+            auto first = bufstart + (std::max(holestart, offset) - offset);
+            auto last = bufstart + std::min<uint64_t>(holeend - offset, bufend - bufstart);
+            if (first > part) {
+                auto partend = std::min(bufend, first + margin);
+                if (!searchpart(part, partend, std::min(keepend, partend), offset + (part - bufstart), origin, searcher, res))
+                    return false;
+            }
+            part = std::max(part, last - std::min<size_t>(margin, last - bufstart));
+        }
+        if (part < keepend)
+            return searchpart(part, bufend, keepend, offset + (part - bufstart), origin, searcher, res);
+        return true;
+    }
+    bool searchpart(const char *bufstart, const char *bufend, const char *keepend, uint64_t offset, const std::string& origin, const SearchBase& searcher, matchresults& res)
+    {
+        if (nthreads > 1 && !res.inworker && uint64_t(keepend - bufstart) > 2 * chunksize)
+            return searchchunked(bufstart, bufend, keepend, offset, origin, searcher, res);
 
-        searcher->search((const char*)mem.begin(), (const char*)mem.end(), [&mem, this](const char *first, const char *last)->bool {
-            return writeresult("memory", (const char*)mem.begin(), memoffset, first, last);
+        return NULL != runsearchinorder(searcher, bufstart, bufend, offset, [&res, &origin, bufstart, keepend, offset, this](const char *first, const char *last)->bool {
+            if (first >= keepend)
+                return true;
+            return writeresult(res, origin, bufstart, offset, first, last);
         });
     }
-#endif
 
-    void searchstdin()
+    bool usewindow(uint64_t fsize) const
     {
-        filehandle f(0);
-        searchsequential(f, "-");
+        if (maxrss)
+            return fsize > maxrss / 2;
+        // a 32 bit address space can not map large files at once.
+        return sizeof(void*) == 4 && fsize > 0x20000000;
     }
 
-    void searchsequential(filehandle& f, const std::string& origin)
+    /*
+     *  search a file through a sliding mmap window, so only a limited part
+     *  of the file is mapped, and resident, at any time.
+     *
+     *  The next window is mapped, with MADV_WILLNEED, before the current one is
+     *  searched, the pages behind the current window are dropped from the page cache.
+     *  Each window overlaps the next by the maximum match length.
+     *  With --record the windows also include the maximum record size before
+     *  and after, so records crossing a window boundary are printed completely.
+     */
+    void searchwindowed(filehandle& f, uint64_t fsize, const std::string& origin, const SearchBase& searcher, matchresults& res)
     {
-        //printf("searching stdin\n");
-        // see: http://www.boost.org/doc/libs/1_52_0/libs/regex/doc/html/boost_regex/partial_matches.html
-
-        nameprinted = false;
-        matchcount = 0;
-
-        std::vector<char> buf(0x100000);
-        char *bufstart = &buf.front();
-        char *bufend = bufstart + buf.size();
-        uint64_t offset = 0;
-
-        auto searcher = makesearcher();
-
-        char *readptr = bufstart;
-
-        while (true)
-        {
-            int needed = bufend - readptr;
-            //print("%08x ; %x: needed = %d -> %p .. %p .. %p\n", offset, lseek(f, 0, 1), needed, bufstart, readptr, bufend);
-            int n = read(f, readptr, needed);
-            if (n == 0) {
-                if (readcontinuous) {
-                    //printf("stdin: waiting for more\n");
 #ifdef _WIN32
-                    Sleep(10);
+        uint64_t pagesize = 0x10000;    // the allocation granularity
 #else
-                    usleep(100);
+        uint64_t pagesize = sysconf(_SC_PAGESIZE);
 #endif
-                    continue;
-                }
-                //print("read empty(need=%d), pos=%d\n", needed, lseek(f, 0, 1));
-                break;
-            }
-            else if (n > needed || n < 0)
-            {
-                //perror("read");
-                //print("n=%d\n", n);
-                break;
-            }
+        uint64_t context = record.type != recordfinder::NONE ? (record.maxsize + pagesize - 1) & ~(pagesize - 1) : 0;
+        uint64_t overlap = ((maxmatchlength() + pagesize - 1) & ~(pagesize - 1)) + context;
+        uint64_t limit = maxrss ? maxrss : 0x10000000;
+        // two windows are mapped at the same time
+        uint64_t window = limit / 2 > context + overlap + pagesize ? (limit / 2 - context - overlap) & ~(pagesize - 1) : pagesize;
 
-            char *readend = readptr + n;
-            const char *partial;
+        // the mapping of the window at 'start' begins 'context' bytes earlier,
+        // windows inside a hole are not mapped.
+        auto mapwindow = [&](uint64_t start) {
+            auto mapstart = start - std::min(start, context);
+            auto size = std::min(start - mapstart + window + overlap, fsize - mapstart);
+            for (auto [holestart, holeend] : res.holes)
+                if (holestart <= mapstart && mapstart + size <= holeend)
+                    return std::unique_ptr<mappedmem>();
+            auto m = std::make_unique<mappedmem>(f, mapstart, size, PROT_READ);
+#ifndef _WIN32
+            madvise(m->begin(), size, MADV_SEQUENTIAL);
+            madvise(m->begin(), size, MADV_WILLNEED);
+#endif
+            return m;
+        };
 
-            partial = searcher->search(bufstart, readend, [&origin, bufstart, offset, this](const char *first, const char *last)->bool {
-                return writeresult(origin, bufstart, offset, first, last);
-            });
-            if (partial==NULL)  // writeresult told searcher to stop
-                break;
-            if (matchstart)
-                break;
+        auto cur = mapwindow(0);
+        for (uint64_t start = 0 ; start < fsize ; start += window) {
+            std::unique_ptr<mappedmem> next;
+            if (start + window < fsize)
+                next = mapwindow(start + window);
+            if (!cur) {
+                cur = std::move(next);
+                continue;
+            }
 
-            // avoid too large partial matches
-            if (partial - bufstart < (int)buf.size()/2)
-                partial = bufstart + buf.size()/2;
+            auto mapbegin = (const char*)cur->begin();
+            auto bufstart = mapbegin + std::min(start, context);
+            auto bufend = (const char*)cur->end();
+            auto keepsize = std::min(window, fsize - start);
 
-            // relocate data for partial matches
-            if (partial < readend) {
-                memcpy(bufstart, partial, readend - partial);
-                readptr = bufstart + (readend - partial);
-                n -= (readend - partial);
-            }
-            else {
-                readptr = bufstart;
-            }
+            res.setcontext(mapbegin, bufend, start + window >= fsize);
+            bool more = searchbuffer(bufstart, bufend, bufstart + keepsize, start, origin, searcher, res);
 
-            offset += n;
+#ifndef _WIN32
+            madvise(cur->begin(), bufend - mapbegin, MADV_DONTNEED);
+#endif
+#ifdef __linux__
+            posix_fadvise(f, start, keepsize, POSIX_FADV_DONTNEED);
+#endif
+            if (!more || matchstart)
+                break;
+            cur = std::move(next);
         }
-        if (count_only)
-            print("%6d %s\n", matchcount, "-");
-        if (nameprinted)
-            print("\n");
     }
-    void searchfile(const std::string& fn)
+
+    /*
+     *  the maximum length of a match, used as the overlap between chunks.
+     */
+    size_t maxmatchlength() const
     {
-        filehandle f = open(fn.c_str(), O_RDONLY);
-        searchhandle(f, fn);
+        if (searchtype == REGEX_SEARCH)
+            return regexwindow;
+        if (filepatterns)
+            return filepatterns->maxlength();
+        size_t len = 0;
+        for (auto & r : valueranges)
+            len = std::max(len, size_t(r.width));
+        for (auto & bm : bytemasks)
+            len = std::max(len, bm.first.size());
+        return len;
     }
 
-    void searchhandle(filehandle& f, const std::string& origin)
+    /*
+     *  true when a pattern may match zero bytes only, then zero filled data,
+     *  like the holes of sparse files, must be searched too.
+     */
+    bool canmatchzeros() const
     {
-        auto size = f.size();
-        if (size == 0)
-            return;
-        else if (use_sequential || size < 0)
-            searchsequential(f, origin);
-        else
-            searchmmap(f, size, origin);
+        if (searchtype == REGEX_SEARCH || maxmatchlength() == 0)
+            return true;
+        auto iszero = [](const uint8_t *data, const uint8_t *mask, size_t size) {
+            for (size_t i = 0 ; i < size ; i++)
+                if (data[i] & (mask ? mask[i] : 0xFF))
+                    return false;
+            return true;
+        };
+        for (auto & [data, mask] : bytemasks)
+            if (iszero(data.data(), mask.data(), data.size()))
+                return true;
+        if (filepatterns) {
+            for (size_t i = 0 ; i < filepatterns->size() ; i++)
+                if (iszero(filepatterns->data(i), filepatterns->mask(i), filepatterns->length(i)))
+                    return true;
+        }
+        static const char zeros[8] = {};
+        for (auto & r : valueranges)
+            if (r.matches(zeros, false))
+                return true;
+        return false;
     }
-    void searchmmap(filehandle& f, uint64_t fsize, const std::string& origin)
+
+    /*
+     *  search a large buffer in chunks, on multiple threads.
+     *  the arguments are the same as for searchbuffer.
+     *
+     *  Each chunk is searched including 'maxmatchlength' bytes of the previous
+     *  and of the next chunk, only matches starting inside the chunk are kept.
+     *  So matches crossing the boundary are found exactly once, and the
+     *  searcher sees the bytes before the chunk, for regex '\b' or 'a+'.
+     *
+     *  Buffers searched on a worker thread of the -j pool, or of an archive,
+     *  are not split, so the nr of threads stays 'nthreads'.
+     *  The matches of each chunk are passed through an orderedqueue, and printed
+     *  in order of their offset by this thread, while the next chunks are searched.
+     */
+    bool searchchunked(const char *bufstart, const char *bufend, const char *keepend, uint64_t offset, const std::string& origin, const SearchBase& searcher, matchresults& res)
     {
-        if (maxfilesize && fsize >= maxfilesize) {
-            if (verbose)
-                print("skipping large file %s\n", origin);
-            return;
-        }
+        uint64_t size = bufend - bufstart;
+        uint64_t keepsize = keepend - bufstart;
+        size_t nchunks = (keepsize + chunksize - 1) / chunksize;
+        uint64_t overlap = maxmatchlength();
 
-        mappedmem r(f, 0, fsize, PROT_READ);
+        typedef std::pair<const char*, const char*> match;
+        orderedqueue<match> queue(nchunks, std::min<size_t>(nthreads, nchunks));
+        std::vector<int> counts(nchunks);
+        std::exception_ptr error;   // the first exception on a worker, rethrown on this thread
+        std::mutex errormtx;
 
-        nameprinted = false;
-        matchcount = 0;
+        auto worker = [&](int id) {
+            uint64_t t0 = stats ? searchstats::now() : 0, tasks = 0;
+            size_t i;
+            while (queue.claim(i)) {
+                tasks++;
+                auto first = bufstart + i * chunksize;
+                auto last = bufstart + std::min(keepsize, (i + 1) * chunksize);
+                auto searchstart = first - std::min(overlap, i * chunksize);
+                auto searchend = bufstart + std::min(size, (i + 1) * chunksize + overlap);
 
-        auto searcher = makesearcher();
+                try {
+                    runsearch(searcher, searchstart, searchend, offset + (searchstart - bufstart), [&, i, first, last](const char *mfirst, const char *mlast)->bool {
+                        if (!queue.wanted(i))
+                            return false;
+                        if (mfirst < first || mfirst >= last)
+                            return true;
+                        if (count_only) {
+                            counts[i]++;
+                            return true;
+                        }
+                        if (list_only || matchstart)
+                            queue.found(i);
+                        if (!queue.push(id, i, match(mfirst, mlast)))
+                            return false;
+                        // for -0 the rest of this chunk may still contain an earlier match.
+                        return !list_only;
+                    });
+                }
+                catch(...) {
+                    std::lock_guard<std::mutex> lock(errormtx);
+                    if (!error)
+                        error = std::current_exception();
+                    queue.cancel();
+                    break;
+                }
+                if (!queue.done(id, i))
+                    break;
+            }
+            if (stats)
+                stats->addthread("chunks", tasks, searchstats::now() - t0);
+        };
 
-        auto bufstart = (const char*)r.begin();
+        bool complete = queue.run(worker, [&](size_t i, std::vector<match>& m) {
+            res.matchcount += counts[i];
 
-        searcher->search(bufstart, (const char*)r.end(), [&origin, bufstart, this](const char *first, const char *last)->bool {
-            return writeresult(origin, bufstart, 0, first, last);
+            std::sort(m.begin(), m.end());
+            for (auto [mfirst, mlast] : m)
+                if (!writeresult(res, origin, bufstart, offset, mfirst, mlast))
+                    return false;
+            return true;
         });
-
-
-        if (count_only)
-            print("%6d %s\n", matchcount, origin);
-        if (nameprinted)
-            print("\n");
-
+        if (error)
+            std::rethrow_exception(error);
+        return complete;
     }
+
     static std::string guidstring(const uint8_t *p)
     {
         struct guid {
@@ -658,32 +3948,199 @@ struct findstr {
                 g->d[2], g->d[3], g->d[4], g->d[5], g->d[6], g->d[7]);
     }
 
-    bool writeresult(const std::string& origin, const char *bufstart, uint64_t offset, const char *first, const char *last)
+    /*
+     *  write a record in one of the machine readable formats, with offset UINT64_MAX
+     *  it is a summary, with the match count in 'length'.
+     *  'id' is the -F pattern which matched, or -1.
+     */
+    void writerecord(matchresults& res, const std::string& origin, uint64_t offset, uint64_t length, const char *first, const char *last, int64_t id = -1)
+    {
+        if (!outputbytes || offset == UINT64_MAX)
+            first = last = NULL;
+        switch(outputformat) {
+            case JSONL_OUTPUT:
+                res.output += "{\"origin\":\"";
+                res.appendjson(origin);
+                if (offset == UINT64_MAX) {
+                    res.output += "\",\"count\":";
+                    res.appenddecimal(length);
+                }
+                else {
+                    res.output += "\",\"offset\":";
+                    res.appenddecimal(offset);
+                    res.output += ",\"length\":";
+                    res.appenddecimal(length);
+                    if (id >= 0) {
+                        res.output += ",\"pattern\":";
+                        res.appenddecimal(id);
+                    }
+                    if (res.compressed) {
+                        res.output += ",\"frame\":";
+                        res.appenddecimal(res.compressed->frameoffset(offset));
+                    }
+                }
+                if (first) {
+                    res.output += ",\"bytes\":\"";
+                    res.appendbytes(first, last);
+                    res.output += '"';
+                }
+                res.append("}\n");
+                break;
+            case TSV_OUTPUT:
+                res.appendtsv(origin);
+                if (offset != UINT64_MAX) {
+                    res.output += '\t';
+                    res.appenddecimal(offset);
+                }
+                res.output += '\t';
+                res.appenddecimal(length);
+                if (id >= 0) {
+                    res.output += '\t';
+                    res.appenddecimal(id);
+                }
+                if (first) {
+                    res.output += '\t';
+                    res.appendbytes(first, last);
+                }
+                res.append("\n");
+                break;
+            case BINARY_OUTPUT:
+                {
+                binaryrecord rec = { uint32_t(origin.size()), uint32_t(last - first), offset, length };
+                res.output.append((const char*)&rec, sizeof(rec));
+                res.output += origin;
+                res.append(first, last - first);
+                }
+                break;
+            case TEXT_OUTPUT:
+                break;
+        }
+    }
+
+    // the -c and -l output for a file
+    void writesummary(matchresults& res, const std::string& origin)
+    {
+        if (outputformat != TEXT_OUTPUT)
+            writerecord(res, origin, UINT64_MAX, res.matchcount, NULL, NULL);
+        else if (count_only)
+            res.write("%6d %s\n", res.matchcount, origin);
+        else
+            res.write("%s\n", origin);
+    }
+
+    /*
+     *  print the record containing the match [first, last), using the context set in 'res'.
+     *  Several matches in the same record print it only once.
+     *  When the end of the record was not read yet, it is printed by writependingrecord.
+     */
+    void writematchrecord(matchresults& res, const std::string& origin, const char *bufstart, uint64_t offset, const char *first, const char *last)
+    {
+        uint64_t matchofs = offset + (first - bufstart);
+        if (matchofs < res.recordend || (res.pending && matchofs >= res.pendingofs))
+            return;
+        auto s = record.start(res.ctxfirst, first, matchofs, knownrecord(res, bufstart, offset, first));
+        uint64_t sofs = offset + (s - bufstart);
+        auto e = record.end(s, sofs, last, res.ctxlast, res.ctxatend);
+        if (!e) {
+            res.pending = true;
+            res.pendingofs = sofs;
+            return;
+        }
+        res.recordstart = sofs;
+        res.recordend = offset + (e - bufstart);
+        printrecord(res, origin, sofs, s, e);
+    }
+
+    // the last known record start before 'p', as a pointer, when it is in the context.
+    static const char *knownrecord(const matchresults& res, const char *bufstart, uint64_t offset, const char *p)
+    {
+        uint64_t ctxofs = offset - (bufstart - res.ctxfirst);
+        uint64_t pofs = offset + (p - bufstart);
+        uint64_t known = res.recordstart;
+        if (res.recordend <= pofs && (res.recordend > known || known > pofs))
+            known = res.recordend;
+        if (known < ctxofs || known > pofs)
+            return NULL;
+        return res.ctxfirst + (known - ctxofs);
+    }
+
+    /*
+     *  print the pending record, now [bufstart, readend) is available, with
+     *  'offset' the file offset of bufstart.
+     */
+    void writependingrecord(matchresults& res, const std::string& origin, const char *bufstart, const char *readend, uint64_t offset, bool atend)
+    {
+        // the start was clipped when the carry was limited.
+        auto s = bufstart + (res.pendingofs > offset ? res.pendingofs - offset : 0);
+        uint64_t sofs = offset + (s - bufstart);
+        auto e = record.end(s, sofs, s, readend, atend);
+        if (!e)
+            return;
+        res.pending = false;
+        res.recordstart = sofs;
+        res.recordend = offset + (e - bufstart);
+        printrecord(res, origin, sofs, s, e);
+    }
+
+    void printrecord(matchresults& res, const std::string& origin, uint64_t ofs, const char *s, const char *e)
+    {
+        e = record.contentend(s, e);
+        if (outputformat != TEXT_OUTPUT) {
+            writerecord(res, origin, ofs, e - s, s, e);
+            return;
+        }
+        res.output += origin;
+        res.output += ' ';
+        res.appendhex(ofs, 8);
+        res.output += ' ';
+        res.appendescaped(s, e);
+        res.append("\n");
+    }
+
+    bool writeresult(matchresults& res, const std::string& origin, const char *bufstart, uint64_t offset, const char *first, const char *last)
     {
-        matchcount++;
+        searchstats::timer t(stats ? &stats->outputtime : NULL, &threadstats.outputtime);
+        res.matchcount++;
         if (count_only)
             return true;
         if (list_only) {
-            print("%s\n", origin);
+            writesummary(res, origin);
             return false;
         }
+        else if (record.type != recordfinder::NONE) {
+            writematchrecord(res, origin, bufstart, offset, first, last);
+        }
+        else if (outputformat != TEXT_OUTPUT) {
+            writerecord(res, origin, offset + first - bufstart, last - first, first, last, idsearcher ? idsearcher->patternid(first, last) : -1);
+        }
         else if (verbose) {
+            auto ofs = offset + first - bufstart;
+            auto where = res.compressed ? stringformat("%08x [frame %08x]", ofs, res.compressed->frameoffset(ofs)) : stringformat("%08x", ofs);
+            if (idsearcher)
+                where += stringformat(" #%d", idsearcher->patternid(first, last));
             if (matchbinary)
-                print("%s %08x %-b\n", origin, offset + first - bufstart, Hex::dumper((const uint8_t*)first, last - first));
+                res.write("%s %s %-b\n", origin, where, Hex::dumper((const uint8_t*)first, last - first));
             else if (pattern_is_guid)
-                print("%s %08x %s\n", origin, offset + first - bufstart, guidstring((const uint8_t*)first));
+                res.write("%s %s %s\n", origin, where, guidstring((const uint8_t*)first));
             else // TODO: add option to output the actual string, instead of the current 'ascdump'
-                print("%s %08x %+b\n", origin, offset + first - bufstart, Hex::dumper((const uint8_t*)first, last - first));
+                res.write("%s %s %+b\n", origin, where, Hex::dumper((const uint8_t*)first, last - first));
         }
         else {
-            if (!nameprinted) {
-                print("%s\n\t", origin);
+            // formatted by hand, this is the most common output
+            if (!res.nameprinted) {
+                res.output += origin;
+                res.output += "\n\t";
             }
             else {
-                print(", ");
+                res.output += ", ";
+            }
+            res.appendhex(offset + first - bufstart, 8);
+            if (idsearcher) {
+                res.output += " #";
+                res.appenddecimal(idsearcher->patternid(first, last));
             }
-            print("%08x", offset + first - bufstart);
-            nameprinted = true;
+            res.flushfull();
+            res.nameprinted = true;
         }
         if (matchstart) {
             return false;
@@ -713,6 +4170,16 @@ struct findstr {
         // if 'need unicode' -> append unicode patterns.
         //
 
+        if (!valuequeries.empty())
+            return compile_values();
+        if (!patternfile.empty())
+            return compile_patternfile();
+
+        // text containing regex syntax can only be searched by the regex engine,
+        // otherwise the choice is made by selectsearchtype, after compiling.
+        if (searchtype == AUTO_SEARCH && !pattern_is_hex && !pattern_is_guid && hasregexsyntax(pattern))
+            searchtype = REGEX_SEARCH;
+
         if (pattern_is_hex) {
             return compile_hex_pattern();
         }
@@ -720,6 +4187,13 @@ struct findstr {
             return compile_guid_pattern();
         }
         else {
+            auto i = pattern.c_str();
+            auto last = pattern.c_str() + pattern.size();
+            while (i != last) {
+                auto j = std::find(i, last, '|');
+                textpatterns.emplace_back(i, j);
+                i = (j == last) ? j : j + 1;
+            }
             if (searchtype != REGEX_SEARCH)
                 calculatebytemask();
             if (!matchbinary) {
@@ -734,6 +4208,259 @@ struct findstr {
         }
         return true;
     }
+    /*
+     *  the --u8 .. --f64 queries are searched by valuesearch, they can not
+     *  be combined with patterns.
+     */
+    bool compile_values()
+    {
+        if (searchtype != AUTO_SEARCH || !patternfile.empty()) {
+            print("value searches can not be combined with -S or -F\n");
+            return false;
+        }
+        searchtype = VALUE_SEARCH;
+        for (auto & [type, spec] : valuequeries) {
+            try {
+                valueranges.push_back(valuerange::parse(type, spec));
+            }
+            catch(const std::exception& e) {
+                print("--%s %s: %s\n", type, spec, e.what());
+                return false;
+            }
+        }
+        return true;
+    }
+    static bool hasregexsyntax(const std::string& txt)
+    {
+        return txt.find_first_of("\\^$.[]()*+?{}") != txt.npos;
+    }
+
+    static std::string readfile(const std::string& fn)
+    {
+        std::string data;
+        filehandle f = open(fn.c_str(), O_RDONLY);
+        char buf[0x10000];
+        while (true) {
+            auto n = ::read(f, buf, sizeof(buf));
+            if (n < 0)
+                throw std::runtime_error(stringformat("%s: read error", fn));
+            if (n == 0)
+                break;
+            data.append(buf, n);
+        }
+        return data;
+    }
+
+    /*
+     *  read the -F file, with one pattern per line, the line number is the pattern id.
+     *  A line is text, hex with -x, or a guid with -g, a "text:", "hex:" or "guid:"
+     *  prefix overrides this.  Empty lines and lines starting with '#' are skipped.
+     *
+     *  The patterns are stored in a single patternset, and always searched with
+     *  the Aho-Corasick automaton, its size depends only on the total pattern length.
+     */
+    bool compile_patternfile()
+    {
+        if (searchtype != AUTO_SEARCH && searchtype != AHO_CORASICK_SEARCH) {
+            print("-F only supports -S ac\n");
+            return false;
+        }
+        searchtype = AHO_CORASICK_SEARCH;
+
+        auto data = readfile(patternfile);
+        auto patterns = std::make_shared<patternset>();
+        filepatterns = patterns;
+        uint32_t lineno = 0;
+        auto i = data.c_str();
+        auto last = data.c_str() + data.size();
+        while (i != last) {
+            auto j = std::find(i, last, '\n');
+            auto e = (j > i && j[-1] == '\r') ? j - 1 : j;
+            auto line = i;
+            i = (j == last) ? j : j + 1;
+            lineno++;
+            if (line == e || *line == '#')
+                continue;
+
+            auto hasprefix = [&line, e](const char *prefix) {
+                size_t n = strlen(prefix);
+                if (size_t(e - line) < n || std::memcmp(line, prefix, n))
+                    return false;
+                line += n;
+                return true;
+            };
+            bool ishex = pattern_is_hex, isguid = pattern_is_guid;
+            if (hasprefix("hex:"))
+                ishex = true, isguid = false;
+            else if (hasprefix("guid:"))
+                ishex = false, isguid = true;
+            else if (hasprefix("text:"))
+                ishex = isguid = false;
+
+            if (ishex) {
+                patterns->add(hexpattern(line, e).getbytemask(), lineno, patternset::NARROW);
+            }
+            else if (isguid) {
+                hexpattern hp(line, e);
+                if (hp.getchunks().size() != 5) {
+                    print("%s:%d: not a guid\n", patternfile, lineno);
+                    return false;
+                }
+                patterns->add(hp.getguidmask(), lineno, patternset::NARROW);
+            }
+            else {
+                uint8_t flags = patternset::NARROW;
+                if (!matchcase)
+                    flags |= patternset::FOLDCASE;
+                if (!matchbinary)
+                    flags |= patternset::UTF16 | patternset::UTF32;
+                patterns->add(ByteMaskType(ByteVector(line, e), ByteVector(e - line, 0xFF)), lineno, flags);
+            }
+        }
+        return true;
+    }
+
+    /*
+     *  read the start of a file, to estimate the byte frequencies in the searched data.
+     */
+    void sampledata(const std::string& fn)
+    {
+        struct stat st;
+        if (stat(fn.c_str(), &st) || !S_ISREG(st.st_mode))
+            return;
+        try {
+            filehandle f = open(fn.c_str(), O_RDONLY);
+            std::vector<uint8_t> buf(0x10000);
+            auto n = ::read(f, buf.data(), buf.size());
+            if (n <= 0)
+                return;
+            // the compressed bytes, or archive headers, say little about the searched data
+            if (decompress && detectcompression(buf.data(), n) != NOT_COMPRESSED)
+                return;
+            if (archives && detectarchive(buf.data(), n) != NOT_AN_ARCHIVE)
+                return;
+            samplecounts.assign(256, 0);
+            for (int i = 0 ; i < n ; i++)
+                samplecounts[buf[i]]++;
+            samplesize = n;
+        }
+        catch(...) {
+            // without a sample the builtin byte frequencies are used.
+        }
+    }
+
+    // the estimated fraction of the data equal to 'c'
+    double bytefraction(uint8_t c) const
+    {
+        if (samplesize)
+            return (samplecounts[c] + 1.0) / (samplesize + 256.0);
+        return std::exp2((bytefrequency(c) - 255) / 32.0) / 4;
+    }
+
+    /*
+     *  choose the fastest algorithm for the compiled bytemasks, when the
+     *  searchtype was AUTO_SEARCH before compile_pattern.
+     *
+     *  The costs, in ns per searched byte, or per verified candidate, are
+     *  rough numbers measured with findstr-bench.
+     */
+    void selectsearchtype()
+    {
+        static constexpr double MASKSCAN = 0.1;       // per byte, per pattern
+        static constexpr double MASKVERIFY = 5;       // per anchor hit
+        static constexpr double ACBYTE = 4;           // per byte, independent of the nr of patterns
+        static constexpr double PREFILTERSCAN = 0.3;  // per byte, all literals in one pass
+        static constexpr double REGEXVERIFY = 200;    // per literal hit
+        static constexpr double TEXTSCAN = 0.04;      // per byte, per compared byte value
+        static constexpr double TEXTVERIFY = 5;       // per candidate
+
+        if (searchtype == REGEX_SEARCH) {
+            if (verbose)
+                print("auto: pattern has regex syntax -> regex\n");
+            return;
+        }
+        if (searchtype == VALUE_SEARCH)
+            return;
+        if (filepatterns) {
+            if (verbose)
+                print("auto: %d patterns from %s -> ac\n", filepatterns->size(), patternfile);
+            return;
+        }
+
+        // case folding is only supported by ac, text and regex
+        bool foldcase = false;
+        size_t minlen = SIZE_MAX, maxlen = 0, nbytes = 0, nwild = 0;
+        double maskhits = 0;    // expected nr of anchor hits per byte, for all patterns
+        double anyhits = 0;     // expected nr of hits on the rarest byte of each pattern
+        for (auto & [data, mask] : bytemasks) {
+            minlen = std::min(minlen, data.size());
+            maxlen = std::max(maxlen, data.size());
+            nbytes += data.size();
+
+            // the two rarest fixed bytes, as used by masksearch as anchors
+            double p1 = 1, p2 = 1;
+            for (size_t i = 0 ; i < data.size() ; i++) {
+                if (mask[i] != 0xFF) {
+                    nwild++;
+                    continue;
+                }
+                double p = bytefraction(data[i]);
+                if (!matchcase && isalpha(data[i])) {
+                    foldcase = true;
+                    p += bytefraction(data[i] ^ 0x20);
+                }
+                if (p < p1) {
+                    p2 = p1;
+                    p1 = p;
+                }
+                else if (p < p2) {
+                    p2 = p;
+                }
+            }
+            maskhits += p1 * p2;
+            anyhits += p1;
+        }
+
+        double accost = ACBYTE;
+        double maskcost = bytemasks.size() * MASKSCAN + maskhits * MASKVERIFY;
+        double regexcost = -1;
+        if (foldcase && !pattern_is_hex && !pattern_is_guid && literalscanner(regexliterals(pattern).extract(), matchcase).usable())
+            regexcost = PREFILTERSCAN + anyhits * REGEXVERIFY;
+        double textcost = -1;
+        if (!pattern_is_hex && !pattern_is_guid) {
+            textsearch text(textpatterns, matchcase, matchbinary);
+            if (text.usable())
+                textcost = text.ncompares() * TEXTSCAN + (text.haschecks() ? maskhits : anyhits) * TEXTVERIFY;
+        }
+
+        double best = accost;
+        searchtype = AHO_CORASICK_SEARCH;
+        if (foldcase) {
+            if (regexcost >= 0 && regexcost < best) {
+                best = regexcost;
+                searchtype = REGEX_SEARCH;
+            }
+        }
+        else if (maskcost < best) {
+            best = maskcost;
+            searchtype = BYTEMASK_SEARCH;
+        }
+        if (textcost >= 0 && textcost < best)
+            searchtype = TEXT_SEARCH;
+
+        if (verbose) {
+            print("auto: %d patterns, length %d..%d, %d%% wildcards, %s, %s\n", bytemasks.size(), minlen, maxlen,
+                    nbytes ? 100 * nwild / nbytes : 0, foldcase ? "ignoring case" : "matching case",
+                    samplesize ? "sampled byte frequencies" : "builtin byte frequencies");
+            std::string costs = stringformat("mask %.2f, ac %.2f", maskcost, accost);
+            if (regexcost >= 0)
+                costs += stringformat(", regex %.2f", regexcost);
+            if (textcost >= 0)
+                costs += stringformat(", text %.2f", textcost);
+            print("auto: estimated ns/byte: %s -> %s\n", costs, searchtypename(searchtype));
+        }
+    }
+
     ByteMaskType make_unicode_bytemask(const ByteMaskType& bm, int size)
     {
         ByteVector data;
@@ -746,11 +4473,12 @@ struct findstr {
                 data.push_back(0);
                 data.push_back(0);
             }
+            // the padding bytes must be zero, just like the '\x00' in make_unicode_pattern.
             mask.push_back(bm.second[i]);
-            mask.push_back(0);
+            mask.push_back(0xFF);
             if (size == 4) {
-                mask.push_back(0);
-                mask.push_back(0);
+                mask.push_back(0xFF);
+                mask.push_back(0xFF);
             }
         }
         return std::make_pair(data, mask);
@@ -813,7 +4541,34 @@ struct findstr {
         }
         return true;
     }
-    std::shared_ptr<SearchBase> makesearcher()
+    /*
+     *  the literals of which at least one must occur in a matching file.
+     *  returns an empty list when this can not be determined.
+     */
+    std::vector<std::string> requiredliterals() const
+    {
+        std::vector<std::string> literals;
+        if (searchtype == REGEX_SEARCH) {
+            for (auto & lit : regexliterals(pattern).extract())
+                literals.push_back(lit.text);
+        }
+        else if (filepatterns) {
+            for (size_t i = 0 ; i < filepatterns->size() ; i++) {
+                auto m = filepatterns->mask(i);
+                auto [ofs, len] = m ? longestfullmask(m, filepatterns->length(i)) : std::make_pair(size_t(0), filepatterns->length(i));
+                literals.emplace_back((const char*)filepatterns->data(i) + ofs, len);
+            }
+        }
+        else {
+            for (auto & bm : bytemasks) {
+                auto [ofs, len] = longestfullmask(bm);
+                literals.emplace_back((const char*)bm.first.data() + ofs, len);
+            }
+        }
+        return literals;
+    }
+
+    std::shared_ptr<const SearchBase> makesearcher() const
     {
         switch(searchtype) {
         case REGEX_SEARCH:
@@ -834,8 +4589,91 @@ struct findstr {
 #endif
         case BYTEMASK_SEARCH:
             return std::make_shared<masksearch>(bytemasks);
+        case AHO_CORASICK_SEARCH:
+            if (filepatterns)
+                return std::make_shared<acsearch>(filepatterns);
+            return std::make_shared<acsearch>(std::make_shared<patternset>(bytemasks, matchcase));
+        case TEXT_SEARCH:
+            if (textpatterns.empty())
+                throw std::runtime_error("-S text needs a text pattern");
+            return std::make_shared<textsearch>(textpatterns, matchcase, matchbinary);
+        case VALUE_SEARCH:
+            return std::make_shared<valuesearch>(valueranges, valuebigendian, valuealigned);
+        case AUTO_SEARCH:
+            break;
+        }
+        throw std::runtime_error("unknown searchtype");
+    }
+
+    /*
+     *  with --cache the Aho-Corasick automaton is saved, the other searchers compile
+     *  in a few milliseconds, and regexes can not be saved.
+     */
+    bool cacheable() const
+    {
+        if (cachedir.empty() || !valuequeries.empty() || (searchtype != AUTO_SEARCH && searchtype != AHO_CORASICK_SEARCH))
+            return false;
+        return !patternfile.empty() || pattern_is_hex || pattern_is_guid || !hasregexsyntax(pattern);
+    }
+    // a hash of the patterns, and the options which change the compiled patterns
+    uint64_t makecachekey() const
+    {
+        auto options = stringformat("%s:%d:%d:%d:%d:%d:", patternfile.empty() ? "pattern" : "file",
+                int(matchcase), int(matchbinary), int(matchword), int(pattern_is_hex), int(pattern_is_guid));
+        auto h = patterncache::hash(options.data(), options.size());
+        if (!patternfile.empty()) {
+            auto data = readfile(patternfile);
+            return patterncache::hash(data.data(), data.size(), h);
+        }
+        return patterncache::hash(pattern.data(), pattern.size(), h);
+    }
+    std::string cachefile() const
+    {
+        return stringformat("%s/%016x.fspc", cachedir, cachekey);
+    }
+
+    /*
+     *  load the automaton compiled by an earlier run with the same patterns and options,
+     *  returns NULL when there is none.
+     *  For -F the patterns are in the cache too, otherwise they are compiled, which is fast.
+     */
+    std::shared_ptr<const SearchBase> loadcache()
+    {
+        if (!cacheable())
+            return NULL;
+        std::shared_ptr<acsearch> searcher;
+        try {
+            cachekey = makecachekey();
+            searcher = std::make_shared<acsearch>(std::make_shared<patterncache>(cachefile(), cachekey));
+        }
+        catch(...) {
+            // not cached yet, or by an other version of findstr.
+            return NULL;
+        }
+        searchtype = AHO_CORASICK_SEARCH;
+        if (patternfile.empty())
+            compile_pattern();
+        else
+            filepatterns = searcher->getpatterns();
+        if (verbose)
+            print("cache: loaded %s\n", cachefile());
+        return searcher;
+    }
+    void savecache(const SearchBase& searcher) const
+    {
+        auto ac = dynamic_cast<const acsearch*>(&searcher);
+        if (!ac || !cacheable() || !cachekey)
+            return;
+        try {
+            patterncache::writer w;
+            ac->save(w);
+            w.save(cachefile(), cachekey);
+            if (verbose)
+                print("cache: saved %s\n", cachefile());
+        }
+        catch(const std::exception& e) {
+            print("EXCEPTION in %s - %s\n", cachefile(), e.what());
         }
-        throw std::runtime_error("unknown searchtype");
     }
 
     bool compile_guid_pattern()
@@ -929,6 +4767,489 @@ struct findstr {
     }
 };
 
+/*
+ * Searches files on multiple threads.
+ *
+ * The worker threads pull filenames from a shared queue, and all use the
+ * same searcher.  The output for each file is collected, and printed in one go,
+ * in the order in which the files were added, unless 'unordered' is set,
+ * then the output is printed as soon as the file was searched.
+ */
+class parallelsearch {
+    findstr& f;
+    const SearchBase& searcher;
+    bool unordered;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::deque<std::pair<uint64_t, std::string>> queue;
+    bool done = false;
+
+    std::mutex outmtx;
+    std::map<uint64_t, std::string> finished;
+    uint64_t nextseq = 0;       // number of the next file added
+    uint64_t nextout = 0;       // number of the next file to be printed
+
+    std::vector<std::thread> workers;
+public:
+    parallelsearch(findstr& f, const SearchBase& searcher, int nthreads, bool unordered)
+        : f(f), searcher(searcher), unordered(unordered)
+    {
+        for (int i = 0 ; i < nthreads ; i++)
+            workers.emplace_back([this, i]() { worker(i); });
+    }
+    ~parallelsearch()
+    {
+        finish();
+    }
+
+    void add(const std::string& fn)
+    {
+        {
+        std::lock_guard<std::mutex> lock(mtx);
+        queue.emplace_back(nextseq++, fn);
+        }
+        cv.notify_one();
+    }
+
+    // wait for all queued files to be searched.
+    void finish()
+    {
+        {
+        std::lock_guard<std::mutex> lock(mtx);
+        done = true;
+        }
+        cv.notify_all();
+        for (auto & t : workers)
+            t.join();
+        workers.clear();
+    }
+private:
+    void worker(int id)
+    {
+        uint64_t busy = 0, tasks = 0;
+        while (true) {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [this]() { return done || !queue.empty(); });
+            if (queue.empty())
+                break;
+            auto [seq, fn] = queue.front();
+            queue.pop_front();
+            lock.unlock();
+
+            auto t0 = f.stats ? searchstats::now() : 0;
+            matchresults res;
+            res.buffered = true;
+            res.inworker = true;
+            try {
+                if (fn == "-")
+                    f.searchstdin(searcher, res);
+                else
+                    f.searchfile(fn, searcher, res);
+            }
+            catch(const std::exception& e) {
+                res.write("EXCEPTION in %s - %s\n", fn, e.what());
+            }
+            catch(...) {
+                res.write("EXCEPTION in %s\n", fn);
+            }
+            emit(seq, std::move(res.output));
+            if (f.stats) {
+                busy += searchstats::now() - t0;
+                tasks++;
+            }
+        }
+        if (f.stats)
+            f.stats->addthread(stringformat("worker %d", id + 1), tasks, busy);
+    }
+
+    // print the output of all files which are next in line.
+    void emit(uint64_t seq, std::string&& output)
+    {
+        searchstats::timer t(f.stats ? &f.stats->outputtime : NULL);
+        std::lock_guard<std::mutex> lock(outmtx);
+        if (unordered) {
+            fwrite(output.data(), 1, output.size(), stdout);
+            return;
+        }
+        finished.emplace(seq, std::move(output));
+        while (!finished.empty() && finished.begin()->first == nextout) {
+            auto & out = finished.begin()->second;
+            fwrite(out.data(), 1, out.size(), stdout);
+            finished.erase(finished.begin());
+            nextout++;
+        }
+    }
+};
+
+/*
+ * Follows files, like 'tail -f', and searches the data appended to them.
+ *
+ * On linux this blocks on inotify for files and directories, and on poll
+ * for pipes. Elsewhere the files are checked every 100 ms.
+ *
+ * The partial match state is kept for each file, so appended data is searched
+ * without rescanning what was already searched. A truncated file is searched
+ * again from the start. A file which is replaced, by a rename or a delete and
+ * create, is reopened, after searching the remaining data of the old file.
+ * New files appearing in a followed directory are followed as well, with -r
+ * also those in new subdirectories.
+ *
+ * Pipes are read while poll says data is available, their fd mode is not
+ * changed, since stdin is shared with the calling shell.
+ */
+class followsearch {
+    findstr& f;
+    const SearchBase& searcher;
+
+    struct followed {
+        std::string name;
+        int fd = -1;
+        bool ispipe = false;
+        dev_t dev = 0;
+        ino_t ino = 0;
+        int wd = -1;                // the inotify watch on this file
+        uint64_t bufoffset = 0;     // the file offset of buffer[0]
+        std::vector<char> buffer;   // the carried bytes, followed by the newly read data
+        size_t carry = 0;
+        matchresults res;
+        int countprinted = 0;
+        bool done = false;          // stopped by -l or -0, or a pipe was closed
+    };
+    std::map<std::string, followed> files;
+    std::set<std::string> dirs;     // new files in these directories are followed
+    std::set<std::string> recursive;    // and new subdirectories of these
+#ifdef __linux__
+    int inotifyfd = -1;
+    std::map<int, std::string> dirwatches;
+    std::map<int, std::string> filewatches;
+#endif
+
+public:
+    followsearch(findstr& f, const SearchBase& searcher)
+        : f(f), searcher(searcher)
+    {
+#ifdef __linux__
+        inotifyfd = inotify_init1(IN_CLOEXEC);
+        if (inotifyfd < 0)
+            throw std::runtime_error("inotify_init failed");
+#endif
+    }
+    ~followsearch()
+    {
+        for (auto & [name, fl] : files)
+            if (fl.fd > 0)
+                close(fl.fd);
+#ifdef __linux__
+        close(inotifyfd);
+#endif
+    }
+
+    void addfile(const std::string& name)
+    {
+        if (files.count(name))
+            return;
+        auto & fl = files[name];
+        fl.name = name;
+        fl.buffer.resize(f.maxcarry() + f.blocksize);
+        if (name != "-")
+            watchdir(parentdir(name));
+        openfile(fl);
+        readnew(fl);
+    }
+
+    /*
+     *  follow all files in 'dir', and the files created later,
+     *  with 'recurse' also those in its subdirectories.
+     */
+    void adddir(const std::string& dir, bool recurse)
+    {
+        dirs.insert(dir);
+        if (recurse)
+            recursive.insert(dir);
+        watchdir(dir);
+        scandir(dir);
+    }
+
+    /*
+     *  wait for changes, until all followed pipes are closed, and no files
+     *  or directories are left to follow.
+     */
+    void run()
+    {
+        while (active()) {
+#ifdef __linux__
+            std::vector<pollfd> fds;
+            fds.push_back({ inotifyfd, POLLIN, 0 });
+            for (auto & [name, fl] : files)
+                if (fl.ispipe && !fl.done)
+                    fds.push_back({ fl.fd, POLLIN, 0 });
+
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR)
+                    continue;
+                throw std::runtime_error("poll failed");
+            }
+            for (auto & [name, fl] : files)
+                if (fl.ispipe && !fl.done)
+                    for (auto & p : fds)
+                        if (p.fd == fl.fd && p.revents)
+                            readnew(fl);
+            if (fds[0].revents & POLLIN)
+                handleevents();
+#else
+            usleep(100000);
+            for (auto & [name, fl] : files) {
+                readnew(fl);
+                checkreplaced(fl);
+            }
+            for (auto & dir : std::set<std::string>(dirs))
+                scandir(dir);
+#endif
+        }
+    }
+private:
+    static std::string parentdir(const std::string& name)
+    {
+        auto i = name.rfind('/');
+        if (i == name.npos)
+            return ".";
+        if (i == 0)
+            return "/";
+        return name.substr(0, i);
+    }
+
+    bool active() const
+    {
+        if (!dirs.empty())
+            return true;
+        for (auto & [name, fl] : files)
+            if (!fl.done && (fl.fd >= 0 || name != "-"))
+                return true;
+        return false;
+    }
+
+    static std::string joinpath(const std::string& dir, const std::string& name)
+    {
+        return dir == "." ? name : dir + "/" + name;
+    }
+
+    /*
+     *  follow the files in 'dir' which are not followed yet, and the new
+     *  subdirectories, when 'dir' is followed recursively.
+     */
+    void scandir(const std::string& dir)
+    {
+        std::vector<std::string> names;
+        DIR *d = opendir(dir.c_str());
+        if (!d)
+            return;
+        while (auto ent = readdir(d))
+            if (strcmp(ent->d_name, ".") && strcmp(ent->d_name, ".."))
+                names.push_back(ent->d_name);
+        closedir(d);
+        std::sort(names.begin(), names.end());
+
+        for (auto & name : names) {
+            auto path = joinpath(dir, name);
+            struct stat st;
+            if (lstat(path.c_str(), &st))
+                continue;
+            if (S_ISDIR(st.st_mode)) {
+                if (recursive.count(dir) && !dirs.count(path))
+                    adddir(path, true);
+            }
+            else if (!files.count(path) && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                addfile(path);
+            }
+        }
+    }
+
+    // true when reading the pipe will not block.
+    static bool readable(int fd)
+    {
+        pollfd p = { fd, POLLIN, 0 };
+        return poll(&p, 1, 0) > 0;
+    }
+
+    void watchdir(const std::string& dir)
+    {
+#ifdef __linux__
+        int wd = inotify_add_watch(inotifyfd, dir.c_str(), IN_CREATE | IN_MOVED_TO);
+        if (wd >= 0)
+            dirwatches[wd] = dir;
+#endif
+    }
+
+    void openfile(followed& fl)
+    {
+        fl.fd = fl.name == "-" ? 0 : open(fl.name.c_str(), O_RDONLY | O_NONBLOCK);
+        fl.bufoffset = 0;
+        fl.carry = 0;
+        fl.res.resetrecords();
+        if (fl.fd < 0)
+            return;     // wait for the file to be created
+        struct stat st;
+        if (fstat(fl.fd, &st) == 0) {
+            fl.dev = st.st_dev;
+            fl.ino = st.st_ino;
+            fl.ispipe = !S_ISREG(st.st_mode);
+        }
+#ifdef __linux__
+        if (!fl.ispipe) {
+            auto path = fl.name == "-" ? "/proc/self/fd/0"s : fl.name;
+            fl.wd = inotify_add_watch(inotifyfd, path.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+            if (fl.wd >= 0)
+                filewatches[fl.wd] = fl.name;
+        }
+#endif
+    }
+    void closefile(followed& fl)
+    {
+#ifdef __linux__
+        if (fl.wd >= 0) {
+            inotify_rm_watch(inotifyfd, fl.wd);
+            filewatches.erase(fl.wd);
+            fl.wd = -1;
+        }
+#endif
+        if (fl.fd > 0)
+            close(fl.fd);
+        fl.fd = -1;
+    }
+
+    /*
+     *  search the data appended since the last call.
+     */
+    void readnew(followed& fl)
+    {
+        if (fl.fd < 0 || fl.done)
+            return;
+        if (!fl.ispipe) {
+            struct stat st;
+            if (fstat(fl.fd, &st) == 0 && uint64_t(st.st_size) < fl.bufoffset + fl.carry) {
+                if (f.verbose)
+                    print("%s: file truncated\n", fl.name);
+                lseek(fl.fd, 0, SEEK_SET);
+                fl.bufoffset = 0;
+                fl.carry = 0;
+                fl.res.resetrecords();
+            }
+        }
+        while (true) {
+            // pipes are read until no more data is available, without blocking the other files.
+            if (fl.ispipe && !readable(fl.fd))
+                break;
+            auto n = ::read(fl.fd, fl.buffer.data() + fl.carry, f.blocksize);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n == 0 && fl.ispipe) {
+                // the writer closed the pipe
+                if (fl.res.pending)
+                    f.writependingrecord(fl.res, fl.name, fl.buffer.data(), fl.buffer.data() + fl.carry, fl.bufoffset, true);
+                fl.done = true;
+                closefile(fl);
+            }
+            if (n <= 0)
+                break;
+
+            auto bufstart = fl.buffer.data();
+            auto readend = bufstart + fl.carry + n;
+            size_t carry = 0;
+            if (!f.searchblock(bufstart, bufstart + fl.carry, readend, fl.bufoffset, fl.name, searcher, fl.res, carry)) {
+                fl.done = true;
+                break;
+            }
+            memmove(bufstart, readend - carry, carry);
+            fl.bufoffset += (readend - bufstart) - carry;
+            fl.carry = carry;
+        }
+        // finish the output for this batch of data
+        if (f.count_only && fl.res.matchcount != fl.countprinted) {
+            f.writesummary(fl.res, fl.name);
+            fl.countprinted = fl.res.matchcount;
+        }
+        if (fl.res.nameprinted) {
+            fl.res.write("\n");
+            fl.res.nameprinted = false;
+        }
+        fl.res.flush();
+        fflush(stdout);
+    }
+
+    /*
+     *  check if the file was replaced by a new file with the same name.
+     */
+    void checkreplaced(followed& fl)
+    {
+        if (fl.name == "-" || fl.done)
+            return;
+        struct stat st;
+        if (stat(fl.name.c_str(), &st))
+            return;     // removed, wait for it to be recreated
+        if (fl.fd >= 0 && st.st_dev == fl.dev && st.st_ino == fl.ino)
+            return;
+
+        if (fl.fd >= 0) {
+            readnew(fl);
+            if (f.verbose)
+                print("%s: file replaced\n", fl.name);
+        }
+        closefile(fl);
+        openfile(fl);
+        readnew(fl);
+    }
+
+#ifdef __linux__
+    void handleevents()
+    {
+        alignas(inotify_event) char buf[0x10000];
+        auto n = ::read(inotifyfd, buf, sizeof(buf));
+        if (n <= 0)
+            return;
+        for (auto p = buf ; p < buf + n ; ) {
+            auto ev = (const inotify_event*)p;
+            p += sizeof(inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events were lost, check everything.
+                for (auto & [name, fl] : files) {
+                    readnew(fl);
+                    checkreplaced(fl);
+                }
+                continue;
+            }
+            auto fw = filewatches.find(ev->wd);
+            if (fw != filewatches.end()) {
+                auto & fl = files[fw->second];
+                readnew(fl);
+                if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF))
+                    checkreplaced(fl);
+                continue;
+            }
+            auto dw = dirwatches.find(ev->wd);
+            if (dw != dirwatches.end() && ev->len) {
+                auto path = joinpath(dw->second, ev->name);
+                auto fl = files.find(path);
+                if (fl != files.end()) {
+                    checkreplaced(fl->second);
+                }
+                else if (dirs.count(dw->second)) {
+                    struct stat st;
+                    if (lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                        if (recursive.count(dw->second) && !dirs.count(path))
+                            adddir(path, true);
+                    }
+                    else if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                        addfile(path);
+                    }
+                }
+            }
+        }
+    }
+#endif
+};
+
 /*
  * object which returns an iterator, iterating over all substrings.
  */
@@ -982,9 +5303,64 @@ struct tokenize {
         return token(str.end(), str.end(), sep);
     }
 };
+#ifndef _WIN32
+/*
+ *  selects the files and directories searched with -r.
+ *
+ *  globs are matched against the name, or against the path when they contain a '/'.
+ *  regexes are searched for in the path.
+ *  Excludes apply to files and directories, includes only to files.
+ */
+struct pathfilter {
+    std::vector<std::string> excludeglobs;
+    std::vector<std::string> includeglobs;
+    std::vector<BASIC_REGEX<char>> excluderegexes;
+    std::vector<BASIC_REGEX<char>> includeregexes;
+
+    bool empty() const
+    {
+        return excludeglobs.empty() && includeglobs.empty() && excluderegexes.empty() && includeregexes.empty();
+    }
+    static bool globmatch(const std::string& glob, const std::string& path, const char *name)
+    {
+        return fnmatch(glob.c_str(), glob.find('/') != glob.npos ? path.c_str() : name, 0) == 0;
+    }
+    bool operator()(const std::string& path, const char *name, bool isdir) const
+    {
+        for (auto & g : excludeglobs)
+            if (globmatch(g, path, name))
+                return false;
+        for (auto & re : excluderegexes)
+            if (REGEX_FIND(path, re))
+                return false;
+        if (isdir || (includeglobs.empty() && includeregexes.empty()))
+            return true;
+        for (auto & g : includeglobs)
+            if (globmatch(g, path, name))
+                return true;
+        for (auto & re : includeregexes)
+            if (REGEX_FIND(path, re))
+                return true;
+        return false;
+    }
+};
+#endif
+
+// the value type of a --u8 .. --f64 option, or NULL
+template<typename ARG>
+static const char *valueoption(ARG& arg)
+{
+    for (auto type : { "u8", "u16", "u32", "u64", "i8", "i16", "i32", "i64", "f32", "f64" })
+        if (arg.match(("--"s + type).c_str()))
+            return type;
+    return NULL;
+}
+
 void usage()
 {
     print("Usage: findstr [options]  pattern  files...\n");
+    print("       findstr [options]  -F FILE  files...\n");
+    print("       findstr [options]  --u32 RANGE  files...\n");
     print("   -w       (regex) match words\n");
     print("   -b       binary match ( no unicode match )\n");
     print("   -I       case sensitive match\n");
@@ -995,23 +5371,80 @@ void usage()
     print("   -0       only match to start of file\n");
     print("   -l       list matching files\n");
     print("   -c       count number of matches per file\n");
-    print("   -f       follow, keep checking file for new data\n");
+    print("   -f       follow, search data appended to the files, or to files created in directories\n");
     print("   -M NUM   max file size\n");
-    //print("   -X LIST   exclude paths\n");
-    print("   -S NAME  search algorithm: regex, std, stdbm, stdbmh, boostbm, boostbmh, boostkmp\n");
+    print("   -F FILE  search for all patterns in FILE, one per line, optionally prefixed with text:, hex: or guid:\n");
+    print("            matches show the line number of the pattern\n");
+    print("   --u8, --u16, --u32, --u64, --i8, --i16, --i32, --i64, --f32, --f64 RANGE\n");
+    print("            search numbers of this type: VALUE, FIRST..LAST, or VALUE+-DELTA, can be repeated\n");
+    print("   --be       with --u32 etc: the numbers are big endian\n");
+    print("   --aligned  with --u32 etc: only at offsets which are a multiple of the size\n");
+#ifndef _WIN32
+    print("   -X GLOB  with -r: skip files and directories matching GLOB, can be repeated\n");
+    print("            the name is matched, or the path when GLOB contains a '/'\n");
+    print("   --include GLOB  with -r: only search files matching GLOB, can be repeated\n");
+    print("   --exclude-regex RE  with -r: skip files and directories with a path matching RE\n");
+    print("   --include-regex RE  with -r: only search files with a path matching RE\n");
+    print("   --one-file-system  with -r: do not enter directories on other filesystems\n");
+#endif
+    print("   -S NAME  search algorithm: auto, regex, std, stdbm, stdbmh, boostbm, boostbmh, boostkmp, mask, ac, text\n");
+    print("            the default, auto, chooses based on the pattern, -v shows the choice\n");
     print("   -Q       use posix::read, instead of posix::mmap\n");
+    print("   -z       search the decompressed contents of gzip, xz, zstd and lz4 files\n");
+    print("   -a       search the members of zip, tar and cpio archives, reported as archive!member\n");
+    print("   --archivedepth NUM  with -a: search archives nested up to NUM deep, default 4\n");
+    print("   --blocksize SIZE  with -Q: the size of each read, default 1M\n");
+    print("   --buffers NUM  with -Q: the nr of blocks being read ahead, default 3\n");
+    print("   -j NUM   search NUM files in parallel, 0 = one per cpu\n");
+    print("   --unordered  with -j: print results as soon as a file is done\n");
+    print("   --chunksize SIZE  with -j: files larger than twice this size are searched in parallel chunks\n");
+    print("   --format FMT   output format: text, jsonl, tsv or bin\n");
+    print("   --bytes  with --format: include the matched bytes\n");
+    print("   --record TYPE  print the record containing the match: line, nul, csv, or a block size\n");
+    print("   --maxrecord SIZE  with --record: the maximum nr of bytes before and after the match, default 64K\n");
+    print("   --maxrss SIZE  map large files in windows, keeping at most SIZE bytes mapped\n");
+    print("   --build-index DIR  create a trigram index for all files below DIR\n");
+    print("   --index FILE  search the files in this index, default: DIR/.findstr.idx\n");
+    print("   --skip-zeros  do not search zero filled 4K blocks, when no pattern matches only zeros\n");
+    print("            holes in sparse files are always skipped\n");
+    print("   --cache DIR   save the compiled -F, or ac patterns in DIR, and use these in later runs\n");
+    print("   --stats FMT   print performance counters to stderr at exit, as text or json\n");
 #ifdef WITH_MEMSEARCH
     print("   -o OFS   memory offset to start searching\n");
     print("   -L SIZE  size of memory block to search through\n");
     print("   -h PID   which process to search\n");
 #endif
+#ifdef WITH_PROCMEM
+    print("   -h PID   search the memory of this process, can be repeated\n");
+    print("   -o OFS   with -h: only search from this address\n");
+    print("   -L SIZE  with -h: only search this many bytes\n");
+    print("   --perm FLAGS    with -h: only regions with these permissions, default: r\n");
+    print("   --mapname TEXT  with -h: only regions with a name containing TEXT\n");
+#endif
 }
+// findstr-bench includes this file, with its own main.
+#ifndef FINDSTR_NO_MAIN
 int main(int argc, char** argv)
 {
+    // output is written in large blocks, unless it is read by a human.
+    // this must be done before anything is printed, -f flushes after each batch of data.
+    if (!isatty(1))
+        setvbuf(stdout, NULL, _IOFBF, 0x100000);
+
     bool recurse_dirs = false;
+    bool unordered = false;
+    std::string buildindex;
+    std::string indexfile;
     std::vector<std::string> args;
     findstr  f;
-    std::string excludepaths;
+#ifndef _WIN32
+    pathfilter filter;
+    std::vector<std::string> excluderegexes;
+    std::vector<std::string> includeregexes;
+    bool onefilesystem = false;
+#endif
+    searchstats stats;
+    std::string statsformat;
 
     for (auto& arg : ArgParser(argc, argv))
         switch (arg.option())
@@ -1028,11 +5461,19 @@ int main(int argc, char** argv)
             case 'c': f.count_only = true; break;
             case 'f': f.readcontinuous = true; break;
             case 'M': f.maxfilesize = arg.getint(); break;
-            //case 'X': excludepaths = arg.getstr(); break;
+            case 'F': f.patternfile = arg.getstr(); break;
+#ifndef _WIN32
+            case 'X': filter.excludeglobs.push_back(arg.getstr()); break;
+#endif
 #ifdef WITH_MEMSEARCH
             case 'o': f.memoffset = arg.getint(); break;
             case 'L': f.memsize = arg.getint(); break;
             case 'h': f.pid = arg.getint(); break;
+#endif
+#ifdef WITH_PROCMEM
+            case 'o': f.memoffset = arg.getint(); break;
+            case 'L': f.memsize = arg.getint(); break;
+            case 'h': f.pids.push_back(arg.getint()); break;
 #endif
             case 'S': 
                       {
@@ -1045,9 +5486,76 @@ int main(int argc, char** argv)
                       else if (mode == "boostbmh"s) f.searchtype = BOOST_BOYER_MOORE_HORSPOOL;
                       else if (mode == "boostkmp"s) f.searchtype = BOOST_KNUTH_MORRIS_PRATT;
                       else if (mode == "mask"s) f.searchtype = BYTEMASK_SEARCH;
+                      else if (mode == "ac"s) f.searchtype = AHO_CORASICK_SEARCH;
+                      else if (mode == "text"s) f.searchtype = TEXT_SEARCH;
+                      else if (mode == "auto"s) f.searchtype = AUTO_SEARCH;
                       }
                       break;
             case 'Q': f.use_sequential = true; break;
+            case 'z': f.decompress = true; break;
+            case 'a': f.archives = true; break;
+            case 'j': f.nthreads = arg.getint(); break;
+            case '-': if (arg.match("--unordered")) unordered = true;
+                      else if (arg.match("--chunksize")) f.chunksize = arg.getint();
+                      else if (arg.match("--build-index")) buildindex = arg.getstr();
+                      else if (arg.match("--blocksize")) f.blocksize = arg.getint();
+                      else if (arg.match("--buffers")) f.nbuffers = arg.getint();
+                      else if (arg.match("--maxrss")) f.maxrss = arg.getint();
+                      else if (arg.match("--index")) indexfile = arg.getstr();
+                      else if (arg.match("--cache")) f.cachedir = arg.getstr();
+                      else if (arg.match("--skip-zeros")) f.skipzeroblocks = true;
+                      else if (arg.match("--format")) {
+                          auto fmt = arg.getstr();
+                          if (fmt == "text"s) f.outputformat = TEXT_OUTPUT;
+                          else if (fmt == "jsonl"s) f.outputformat = JSONL_OUTPUT;
+                          else if (fmt == "tsv"s) f.outputformat = TSV_OUTPUT;
+                          else if (fmt == "bin"s) f.outputformat = BINARY_OUTPUT;
+                          else {
+                              usage();
+                              return 1;
+                          }
+                      }
+                      else if (arg.match("--bytes")) f.outputbytes = true;
+                      else if (arg.match("--record")) {
+                          auto type = arg.getstr();
+                          char *end;
+                          if (type == "line"s) f.record.type = recordfinder::LINE;
+                          else if (type == "nul"s) f.record.type = recordfinder::NUL;
+                          else if (type == "csv"s) f.record.type = recordfinder::CSV;
+                          else if ((f.record.blocksize = strtoull(type.c_str(), &end, 0)) && *end == 0) f.record.type = recordfinder::BLOCK;
+                          else {
+                              usage();
+                              return 1;
+                          }
+                      }
+                      else if (arg.match("--maxrecord")) f.record.maxsize = arg.getint();
+                      else if (arg.match("--archivedepth")) f.archivedepth = arg.getint();
+#ifndef _WIN32
+                      else if (arg.match("--include")) filter.includeglobs.push_back(arg.getstr());
+                      else if (arg.match("--exclude-regex")) excluderegexes.push_back(arg.getstr());
+                      else if (arg.match("--include-regex")) includeregexes.push_back(arg.getstr());
+                      else if (arg.match("--one-file-system")) onefilesystem = true;
+#endif
+                      else if (arg.match("--stats")) {
+                          statsformat = arg.getstr();
+                          if (statsformat != "text"s && statsformat != "json"s) {
+                              usage();
+                              return 1;
+                          }
+                          f.stats = &stats;
+                      }
+#ifdef WITH_PROCMEM
+                      else if (arg.match("--perm")) f.memperms = arg.getstr();
+                      else if (arg.match("--mapname")) f.memname = arg.getstr();
+#endif
+                      else if (arg.match("--be")) f.valuebigendian = true;
+                      else if (arg.match("--aligned")) f.valuealigned = true;
+                      else if (auto type = valueoption(arg)) f.valuequeries.emplace_back(type, arg.getstr());
+                      else {
+                          usage();
+                          return 1;
+                      }
+                      break;
             case 0:
                       args.push_back("-");
                       break;
@@ -1063,59 +5571,249 @@ int main(int argc, char** argv)
                 return 1;
         }
 
-    if (f.pattern.empty()) {
+    if (!buildindex.empty()) {
+        if (indexfile.empty())
+            indexfile = buildindex + "/.findstr.idx";
+        catchall(ngramindex::build(buildindex, indexfile, f.verbose), buildindex);
+        return 0;
+    }
+    // with -F, or value searches, all arguments are files
+    if ((!f.patternfile.empty() || !f.valuequeries.empty()) && !f.pattern.empty()) {
+        args.insert(args.begin(), f.pattern);
+        f.pattern.clear();
+    }
+    if (f.pattern.empty() && f.patternfile.empty() && f.valuequeries.empty()) {
         usage();
         return 1;
     }
-    if (f.pattern_is_hex) {
+    if (f.pattern_is_hex || !f.valuequeries.empty()) {
         f.matchbinary = true;
         f.matchcase = true;
     }
-    //std::set<std::string> exclude;
-    //for (auto i : tokenize(excludepaths, ':'))
-    //    exclude.insert(i);
+#ifndef _WIN32
+    try {
+        for (auto & re : excluderegexes)
+            filter.excluderegexes.emplace_back(re);
+        for (auto & re : includeregexes)
+            filter.includeregexes.emplace_back(re);
+    }
+    catch(const std::exception& e) {
+        print("invalid path regex: %s\n", e.what());
+        return 1;
+    }
+#endif
 
 #ifdef WITH_MEMSEARCH
     if (!f.memoffset)
 #endif
-    if (args.empty())
+#ifdef WITH_PROCMEM
+    if (f.pids.empty())
+#endif
+    if (args.empty() && indexfile.empty())
         args.push_back("-");
-    if (!f.compile_pattern())
-        return 1;
-    if (f.verbose > 1) {
+
+    auto t0 = std::chrono::steady_clock::now();
+    bool autoselect = f.searchtype == AUTO_SEARCH;
+    auto searcher = f.loadcache();
+    if (!searcher) {
+        if (autoselect && !args.empty())
+            f.sampledata(args.front());
+        // the -F file, or the pattern as given, compiling modifies it.
+        auto patternname = !f.patternfile.empty() ? f.patternfile
+                         : !f.pattern.empty() ? "pattern '" + f.pattern + "'"
+                         : "value ranges"s;
+        try {
+            if (!f.compile_pattern())
+                return 1;
+            if (autoselect)
+                f.selectsearchtype();
+            searcher = f.makesearcher();
+        }
+        catch(const std::exception& e) {
+            print("EXCEPTION in %s - %s\n", patternname, e.what());
+            return 1;
+        }
+        f.savecache(*searcher);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    stats.compiletime = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+    stats.engine = searchtypename(f.searchtype);
+    stats.countscandidates = searcher->countscandidates();
+    f.matcheszeros = f.canmatchzeros();
+    if (f.filepatterns)
+        f.idsearcher = searcher.get();
+
+    if (f.verbose > 1 && f.filepatterns) {
+        print("Compiled %d patterns from %s\n", f.filepatterns->size(), f.patternfile);
+    }
+    else if (f.verbose > 1 && !f.valueranges.empty()) {
+        for (auto & r : f.valueranges)
+            print("Compiled value: %s\n", r.name);
+    }
+    else if (f.verbose > 1) {
         print("Compiled regex: %s\n", f.pattern);
         for (auto & bm : f.bytemasks) {
             print("Compiled bytes: %-b\n", bm.first);
             print("Compiled  mask: %-b\n", bm.second);
         }
     }
+    if (f.nthreads == 0)
+        f.nthreads = std::max(1U, std::thread::hardware_concurrency());
+    if (f.readcontinuous)
+        f.nthreads = 1;   // buffered output would never be printed
+    if (f.chunksize == 0)
+        f.chunksize = 0x4000000;
+    if (f.blocksize < 0x1000)
+        f.blocksize = 0x1000;
+    if (f.record.maxsize == 0)
+        f.record.maxsize = 0x10000;
+    // the records are the output
+    if (f.record.type != recordfinder::NONE)
+        f.outputbytes = true;
+
+    matchresults res;
+
 #ifdef WITH_MEMSEARCH
-    if (f.memoffset)
-        catchall(f.searchmemory(), "memory");
+    if (f.memoffset) {
+        catchall(f.searchmemory(*searcher, res), "memory");
+        res.flush();
+    }
 #endif
+#ifdef WITH_PROCMEM
+    for (auto pid : f.pids) {
+        catchall(f.searchprocess(pid, *searcher, res), stringformat("pid %d", pid));
+        res.flush();
+    }
+#endif
+
+    if (f.readcontinuous) {
+        try {
+            followsearch follow(f, *searcher);
+            for (auto const& arg : args) {
+                struct stat st;
+                if (arg != "-" && stat(arg.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+                    follow.adddir(arg, recurse_dirs);
+                else
+                    follow.addfile(arg);
+            }
+            follow.run();
+        }
+        catch(const std::exception& e) {
+            print("EXCEPTION in follow - %s\n", e.what());
+            return 1;
+        }
+        return 0;
+    }
+
+    // a single file is searched by this thread, in chunks on 'nthreads' threads.
+    std::unique_ptr<parallelsearch> pool;
+    if (f.nthreads > 1 && (args.size() > 1 || recurse_dirs || !indexfile.empty()))
+        pool = std::make_unique<parallelsearch>(f, *searcher, f.nthreads, unordered);
+
+    uint64_t mainbusy = 0, maintasks = 0;
+    auto search = [&](const std::string& fn) {
+        if (pool) {
+            pool->add(fn);
+            return;
+        }
+        auto t0 = f.stats ? searchstats::now() : 0;
+        if (fn == "-") {
+            catchall(f.searchstdin(*searcher, res), fn);
+        }
+        else {
+            catchall(f.searchfile(fn, *searcher, res), fn);
+        }
+        {
+        searchstats::timer t(f.stats ? &stats.outputtime : NULL);
+        res.flush();
+        }
+        if (f.stats) {
+            mainbusy += searchstats::now() - t0;
+            maintasks++;
+        }
+    };
+
+    if (!indexfile.empty()) {
+        try {
+            ngramindex index(indexfile);
+            auto candidates = index.candidates(f.requiredliterals());
+            if (f.verbose)
+                print("index: %d of %d files are candidates\n", candidates.size(), index.size());
+            auto c = candidates.begin();
+            for (uint32_t id = 0 ; id < index.size() ; id++) {
+                bool iscandidate = c != candidates.end() && *c == id;
+                if (iscandidate)
+                    ++c;
+                if (iscandidate || index.isstale(id))
+                    search(index.filename(id));
+            }
+        }
+        catch(const std::exception& e) {
+            print("EXCEPTION in %s - %s\n", indexfile, e.what());
+        }
+    }
 
+#ifndef _WIN32
+    std::unique_ptr<dirwalker> walker;      // lists the directories for -r, ahead of the search
+#endif
     for (auto const& arg : args) {
         if (arg == "-")
-            f.searchstdin();
+            search(arg);
         else {
             struct stat st;
             if (-1 == stat(arg.c_str(), &st))
                 continue;
 
             if ((st.st_mode & S_IFMT) == S_IFDIR) {
-                if (recurse_dirs)
-                    for (auto [fn, ent] : fileenumerator(arg))
-                        catchall(f.searchfile(fn), fn);
+                if (!recurse_dirs)
+                    continue;
+#ifdef _WIN32
+                for (auto [fn, ent] : fileenumerator(arg))
+                    search(fn);
+#else
+                if (!walker) {
+                    dirwalker::options opt;
+                    opt.nthreads = f.nthreads;
+                    opt.onefilesystem = onefilesystem;
+                    opt.maxsize = f.maxfilesize;
+                    if (!filter.empty())
+                        opt.filter = std::cref(filter);
+                    if (f.verbose)
+                        opt.error = [](const std::string& path, int err) { print("%s: %s\n", path, strerror(err)); };
+                    walker = std::make_unique<dirwalker>(opt);
+                }
+                walker->walk(arg, search);
+#endif
             }
-            //      [recurse_dirs,&exclude](const std::string& fn)->bool { 
-            //          return exclude.find(fn)==exclude.end() && recurse_dirs;
-            //      }
             else {
-                catchall(f.searchfile(arg), arg);
+                search(arg);
             }
         }
     }
+    if (pool)
+        pool->finish();
+
+    if (f.verbose) {
+        auto t2 = std::chrono::steady_clock::now();
+        print("compile: %.3f ms, search: %.3f ms\n",
+                std::chrono::duration<double, std::milli>(t1 - t0).count(),
+                std::chrono::duration<double, std::milli>(t2 - t1).count());
+    }
+    if (f.stats) {
+        if (maintasks)
+            stats.addthread("main", maintasks, mainbusy);
+#ifndef _WIN32
+        if (walker) {
+            stats.dirs = walker->ndirs.load();
+            stats.excluded = walker->nfiltered.load();
+            stats.duplicates = walker->nduplicates;
+            stats.filesskipped += walker->ntoolarge;
+        }
+#endif
+        fflush(stdout);
+        stats.report(statsformat == "json"s);
+    }
 
     return 0;
 }
-
+#endif
@@ -0,0 +1,227 @@
+#pragma once
+/*
+ * Passes the matches from the search threads to the thread printing them.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * The work is split in numbered tasks, like the chunks of a file. Each worker
+ * takes the next task, and pushes its matches into its own ring, followed by
+ * an end marker. Since a worker takes its tasks in increasing order, the
+ * writer finds the items of the next task to print at the front of one
+ * of the rings, and prints the tasks in order while the workers continue.
+ *
+ * The rings have a single producer and a single consumer, and do not lock.
+ * A worker waits when its ring is full, so the writer limits how far the
+ * search runs ahead of the output.
+ */
+#include <vector>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+
+/*
+ * A fixed size ring, written by one thread, and read by another.
+ * 'capacity' must be a power of two.
+ */
+template<typename T>
+class spscring {
+    std::vector<T> items;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0};   // next item to read, written by the consumer
+    alignas(64) std::atomic<size_t> tail{0};   // next free slot, written by the producer
+public:
+    explicit spscring(size_t capacity)
+        : items(capacity), mask(capacity - 1)
+    {
+    }
+
+    bool trypush(T&& value)
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == items.size())
+            return false;
+        items[t & mask] = std::move(value);
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+    // returns NULL when the ring is empty.
+    T *front()
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return NULL;
+        return &items[h & mask];
+    }
+    void pop()
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        items[h & mask] = T();
+        head.store(h + 1, std::memory_order_release);
+    }
+};
+
+/*
+ * Spins shortly, then sleeps increasingly longer, up to 1 ms.
+ */
+class backoff {
+    int n = 0;
+public:
+    void wait()
+    {
+        if (n < 16)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(std::min(1000, 10 << std::min(n - 16, 7))));
+        n++;
+    }
+    void reset() { n = 0; }
+};
+
+template<typename T>
+class orderedqueue {
+    struct item {
+        size_t task = 0;
+        bool end = false;       // the last item of the task
+        T value;
+    };
+    size_t ntasks;
+    std::vector<std::unique_ptr<spscring<item>>> rings;
+
+    std::atomic<size_t> nexttask{0};
+    std::atomic<size_t> firsthit;           // tasks after this one are not needed
+    std::atomic<bool> stopped{false};
+    std::atomic<int> running{0};
+
+    bool pushitem(int worker, item&& it)
+    {
+        backoff b;
+        while (!rings[worker]->trypush(std::move(it))) {
+            if (stopped)
+                return false;
+            b.wait();
+        }
+        return true;
+    }
+public:
+    static constexpr size_t RINGSIZE = 0x1000;
+
+    orderedqueue(size_t ntasks, int nworkers, size_t ringsize = RINGSIZE)
+        : ntasks(ntasks), firsthit(ntasks)
+    {
+        for (int i = 0 ; i < nworkers ; i++)
+            rings.emplace_back(std::make_unique<spscring<item>>(ringsize));
+    }
+    int workers() const { return rings.size(); }
+
+    /*
+     *  the next task for a worker, returns false when there is nothing left to do.
+     *  each worker must finish a task with 'done' before taking the next.
+     */
+    bool claim(size_t& task)
+    {
+        if (stopped)
+            return false;
+        task = nexttask++;
+        return task < ntasks && task <= firsthit;
+    }
+
+    // false when the results of this task are no longer needed.
+    bool wanted(size_t task) const { return !stopped && task <= firsthit; }
+
+    // for -l and -0: only the tasks up to and including this one are needed.
+    void found(size_t task)
+    {
+        auto hit = firsthit.load();
+        while (task < hit && !firsthit.compare_exchange_weak(hit, task))
+            ;
+    }
+
+    // waits while the ring is full, returns false when the writer stopped.
+    bool push(int worker, size_t task, T&& value)
+    {
+        return pushitem(worker, { task, false, std::move(value) });
+    }
+    bool done(int worker, size_t task)
+    {
+        return pushitem(worker, { task, true, T() });
+    }
+
+    // makes the writer, and all workers stop.
+    void cancel() { stopped = true; }
+
+    /*
+     *  runs 'worker(id)' on each worker thread, and calls 'writer(task, items)'
+     *  on the calling thread for each finished task, in task order.
+     *  'writer' returns false to stop the search.
+     *
+     *  returns false when the search stopped before all tasks were written.
+     */
+    bool run(const std::function<void(int)>& worker, const std::function<bool(size_t, std::vector<T>&)>& writer)
+    {
+        std::vector<std::thread> threads;
+        running = workers();
+        for (int i = 0 ; i < workers() ; i++)
+            threads.emplace_back([this, &worker, i]() {
+                worker(i);
+                running--;
+            });
+
+        bool complete = false;
+        try {
+            complete = write(writer);
+        }
+        catch(...) {
+            cancel();
+            for (auto & t : threads)
+                t.join();
+            throw;
+        }
+        cancel();
+        for (auto & t : threads)
+            t.join();
+        return complete;
+    }
+private:
+    bool write(const std::function<bool(size_t, std::vector<T>&)>& writer)
+    {
+        std::vector<T> current;
+        size_t nextout = 0;
+        backoff b;
+        while (nextout < ntasks && nextout <= firsthit && !stopped) {
+            // check 'running' before the rings, so no items pushed before a worker exits are missed.
+            bool idle = running == 0;
+            bool progress = false;
+            for (auto & r : rings) {
+                item *it;
+                while ((it = r->front()) && it->task == nextout) {
+                    bool end = it->end;
+                    if (!end)
+                        current.push_back(std::move(it->value));
+                    r->pop();
+                    progress = true;
+                    if (end) {
+                        if (!writer(nextout, current))
+                            return false;
+                        current.clear();
+                        nextout++;
+                    }
+                }
+            }
+            if (progress) {
+                b.reset();
+            }
+            else if (idle) {
+                // the remaining tasks were not claimed.
+                break;
+            }
+            else {
+                b.wait();
+            }
+        }
+        return nextout == ntasks;
+    }
+};
@@ -0,0 +1,491 @@
+#pragma once
+/*
+ * A persistent trigram index, used to find which files can contain a pattern,
+ * without reading all files.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * For each file the set of byte 3-grams is recorded, ascii case is folded.
+ * The posting list of each trigram is stored as delta encoded varints.
+ * Files containing too many distinct trigrams, like compressed or encrypted
+ * data, are marked 'unindexed', and are always a candidate.
+ *
+ * While building, the (trigram, file) pairs of a large tree are written to
+ * a temporary file in sorted runs, and merged when writing the index.
+ *
+ * file layout, all numbers are in native byteorder:
+ *
+ *    header
+ *    fileentry[nfiles]
+ *    termentry[nterms]       -- sorted by trigram
+ *    postings                -- varint encoded file-id deltas
+ *    names                   -- the filenames
+ */
+#include <cpputils/formatter.h>
+#include <cpputils/fhandle.h>
+#include <cpputils/mmem.h>
+#include <cpputils/fslibrary.h>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <queue>
+#include <stdexcept>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+class ngramindex {
+public:
+    enum { FLAG_UNINDEXED = 1 };
+
+    struct header {
+        char magic[8];
+        uint64_t nfiles;
+        uint64_t nterms;
+        uint64_t filesofs;
+        uint64_t termsofs;
+        uint64_t postingsofs;
+        uint64_t namesofs;
+        uint64_t totalsize;
+    };
+    struct fileentry {
+        uint64_t nameofs;       // relative to namesofs
+        uint64_t size;
+        int64_t mtime;
+        uint32_t namelen;
+        uint32_t flags;
+    };
+    struct termentry {
+        uint32_t trigram;
+        uint32_t count;         // nr of files
+        uint64_t postofs;       // relative to postingsofs
+    };
+
+    static constexpr const char *MAGIC = "FSIDX001";
+
+    // files with more distinct trigrams than this are not indexed.
+    static constexpr size_t MAXTRIGRAMS = 0x100000;
+
+    // the nr of (trigram, file) pairs kept in memory while building, 128 MB.
+    static constexpr size_t MAXPAIRS = 0x1000000;
+
+    static uint32_t trigram(const uint8_t *p)
+    {
+        return (tolower(p[0]) << 16) | (tolower(p[1]) << 8) | tolower(p[2]);
+    }
+private:
+    std::unique_ptr<filehandle> fh;
+    std::unique_ptr<mappedmem> mem;
+    const header *hdr = nullptr;
+    const fileentry *files = nullptr;
+    const termentry *terms = nullptr;
+    const uint8_t *postings = nullptr;
+    const uint8_t *postingsend = nullptr;
+    const char *names = nullptr;
+
+    static void putvarint(std::vector<uint8_t>& v, uint64_t value)
+    {
+        while (value >= 0x80) {
+            v.push_back(0x80 | (value & 0x7F));
+            value >>= 7;
+        }
+        v.push_back(value);
+    }
+    static uint64_t getvarint(const uint8_t *& p, const uint8_t *end)
+    {
+        uint64_t value = 0;
+        int shift = 0;
+        while (p < end && (*p & 0x80) && shift < 63) {
+            value |= uint64_t(*p++ & 0x7F) << shift;
+            shift += 7;
+        }
+        if (p >= end || (*p & 0x80))
+            throw std::runtime_error("invalid index");
+        value |= uint64_t(*p++) << shift;
+        return value;
+    }
+
+    static void writeall(int f, const void *data, size_t size)
+    {
+        auto p = (const char*)data;
+        while (size) {
+            auto n = ::write(f, p, size);
+            if (n <= 0)
+                throw std::runtime_error("write error");
+            p += n;
+            size -= n;
+        }
+    }
+
+    static void readall(int f, uint64_t ofs, void *data, size_t size)
+    {
+        auto p = (char*)data;
+        while (size) {
+            auto n = ::pread(f, p, size, ofs);
+            if (n <= 0)
+                throw std::runtime_error("read error");
+            p += n;
+            ofs += n;
+            size -= n;
+        }
+    }
+
+    /*
+     *  the (trigram << 32 | fileid) pairs of all files, in sorted runs of at
+     *  most MAXPAIRS, which are written to a temporary file.
+     */
+    class pairruns {
+        std::string filename;
+        std::unique_ptr<filehandle> fh;
+        uint64_t filesize = 0;
+        std::vector<std::pair<uint64_t, uint64_t>> runs;    // offset and nr of pairs
+        std::vector<uint64_t> pairs;
+
+        void spill()
+        {
+            std::sort(pairs.begin(), pairs.end());
+            if (!fh)
+                fh = std::make_unique<filehandle>(open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600));
+            writeall(*fh, pairs.data(), pairs.size() * sizeof(uint64_t));
+            runs.emplace_back(filesize, pairs.size());
+            filesize += pairs.size() * sizeof(uint64_t);
+            pairs.clear();
+        }
+    public:
+        pairruns(const std::string& filename) : filename(filename) { }
+        ~pairruns()
+        {
+            if (fh)
+                unlink(filename.c_str());
+        }
+
+        void add(uint64_t pair)
+        {
+            pairs.push_back(pair);
+            if (pairs.size() >= MAXPAIRS)
+                spill();
+        }
+
+        // calls 'fn' for all pairs, in sorted order.
+        template<typename FN>
+        void merge(FN fn)
+        {
+            if (runs.empty()) {
+                std::sort(pairs.begin(), pairs.end());
+                for (auto pair : pairs)
+                    fn(pair);
+                return;
+            }
+            if (!pairs.empty())
+                spill();
+            std::vector<uint64_t>().swap(pairs);
+
+            struct cursor {
+                uint64_t ofs;
+                uint64_t left;      // pairs not yet read
+                std::vector<uint64_t> buf;
+                size_t pos = 0;
+            };
+            std::vector<cursor> cursors;
+            for (auto [ofs, n] : runs)
+                cursors.push_back({ ofs, n, {} });
+            auto fill = [this](cursor& c) {
+                c.buf.resize(std::min<uint64_t>(c.left, 0x2000));
+                readall(*fh, c.ofs, c.buf.data(), c.buf.size() * sizeof(uint64_t));
+                c.ofs += c.buf.size() * sizeof(uint64_t);
+                c.left -= c.buf.size();
+                c.pos = 0;
+            };
+
+            // the next pair of each run, smallest first.
+            typedef std::pair<uint64_t, size_t> head;
+            std::priority_queue<head, std::vector<head>, std::greater<head>> heads;
+            for (size_t i = 0 ; i < cursors.size() ; i++) {
+                fill(cursors[i]);
+                heads.emplace(cursors[i].buf[0], i);
+            }
+            while (!heads.empty()) {
+                auto [pair, i] = heads.top();
+                heads.pop();
+                fn(pair);
+                auto & c = cursors[i];
+                if (++c.pos == c.buf.size()) {
+                    if (c.left == 0)
+                        continue;
+                    fill(c);
+                }
+                heads.emplace(c.buf[c.pos], i);
+            }
+        }
+    };
+
+    /*
+     *  collects the distinct trigrams of a single file.
+     */
+    struct trigramset {
+        std::vector<uint64_t> bitmap;
+        std::vector<uint32_t> found;
+
+        trigramset() : bitmap(0x1000000 / 64) { }
+
+        // returns false when there are too many trigrams.
+        bool add(const uint8_t *p, const uint8_t *last)
+        {
+            for ( ; last - p >= 3 ; p++) {
+                auto t = trigram(p);
+                auto & word = bitmap[t / 64];
+                auto bit = uint64_t(1) << (t % 64);
+                if (word & bit)
+                    continue;
+                word |= bit;
+                found.push_back(t);
+                if (found.size() > MAXTRIGRAMS)
+                    return false;
+            }
+            return true;
+        }
+        void clear()
+        {
+            for (auto t : found)
+                bitmap[t / 64] = 0;
+            found.clear();
+        }
+    };
+
+public:
+    /*
+     *  index all files below 'dir', and save the index in 'indexfile'.
+     */
+    static void build(const std::string& dir, const std::string& indexfile, int verbose)
+    {
+        std::vector<fileentry> filelist;
+        std::string namepool;
+        trigramset tset;
+        std::vector<uint64_t> allterms(0x1000000 / 64);     // bitmap of the trigrams found in any file
+        auto tmpname = indexfile + ".tmp";
+        auto runsname = indexfile + ".runs.tmp";
+        pairruns pairs(runsname);
+
+        for (auto [fn, ent] : fileenumerator(dir)) {
+            if (fn == indexfile || fn == tmpname || fn == runsname)
+                continue;
+            try {
+                filehandle f = open(fn.c_str(), O_RDONLY);
+                struct stat st;
+                if (fstat(f, &st) || !S_ISREG(st.st_mode))
+                    continue;
+
+                fileentry e = { namepool.size(), uint64_t(st.st_size), int64_t(st.st_mtime), uint32_t(fn.size()), 0 };
+                namepool += fn;
+
+                bool ok = true;
+                if (st.st_size) {
+                    mappedmem r(f, 0, st.st_size, PROT_READ);
+                    ok = tset.add(r.begin(), r.end());
+                }
+                if (ok) {
+                    for (auto t : tset.found) {
+                        pairs.add((uint64_t(t) << 32) | filelist.size());
+                        allterms[t / 64] |= uint64_t(1) << (t % 64);
+                    }
+                }
+                else {
+                    e.flags |= FLAG_UNINDEXED;
+                    if (verbose)
+                        print("not indexing %s: too many trigrams\n", fn);
+                }
+                tset.clear();
+                filelist.push_back(e);
+            }
+            catch(const std::exception& e) {
+                print("EXCEPTION in %s - %s\n", fn, e.what());
+            }
+        }
+
+        uint64_t nterms = 0;
+        for (auto word : allterms)
+            nterms += __builtin_popcountll(word);
+
+        header hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, MAGIC, 8);
+        hdr.nfiles = filelist.size();
+        hdr.nterms = nterms;
+        hdr.filesofs = sizeof(header);
+        hdr.termsofs = hdr.filesofs + filelist.size() * sizeof(fileentry);
+        hdr.postingsofs = hdr.termsofs + nterms * sizeof(termentry);
+
+        // write to a temporary file, so a concurrent query never sees a partial index.
+        // the postings are written while merging, the terms and the header when they are complete.
+        std::vector<termentry> termlist;
+        uint64_t postingsize = 0;
+        {
+        filehandle f = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (lseek(f, hdr.postingsofs, SEEK_SET) == -1)
+            throw std::runtime_error("seek error");
+
+        std::vector<uint8_t> postingdata;
+        uint32_t prev = 0;
+        pairs.merge([&](uint64_t pair) {
+            uint32_t t = pair >> 32;
+            uint32_t id = pair;
+            if (termlist.empty() || termlist.back().trigram != t) {
+                termlist.push_back({ t, 0, postingsize + postingdata.size() });
+                prev = 0;
+            }
+            putvarint(postingdata, id - prev);
+            prev = id;
+            termlist.back().count++;
+            if (postingdata.size() >= 0x100000) {
+                writeall(f, postingdata.data(), postingdata.size());
+                postingsize += postingdata.size();
+                postingdata.clear();
+            }
+        });
+        writeall(f, postingdata.data(), postingdata.size());
+        postingsize += postingdata.size();
+        writeall(f, namepool.data(), namepool.size());
+
+        hdr.namesofs = hdr.postingsofs + postingsize;
+        hdr.totalsize = hdr.namesofs + namepool.size();
+        if (lseek(f, 0, SEEK_SET) == -1)
+            throw std::runtime_error("seek error");
+        writeall(f, &hdr, sizeof(hdr));
+        writeall(f, filelist.data(), filelist.size() * sizeof(fileentry));
+        writeall(f, termlist.data(), termlist.size() * sizeof(termentry));
+        }
+        if (rename(tmpname.c_str(), indexfile.c_str()))
+            throw std::runtime_error("rename failed");
+
+        if (verbose)
+            print("indexed %d files, %d trigrams, %d bytes of postings\n", filelist.size(), termlist.size(), postingsize);
+    }
+
+    /*
+     *  open an existing index.
+     */
+    ngramindex(const std::string& indexfile)
+    {
+        fh = std::make_unique<filehandle>(open(indexfile.c_str(), O_RDONLY));
+        auto size = fh->size();
+        if (size < (int64_t)sizeof(header))
+            throw std::runtime_error("index too small");
+        mem = std::make_unique<mappedmem>(*fh, 0, size, PROT_READ);
+
+        auto base = (const uint8_t*)mem->begin();
+        hdr = (const header*)base;
+        if (memcmp(hdr->magic, MAGIC, 8) || hdr->totalsize != (uint64_t)size)
+            throw std::runtime_error("invalid index");
+
+        // the sections must be in order, and within the file.
+        auto fits = [](uint64_t ofs, uint64_t count, size_t itemsize, uint64_t end) {
+            return ofs <= end && count <= (end - ofs) / itemsize && ofs % 8 == 0;
+        };
+        if (hdr->filesofs < sizeof(header) || hdr->termsofs < hdr->filesofs || hdr->postingsofs < hdr->termsofs
+                || hdr->namesofs < hdr->postingsofs || hdr->namesofs > hdr->totalsize
+                || !fits(hdr->filesofs, hdr->nfiles, sizeof(fileentry), hdr->termsofs)
+                || !fits(hdr->termsofs, hdr->nterms, sizeof(termentry), hdr->postingsofs)
+                || hdr->nfiles > UINT32_MAX)
+            throw std::runtime_error("invalid index");
+        uint64_t postingsize = hdr->namesofs - hdr->postingsofs;
+        uint64_t namessize = hdr->totalsize - hdr->namesofs;
+
+        files = (const fileentry*)(base + hdr->filesofs);
+        terms = (const termentry*)(base + hdr->termsofs);
+        postings = base + hdr->postingsofs;
+        names = (const char*)base + hdr->namesofs;
+        postingsend = postings + postingsize;
+
+        for (uint64_t i = 0 ; i < hdr->nfiles ; i++)
+            if (files[i].nameofs > namessize || files[i].namelen > namessize - files[i].nameofs)
+                throw std::runtime_error("invalid index");
+        for (uint64_t i = 0 ; i < hdr->nterms ; i++)
+            if (terms[i].postofs > postingsize)
+                throw std::runtime_error("invalid index");
+    }
+
+    size_t size() const { return hdr->nfiles; }
+
+    std::string filename(size_t id) const
+    {
+        return std::string(names + files[id].nameofs, files[id].namelen);
+    }
+
+    // a file which changed since it was indexed must always be searched.
+    bool isstale(size_t id) const
+    {
+        struct stat st;
+        if (stat(filename(id).c_str(), &st))
+            return false;   // removed
+        return uint64_t(st.st_size) != files[id].size || int64_t(st.st_mtime) != files[id].mtime;
+    }
+
+    /*
+     *  returns the ids of the files which may contain one of the literals.
+     *  A literal shorter than 3 bytes can be anywhere, then all files are returned.
+     */
+    std::vector<uint32_t> candidates(const std::vector<std::string>& literals) const
+    {
+        std::vector<uint32_t> all(hdr->nfiles);
+        for (size_t i = 0 ; i < all.size() ; i++)
+            all[i] = i;
+        if (literals.empty())
+            return all;
+
+        std::vector<uint32_t> result;
+        for (auto & lit : literals) {
+            if (lit.size() < 3)
+                return all;
+
+            // intersect the posting lists of all trigrams in the literal
+            std::vector<uint32_t> ids;
+            bool first = true;
+            for (size_t i = 0 ; i + 3 <= lit.size() ; i++) {
+                auto posting = lookup(trigram((const uint8_t*)&lit[i]));
+                if (first) {
+                    ids = std::move(posting);
+                    first = false;
+                }
+                else {
+                    std::vector<uint32_t> both;
+                    std::set_intersection(ids.begin(), ids.end(), posting.begin(), posting.end(), std::back_inserter(both));
+                    ids = std::move(both);
+                }
+                if (ids.empty())
+                    break;
+            }
+            std::vector<uint32_t> merged;
+            std::set_union(result.begin(), result.end(), ids.begin(), ids.end(), std::back_inserter(merged));
+            result = std::move(merged);
+        }
+
+        // unindexed files are always candidates
+        std::vector<uint32_t> unindexed;
+        for (uint32_t i = 0 ; i < hdr->nfiles ; i++)
+            if (files[i].flags & FLAG_UNINDEXED)
+                unindexed.push_back(i);
+        std::vector<uint32_t> merged;
+        std::set_union(result.begin(), result.end(), unindexed.begin(), unindexed.end(), std::back_inserter(merged));
+        return merged;
+    }
+
+    std::vector<uint32_t> lookup(uint32_t t) const
+    {
+        auto last = terms + hdr->nterms;
+        auto i = std::lower_bound(terms, last, t, [](const termentry& e, uint32_t t) { return e.trigram < t; });
+        if (i == last || i->trigram != t)
+            return {};
+
+        std::vector<uint32_t> ids;
+        auto p = postings + i->postofs;
+        uint32_t id = 0;
+        for (uint32_t n = 0 ; n < i->count ; n++) {
+            id += getvarint(p, postingsend);
+            if (id >= hdr->nfiles)
+                throw std::runtime_error("invalid index");
+            ids.push_back(id);
+        }
+        return ids;
+    }
+};
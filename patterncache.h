@@ -0,0 +1,227 @@
+#pragma once
+/*
+ * Compiled patterns saved on disk, so a large pattern set is only compiled once.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * A cache file contains the arrays of a compiled searcher. They are used
+ * directly from the mapped file, without parsing or copying. The file is named
+ * after a hash of the patterns and of the options used to compile them.
+ *
+ * file layout, all numbers are in native byteorder:
+ *
+ *    header
+ *    section[nsections]      -- offset and size of each array
+ *    arrays                  -- each aligned to 64 bytes
+ */
+#include <cpputils/formatter.h>
+#include <cpputils/fhandle.h>
+#include <cpputils/mmem.h>
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <stdexcept>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * An array which is either built in memory, or points into a mapped cache file.
+ * While building it is modified like a std::vector, the const accessors
+ * are used for searching.
+ */
+template<typename T>
+class cachedarray {
+    std::vector<T> owned;
+    const T *first = nullptr;
+    size_t count = 0;
+
+    void update()
+    {
+        first = owned.data();
+        count = owned.size();
+    }
+public:
+    cachedarray() { }
+    cachedarray(std::initializer_list<T> init) : owned(init) { update(); }
+    cachedarray(const cachedarray&) = delete;
+    cachedarray& operator=(const cachedarray&) = delete;
+
+    void push_back(const T& value) { owned.push_back(value); update(); }
+    template<typename IT>
+    void append(IT a, IT b) { owned.insert(owned.end(), a, b); update(); }
+    void assign(size_t n, const T& value) { owned.assign(n, value); update(); }
+    void clear() { owned.clear(); update(); }
+    void shrink_to_fit() { owned.shrink_to_fit(); update(); }
+    cachedarray& operator=(std::vector<T>&& v) { owned = std::move(v); update(); return *this; }
+    T& operator[](size_t i) { return owned[i]; }
+
+    void map(const T *p, size_t n)
+    {
+        owned = std::vector<T>();
+        first = p;
+        count = n;
+    }
+
+    const T& operator[](size_t i) const { return first[i]; }
+    const T *data() const { return first; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T *begin() const { return first; }
+    const T *end() const { return first + count; }
+};
+
+class patterncache {
+public:
+    struct header {
+        char magic[8];
+        uint64_t key;
+        uint64_t nsections;
+        uint64_t totalsize;
+    };
+    struct section {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    // change this when the layout of a compiled searcher changes.
+    static constexpr const char *MAGIC = "FSPAT001";
+    static constexpr size_t ALIGN = 64;
+
+    // a hash of 8 bytes at a time, 'h' can be the hash of the previous data.
+    static uint64_t hash(const void *data, size_t size, uint64_t h = 0xcbf29ce484222325ULL)
+    {
+        auto p = (const uint8_t*)data;
+        auto mix = [&h](uint64_t w) {
+            h = (h ^ w) * 0x9E3779B97F4A7C15ULL;
+            h ^= h >> 29;
+        };
+        for ( ; size >= 8 ; p += 8, size -= 8) {
+            uint64_t w;
+            memcpy(&w, p, 8);
+            mix(w);
+        }
+        uint64_t w = size;
+        memcpy(&w, p, size);
+        mix(w ^ (uint64_t(size) << 56));
+        return h;
+    }
+
+    /*
+     *  collects the arrays of a searcher, and saves them.
+     *  the arrays must stay valid until 'save' is called.
+     */
+    class writer {
+        std::vector<std::pair<const void*, size_t>> items;
+
+        static void writeall(int f, const void *data, size_t size)
+        {
+            auto p = (const char*)data;
+            while (size) {
+                auto n = ::write(f, p, size);
+                if (n <= 0)
+                    throw std::runtime_error("write error");
+                p += n;
+                size -= n;
+            }
+        }
+    public:
+        template<typename T>
+        void addarray(const cachedarray<T>& a) { items.emplace_back(a.data(), a.size() * sizeof(T)); }
+        template<typename T>
+        void addvalue(const T& value) { items.emplace_back(&value, sizeof(T)); }
+
+        void save(const std::string& filename, uint64_t key) const
+        {
+            // zeroed, so no uninitialized padding is written to the file.
+            header hdr;
+            memset(&hdr, 0, sizeof(hdr));
+            memcpy(hdr.magic, MAGIC, 8);
+            hdr.key = key;
+            hdr.nsections = items.size();
+
+            std::vector<section> sections;
+            uint64_t ofs = sizeof(header) + items.size() * sizeof(section);
+            for (auto & [p, size] : items) {
+                ofs = (ofs + ALIGN - 1) & ~uint64_t(ALIGN - 1);
+                sections.push_back({ ofs, size });
+                ofs += size;
+            }
+            hdr.totalsize = ofs;
+
+            // write to a temporary file, so a concurrent run never maps a partial cache.
+            auto tmpname = stringformat("%s.%d.tmp", filename, getpid());
+            {
+            filehandle f = open(tmpname.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            writeall(f, &hdr, sizeof(hdr));
+            writeall(f, sections.data(), sections.size() * sizeof(section));
+            ofs = sizeof(header) + items.size() * sizeof(section);
+            static const char zeros[ALIGN] = {};
+            for (size_t i = 0 ; i < items.size() ; i++) {
+                writeall(f, zeros, sections[i].offset - ofs);
+                writeall(f, items[i].first, items[i].second);
+                ofs = sections[i].offset + sections[i].size;
+            }
+            }
+            if (rename(tmpname.c_str(), filename.c_str())) {
+                unlink(tmpname.c_str());
+                throw std::runtime_error("rename failed");
+            }
+        }
+    };
+
+private:
+    std::unique_ptr<filehandle> fh;
+    std::unique_ptr<mappedmem> mem;
+    const header *hdr = nullptr;
+    const section *sections = nullptr;
+    size_t nextsection = 0;
+
+    std::pair<const uint8_t*, size_t> next()
+    {
+        if (nextsection >= hdr->nsections)
+            throw std::runtime_error("invalid pattern cache");
+        auto & s = sections[nextsection++];
+        return { (const uint8_t*)mem->begin() + s.offset, s.size };
+    }
+public:
+    /*
+     *  map an existing cache file, throws when it is missing, or was made for another key.
+     */
+    patterncache(const std::string& filename, uint64_t key)
+    {
+        fh = std::make_unique<filehandle>(open(filename.c_str(), O_RDONLY));
+        auto size = fh->size();
+        if (size < (int64_t)sizeof(header))
+            throw std::runtime_error("invalid pattern cache");
+        mem = std::make_unique<mappedmem>(*fh, 0, size, PROT_READ);
+
+        hdr = (const header*)mem->begin();
+        if (memcmp(hdr->magic, MAGIC, 8) || hdr->key != key || hdr->totalsize != (uint64_t)size
+                || hdr->nsections > (size - sizeof(header)) / sizeof(section))
+            throw std::runtime_error("invalid pattern cache");
+        sections = (const section*)(hdr + 1);
+        for (size_t i = 0 ; i < hdr->nsections ; i++)
+            if (sections[i].offset % ALIGN || sections[i].offset > hdr->totalsize || sections[i].size > hdr->totalsize - sections[i].offset)
+                throw std::runtime_error("invalid pattern cache");
+    }
+
+    // the arrays and values are loaded in the order in which they were added to the writer.
+    template<typename T>
+    void loadarray(cachedarray<T>& a)
+    {
+        auto [p, size] = next();
+        if (size % sizeof(T))
+            throw std::runtime_error("invalid pattern cache");
+        a.map((const T*)p, size / sizeof(T));
+    }
+    template<typename T>
+    void loadvalue(T& value)
+    {
+        auto [p, size] = next();
+        if (size != sizeof(T))
+            throw std::runtime_error("invalid pattern cache");
+        memcpy(&value, p, sizeof(T));
+    }
+};
@@ -0,0 +1,165 @@
+#pragma once
+/*
+ * Reads the memory of another process on linux.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * The memory layout is taken from /proc/<pid>/maps, the memory is read
+ * using process_vm_readv, which copies directly from the target's address
+ * space without stopping it. When process_vm_readv is not available,
+ * /proc/<pid>/mem is used.
+ *
+ * Both need ptrace access to the target, see /proc/sys/kernel/yama/ptrace_scope.
+ */
+#include <vector>
+#include <string>
+#include <stdexcept>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <climits>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+struct memregion {
+    uint64_t start;
+    uint64_t end;
+    std::string perms;      // like "r-xp"
+    uint64_t offset;        // offset in the mapped file
+    std::string name;       // the mapped file, or [heap], [stack], etc. empty for anonymous memory
+
+    bool hasperms(const std::string& required) const
+    {
+        for (auto c : required)
+            if (c != '-' && perms.find(c) == perms.npos)
+                return false;
+        return true;
+    }
+};
+
+class procmemory {
+    int pid;
+    int memfd = -1;         // /proc/<pid>/mem, opened when process_vm_readv fails with ENOSYS
+public:
+    struct readrequest {
+        uint64_t addr;      // address in the target
+        char *buf;
+        size_t size;
+        size_t got;         // set by readbatch: the nr of bytes read
+    };
+
+    procmemory(int pid)
+        : pid(pid)
+    {
+    }
+    ~procmemory()
+    {
+        if (memfd >= 0)
+            close(memfd);
+    }
+    procmemory(const procmemory&) = delete;
+    procmemory& operator=(const procmemory&) = delete;
+
+    std::vector<memregion> regions() const
+    {
+        auto fn = "/proc/" + std::to_string(pid) + "/maps";
+        FILE *f = fopen(fn.c_str(), "r");
+        if (!f)
+            throw std::runtime_error("can not open " + fn);
+
+        std::vector<memregion> list;
+        char line[PATH_MAX + 256];
+        while (fgets(line, sizeof(line), f)) {
+            unsigned long long start, end, offset;
+            char perms[8];
+            int namepos = 0;
+            if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perms, &offset, &namepos) < 4)
+                continue;
+            std::string name = namepos ? line + namepos : "";
+            while (!name.empty() && (name.back() == '\n' || name.back() == ' '))
+                name.pop_back();
+            list.push_back(memregion{ start, end, perms, offset, name });
+        }
+        fclose(f);
+        return list;
+    }
+
+    /*
+     *  reads several ranges, with as few system calls as possible.
+     *  For each request 'got' is set to the nr of bytes which could be
+     *  read from its start, the part after the first unreadable page is skipped.
+     */
+    void readbatch(std::vector<readrequest>& reqs)
+    {
+        size_t i = 0;
+        while (i < reqs.size()) {
+            size_t n = std::min<size_t>(reqs.size() - i, IOV_MAX);
+            std::vector<iovec> local(n), remote(n);
+            for (size_t j = 0 ; j < n ; j++) {
+                local[j] = { reqs[i + j].buf, reqs[i + j].size };
+                remote[j] = { (void*)reqs[i + j].addr, reqs[i + j].size };
+                reqs[i + j].got = 0;
+            }
+            ssize_t r = memfd < 0 ? process_vm_readv(pid, local.data(), n, remote.data(), n, 0) : -1;
+            if (r < 0) {
+                if (errno == ENOSYS || memfd >= 0) {
+                    readfallback(reqs[i]);
+                    i++;
+                    continue;
+                }
+                if (errno == EPERM || errno == ESRCH)
+                    throw std::runtime_error("process_vm_readv: " + std::string(strerror(errno)));
+                // the first range is not readable.
+                readpages(reqs[i]);
+                i++;
+                continue;
+            }
+
+            // the transfer stops at the first range which can not be read completely.
+            size_t total = r;
+            while (n && total >= reqs[i].size) {
+                reqs[i].got = reqs[i].size;
+                total -= reqs[i].size;
+                i++;
+                n--;
+            }
+            if (n) {
+                reqs[i].got = total;
+                readpages(reqs[i]);
+                i++;
+            }
+        }
+    }
+private:
+    // continue a failed read page by page, up to the first unreadable page.
+    void readpages(readrequest& req)
+    {
+        static const size_t pagesize = sysconf(_SC_PAGESIZE);
+        while (req.got < req.size) {
+            auto want = std::min(req.size - req.got, pagesize - (req.addr + req.got) % pagesize);
+            iovec local = { req.buf + req.got, want };
+            iovec remote = { (void*)(req.addr + req.got), want };
+            auto r = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+            if (r <= 0)
+                break;
+            req.got += r;
+        }
+    }
+    void readfallback(readrequest& req)
+    {
+        if (memfd < 0) {
+            auto fn = "/proc/" + std::to_string(pid) + "/mem";
+            memfd = open(fn.c_str(), O_RDONLY);
+            if (memfd < 0)
+                throw std::runtime_error("can not open " + fn);
+        }
+        while (req.got < req.size) {
+            auto r = pread(memfd, req.buf + req.got, req.size - req.got, req.addr + req.got);
+            if (r <= 0)
+                break;
+            req.got += r;
+        }
+    }
+};
@@ -0,0 +1,400 @@
+#pragma once
+/*
+ * Reads a file in blocks, ahead of the searcher.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * The blocks are read into a ring of buffers, while the previous block is
+ * being searched.  On linux regular files are read using io_uring, other files,
+ * like pipes, or when io_uring is not available, are read by a separate thread.
+ *
+ * Each buffer has 'reserve' bytes of room in front of the data, where the
+ * caller can place the unsearched tail of the previous block.
+ *
+ * With 'minhole', holes of a sparse file of at least that size are not read,
+ * a block starting in a hole starts at the next data instead. The caller sees
+ * this from the block offsets.
+ */
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+
+class blockreader {
+public:
+    struct block {
+        char *data;         // the data read, preceded by 'reserve' bytes
+        size_t size;        // 0 = end of file
+        int state;
+        uint64_t offset;    // file offset, relative to the start position for files which can not seek
+    };
+private:
+    enum { FREE, READING, FILLED, INUSE };
+
+    int fd;
+    size_t blocksize;
+    size_t reserve;
+
+    // the buffers are shared with the reader thread, which may outlive this object.
+    struct shared {
+        std::vector<char> memory;
+        std::vector<block> blocks;
+
+        std::mutex mtx;
+        std::condition_variable cv;
+        std::atomic<bool> stop{false};
+    };
+    std::shared_ptr<shared> sync;
+    std::vector<block>& blocks;
+    size_t nextblock = 0;      // the next block to be returned by 'next'
+
+    std::thread reader;
+    bool detachreader = false;
+    uint64_t minhole = 0;      // skip holes of at least this size, 0 = read the holes
+
+#ifdef __linux__
+    // io_uring based reader
+    struct uring {
+        int fd = -1;
+        io_uring_params params;
+        void *sqring = MAP_FAILED;
+        void *cqring = MAP_FAILED;
+        size_t sqringsize = 0;
+        size_t cqringsize = 0;
+        io_uring_sqe *sqes = (io_uring_sqe*)MAP_FAILED;
+        unsigned *sqtail, *sqmask, *sqarray;
+        unsigned *cqhead, *cqtail, *cqmask;
+        io_uring_cqe *cqes;
+
+        bool setup(unsigned entries)
+        {
+            memset(&params, 0, sizeof(params));
+            fd = syscall(__NR_io_uring_setup, entries, &params);
+            if (fd < 0)
+                return false;
+            sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqringsize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+                sqringsize = cqringsize = std::max(sqringsize, cqringsize);
+
+            sqring = mmap(0, sqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+            if (sqring == MAP_FAILED)
+                return false;
+            if (params.features & IORING_FEAT_SINGLE_MMAP)
+                cqring = sqring;
+            else
+                cqring = mmap(0, cqringsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+            if (cqring == MAP_FAILED)
+                return false;
+            sqes = (io_uring_sqe*)mmap(0, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED)
+                return false;
+
+            auto sq = (char*)sqring;
+            sqtail = (unsigned*)(sq + params.sq_off.tail);
+            sqmask = (unsigned*)(sq + params.sq_off.ring_mask);
+            sqarray = (unsigned*)(sq + params.sq_off.array);
+            auto cq = (char*)cqring;
+            cqhead = (unsigned*)(cq + params.cq_off.head);
+            cqtail = (unsigned*)(cq + params.cq_off.tail);
+            cqmask = (unsigned*)(cq + params.cq_off.ring_mask);
+            cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+            return true;
+        }
+        ~uring()
+        {
+            if (sqes != MAP_FAILED)
+                munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+            if (cqring != MAP_FAILED && cqring != sqring)
+                munmap(cqring, cqringsize);
+            if (sqring != MAP_FAILED)
+                munmap(sqring, sqringsize);
+            if (fd >= 0)
+                close(fd);
+        }
+        bool submitread(int f, char *buf, unsigned len, uint64_t ofs, uint64_t userdata)
+        {
+            unsigned tail = *sqtail;
+            unsigned idx = tail & *sqmask;
+            auto sqe = &sqes[idx];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = f;
+            sqe->addr = (uintptr_t)buf;
+            sqe->len = len;
+            sqe->off = ofs;
+            sqe->user_data = userdata;
+            sqarray[idx] = idx;
+            __atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+
+            return syscall(__NR_io_uring_enter, fd, 1, 0, 0, NULL, 0) == 1;
+        }
+        bool waitcompletion(uint64_t& userdata, int& result)
+        {
+            while (true) {
+                unsigned head = *cqhead;
+                if (head != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE)) {
+                    auto cqe = &cqes[head & *cqmask];
+                    userdata = cqe->user_data;
+                    result = cqe->res;
+                    __atomic_store_n(cqhead, head + 1, __ATOMIC_RELEASE);
+                    return true;
+                }
+                if (syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR)
+                    return false;
+            }
+        }
+    };
+    std::unique_ptr<uring> ring;
+    uint64_t readoffset = 0;    // offset of the next read to submit
+    uint64_t filesize = 0;
+    int inflight = 0;
+#endif
+
+    char *buffer(size_t i)
+    {
+        return &sync->memory[i * (reserve + blocksize) + reserve];
+    }
+
+    static bool isregular(int f, uint64_t& size, bool& sparse)
+    {
+        struct stat st;
+        if (fstat(f, &st))
+            return false;
+        size = st.st_size;
+#ifndef _WIN32
+        sparse = uint64_t(st.st_blocks) * 512 < size;
+#endif
+        return (st.st_mode & S_IFMT) == S_IFREG;
+    }
+
+    /*
+     *  the offset of the data at or after 'ofs', or 'size' when the file ends
+     *  in a hole, or 'ofs' when the hole is smaller than 'minsize'.
+     */
+    static uint64_t nextdata(int fd, uint64_t ofs, uint64_t size, uint64_t minsize)
+    {
+#ifdef SEEK_DATA
+        auto data = lseek(fd, ofs, SEEK_DATA);
+        uint64_t next = data >= 0 ? uint64_t(data) : errno == ENXIO ? size : ofs;
+        if (next - ofs >= minsize)
+            return next;
+#endif
+        return ofs;
+    }
+
+public:
+    blockreader(int fd, size_t blocksize, size_t nbuffers, size_t reserve, uint64_t minhole = 0)
+        : fd(fd), blocksize(blocksize), reserve(reserve),
+          sync(std::make_shared<shared>()), blocks(sync->blocks)
+    {
+        if (nbuffers < 2)
+            nbuffers = 2;
+        sync->memory.resize(nbuffers * (reserve + blocksize));
+        for (size_t i = 0 ; i < nbuffers ; i++)
+            blocks.push_back(block{ buffer(i), 0, FREE, 0 });
+
+        uint64_t size = 0;
+        bool sparse = false;
+        bool regular = isregular(fd, size, sparse);
+        if (regular && sparse)
+            this->minhole = minhole;
+#ifdef __linux__
+        if (regular) {
+            ring = std::make_unique<uring>();
+            if (ring->setup(nbuffers)) {
+                filesize = size;
+                readoffset = lseek(fd, 0, SEEK_CUR);
+                for (size_t i = 0 ; i < blocks.size() ; i++)
+                    submit(i);
+                return;
+            }
+            ring.reset();
+        }
+#endif
+        // a thread blocked in read on a pipe can not be stopped, it is detached
+        // when the reader is destroyed. It reads from its own copy of the fd,
+        // since the caller closes 'fd', and the fd number may then be reused.
+        int readfd = regular ? -1 : dup(fd);
+        detachreader = readfd != -1;
+        reader = std::thread(readerthread, sync, detachreader ? readfd : fd, detachreader, blocksize, this->minhole, size);
+    }
+    ~blockreader()
+    {
+#ifdef __linux__
+        if (ring) {
+            // wait for the outstanding reads, the kernel is still writing to our buffers.
+            uint64_t id;
+            int result;
+            while (inflight > 0 && ring->waitcompletion(id, result))
+                inflight--;
+            return;
+        }
+#endif
+        {
+        std::lock_guard<std::mutex> lock(sync->mtx);
+        sync->stop = true;
+        }
+        sync->cv.notify_all();
+        if (detachreader) {
+            reader.detach();
+        }
+        else {
+            reader.join();
+        }
+    }
+
+    /*
+     *  returns the next block, or NULL at the end of the file.
+     */
+    block *next()
+    {
+        auto & b = blocks[nextblock];
+#ifdef __linux__
+        if (ring) {
+            while (b.state == READING)
+                reap();
+            b.state = INUSE;
+        }
+        else
+#endif
+        {
+        std::unique_lock<std::mutex> lock(sync->mtx);
+        sync->cv.wait(lock, [&b]() { return b.state == FILLED; });
+        b.state = INUSE;
+        }
+        if (b.size == 0)
+            return NULL;
+        nextblock = (nextblock + 1) % blocks.size();
+        return &b;
+    }
+
+    /*
+     *  the caller is done with this block, it can be reused.
+     */
+    void release(block *b)
+    {
+        size_t i = b - blocks.data();
+#ifdef __linux__
+        if (ring) {
+            submit(i);
+            return;
+        }
+#endif
+        {
+        std::lock_guard<std::mutex> lock(sync->mtx);
+        b->state = FREE;
+        }
+        sync->cv.notify_all();
+    }
+
+private:
+    static void readerthread(std::shared_ptr<shared> sync, int fd, bool ownfd, size_t blocksize, uint64_t minhole, uint64_t filesize)
+    {
+        struct closer {
+            int fd;
+            ~closer() { if (fd != -1) close(fd); }
+        } c{ ownfd ? fd : -1 };
+        uint64_t offset = minhole ? lseek(fd, 0, SEEK_CUR) : 0;
+        for (size_t i = 0 ; ; i = (i + 1) % sync->blocks.size()) {
+            auto & b = sync->blocks[i];
+            {
+            std::unique_lock<std::mutex> lock(sync->mtx);
+            sync->cv.wait(lock, [&]() { return sync->stop || b.state == FREE; });
+            if (sync->stop)
+                return;
+            }
+
+            if (minhole) {
+                auto data = nextdata(fd, offset, filesize, minhole);
+                if (data != offset)
+                    lseek(fd, data, SEEK_SET);
+                offset = data;
+            }
+            int n;
+            do {
+                n = ::read(fd, b.data, blocksize);
+            } while (n < 0 && errno == EINTR);
+
+            {
+            std::lock_guard<std::mutex> lock(sync->mtx);
+            b.size = n > 0 ? n : 0;
+            b.offset = offset;
+            b.state = FILLED;
+            }
+            offset += n > 0 ? n : 0;
+            sync->cv.notify_all();
+            if (n <= 0)
+                return;
+        }
+    }
+
+#ifdef __linux__
+    void submit(size_t i)
+    {
+        auto & b = blocks[i];
+        if (minhole && readoffset < filesize)
+            readoffset = nextdata(fd, readoffset, filesize, minhole);
+        b.offset = readoffset;
+        b.size = 0;
+        if (readoffset >= filesize) {
+            // past the end: an empty block marks the end of the file.
+            b.state = FILLED;
+            return;
+        }
+        b.state = READING;
+        size_t want = std::min<uint64_t>(blocksize, filesize - readoffset);
+        readoffset += want;
+        if (!ring->submitread(fd, b.data, want, b.offset, i)) {
+            completeread(i, pread(fd, b.data, want, b.offset));
+            return;
+        }
+        inflight++;
+    }
+    void reap()
+    {
+        uint64_t id;
+        int result;
+        if (!ring->waitcompletion(id, result))
+            throw std::runtime_error("io_uring wait failed");
+        inflight--;
+        completeread(id, result);
+    }
+    void completeread(size_t i, int result)
+    {
+        auto & b = blocks[i];
+        size_t want = std::min<uint64_t>(blocksize, filesize - b.offset);
+        if (result < 0)
+            result = pread(fd, b.data, want, b.offset);
+        if (result < 0)
+            result = 0;
+
+        // complete a short read synchronously, the next block was already requested.
+        while (size_t(result) < want) {
+            auto n = pread(fd, b.data + result, want - result, b.offset + result);
+            if (n <= 0)
+                break;
+            result += n;
+        }
+        b.size = result;
+        b.state = FILLED;
+    }
+#endif
+};
@@ -0,0 +1,180 @@
+#pragma once
+/*
+ * Performance counters, reported with --stats when findstr exits.
+ *
+ * Author: (C) 2004-2019  Willem Hengeveld <itsme@xs4all.nl>
+ *
+ * The counters are shared by all search threads. Counts which change for
+ * every candidate are kept per thread in 'threadstats', and added to the
+ * shared counters after each search call.
+ *
+ * Times are in nanoseconds, the io, search and output times are summed over
+ * all threads. The search time of mapped files includes the page faults,
+ * since these happen while searching.
+ */
+#include <cpputils/formatter.h>
+
+#include <atomic>
+#include <mutex>
+#include <map>
+#include <string>
+#include <chrono>
+#include <cstdio>
+
+struct threadcounters {
+    uint64_t candidates = 0;    // positions verified by the searcher
+    uint64_t outputtime = 0;    // time spent writing results
+};
+inline thread_local threadcounters threadstats;
+
+struct searchstats {
+    std::atomic<uint64_t> filesopened{0};
+    std::atomic<uint64_t> filesskipped{0};      // larger than -M
+    uint64_t dirs = 0;                          // directories listed by -r
+    uint64_t excluded = 0;                      // files and directories excluded with -X, --include, etc
+    uint64_t duplicates = 0;                    // hard links, and directories seen before
+    std::atomic<uint64_t> bytesread{0};
+    std::atomic<uint64_t> bytesmapped{0};
+    std::atomic<uint64_t> bytesdecompressed{0};
+    std::atomic<uint64_t> holebytes{0};         // not searched: holes in sparse files
+    std::atomic<uint64_t> zerobytes{0};         // not searched: zero filled blocks, with --skip-zeros
+
+    uint64_t compiletime = 0;
+    std::atomic<uint64_t> iotime{0};            // waiting for read ahead, or process memory
+    std::atomic<uint64_t> decompresstime{0};    // waiting for decompressed data
+    std::atomic<uint64_t> searchtime{0};        // in the searcher, excluding the output
+    std::atomic<uint64_t> outputtime{0};
+
+    std::string engine;
+    bool countscandidates = false;              // the engine filters candidates before verifying them
+    std::atomic<uint64_t> candidates{0};
+    std::atomic<uint64_t> matches{0};           // reported by the engine, including those in overlapping chunks
+
+    std::atomic<uint64_t> blocks{0};            // searched by the sequential search
+    std::atomic<uint64_t> carries{0};           // blocks of which the tail was searched again
+    std::atomic<uint64_t> carrybytes{0};
+
+    struct threadusage {
+        uint64_t tasks = 0;     // files, chunks, or members searched
+        uint64_t busy = 0;
+    };
+    std::mutex mtx;
+    std::map<std::string, threadusage> threads;
+
+    uint64_t starttime = now();
+
+    static uint64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /*
+     *  adds the time from construction to destruction to 'counter',
+     *  does nothing for a NULL counter.
+     */
+    class timer {
+        std::atomic<uint64_t> *counter;
+        uint64_t *local;
+        uint64_t t0;
+    public:
+        timer(std::atomic<uint64_t> *counter, uint64_t *local = NULL)
+            : counter(counter), local(local), t0(counter ? now() : 0)
+        {
+        }
+        ~timer()
+        {
+            if (!counter)
+                return;
+            auto t = now() - t0;
+            *counter += t;
+            if (local)
+                *local += t;
+        }
+    };
+
+    // threads with the same name, like those searching chunks, are added together.
+    void addthread(const std::string& name, uint64_t tasks, uint64_t busy)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto & u = threads[name];
+        u.tasks += tasks;
+        u.busy += busy;
+    }
+
+    void report(bool json)
+    {
+        auto s = json ? jsonreport() : textreport();
+        fwrite(s.data(), 1, s.size(), stderr);
+    }
+
+    std::string textreport()
+    {
+        auto wall = now() - starttime;
+        auto ms = [](uint64_t t) { return t / 1e6; };
+        std::string s;
+        s += stringformat("files:       %d opened, %d skipped by -M\n", filesopened.load(), filesskipped.load());
+        if (dirs)
+            s += stringformat("walk:        %d directories, %d excluded, %d duplicates\n", dirs, excluded, duplicates);
+        s += stringformat("bytes:       %d read, %d mapped, %d decompressed\n", bytesread.load(), bytesmapped.load(), bytesdecompressed.load());
+        if (holebytes || zerobytes)
+            s += stringformat("skipped:     %d bytes in holes, %d bytes in zero blocks\n", holebytes.load(), zerobytes.load());
+        s += stringformat("time:        total %.3f ms, compile %.3f ms\n", ms(wall), ms(compiletime));
+        s += stringformat("thread time: io %.3f ms, decompress %.3f ms, search %.3f ms, output %.3f ms\n",
+                ms(iotime), ms(decompresstime), ms(searchtime), ms(outputtime));
+        if (countscandidates)
+            s += stringformat("engine:      %s, %d candidates, %d matches\n", engine, candidates.load(), matches.load());
+        else
+            s += stringformat("engine:      %s, %d matches\n", engine, matches.load());
+        if (blocks)
+            s += stringformat("carry:       %d bytes, in %d of %d blocks\n", carrybytes.load(), carries.load(), blocks.load());
+        std::lock_guard<std::mutex> lock(mtx);
+        for (auto & [name, u] : threads)
+            s += stringformat("thread:      %-10s %6d tasks, busy %.3f ms, %.0f%%\n", name, u.tasks, ms(u.busy), wall ? 100.0 * u.busy / wall : 0.0);
+        return s;
+    }
+
+    std::string jsonreport()
+    {
+        auto wall = now() - starttime;
+        std::string s = "{";
+        auto add = [&s](const char *name, uint64_t value) {
+            if (s.size() > 1)
+                s += ",";
+            s += stringformat("\"%s\":%d", name, value);
+        };
+        add("files_opened", filesopened);
+        add("files_skipped", filesskipped);
+        add("dirs", dirs);
+        add("excluded", excluded);
+        add("duplicates", duplicates);
+        add("bytes_read", bytesread);
+        add("bytes_mapped", bytesmapped);
+        add("bytes_decompressed", bytesdecompressed);
+        add("hole_bytes", holebytes);
+        add("zero_bytes", zerobytes);
+        add("compile_ns", compiletime);
+        add("io_ns", iotime);
+        add("decompress_ns", decompresstime);
+        add("search_ns", searchtime);
+        add("output_ns", outputtime);
+        add("total_ns", wall);
+        s += stringformat(",\"engine\":\"%s\"", engine);
+        if (countscandidates)
+            add("candidates", candidates);
+        add("matches", matches);
+        add("blocks", blocks);
+        add("carries", carries);
+        add("carry_bytes", carrybytes);
+        s += ",\"threads\":[";
+        std::lock_guard<std::mutex> lock(mtx);
+        bool first = true;
+        for (auto & [name, u] : threads) {
+            if (!first)
+                s += ",";
+            s += stringformat("{\"name\":\"%s\",\"tasks\":%d,\"busy_ns\":%d}", name, u.tasks, u.busy);
+            first = false;
+        }
+        s += "]}\n";
+        return s;
+    }
+};